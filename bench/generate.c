@@ -0,0 +1,353 @@
+#include "generate.h"
+
+#include "libs/util/util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <ftw.h>
+#include <git2.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define GENERATED_LINE_SIZE 64U
+#define SUBDIRECTORIES 8U
+#define MODIFIED_LINE_STRIDE 8U
+#define PATCH_DIRECTORIES 64U
+#define PATCH_CONTEXT_LINES 3U
+#define PATCH_HUNK_GAP 20U
+
+void bench_repo_spec_defaults(bench_repo_spec *spec)
+{
+	*spec = (bench_repo_spec){
+		.files = 2000U,
+		.modified = 200U,
+		.untracked = 50U,
+		.directories = 32U,
+		.file_size = 4096U,
+		.binary_percent = 5U,
+		.seed = 1U,
+	};
+}
+
+void bench_patch_spec_defaults(bench_patch_spec *spec)
+{
+	*spec = (bench_patch_spec){
+		.files = 1000U,
+		.hunks = 4U,
+		.lines = 8U,
+		.seed = 1U,
+	};
+}
+
+// splitmix64: cheap, seedable and identical on every platform
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static bool is_binary(const bench_repo_spec *spec, size_t index)
+{
+	uint64_t state = spec->seed ^ (index * 0x2545f4914f6cdd1dULL);
+	return next_random(&state) % 100U < spec->binary_percent;
+}
+
+void bench_repo_path(const bench_repo_spec *spec, size_t index, char *buffer,
+		     size_t size)
+{
+	const size_t directories = spec->directories ? spec->directories : 1U;
+	utils_format_message(
+		(message_buf){buffer, size}, "dir%03zu/sub%zu/file%06zu.%s",
+		index % directories,
+		(index / directories) % SUBDIRECTORIES, index,
+		is_binary(spec, index) ? "bin" : "txt");
+}
+
+static void untracked_path(const bench_repo_spec *spec, size_t index,
+			   char *buffer, size_t size)
+{
+	const size_t directories = spec->directories ? spec->directories : 1U;
+	utils_format_message((message_buf){buffer, size},
+			     "dir%03zu/new%06zu.txt", index % directories,
+			     index);
+}
+
+static int make_parents(const char *path)
+{
+	char buffer[PATH_MAX];
+	if (strlen(path) >= sizeof(buffer)) {
+		return -1;
+	}
+	strcpy(buffer, path);
+	for (char *slash = strchr(buffer + 1, '/'); slash;
+	     slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(buffer, 0755) != 0 && errno != EEXIST) {
+			return -1;
+		}
+		*slash = '/';
+	}
+	return 0;
+}
+
+// Text files are numbered lines so that every generated diff has stable
+// hunk boundaries; a modified file rewrites every eighth line and grows.
+static bool write_text(FILE *file, const bench_repo_spec *spec,
+		       size_t index, bool modified)
+{
+	uint64_t state = spec->seed + index;
+	const size_t lines = spec->file_size / GENERATED_LINE_SIZE + 1U;
+	const size_t total = modified ? lines + lines / 16U + 1U : lines;
+	for (size_t line = 0; line < total; ++line) {
+		uint64_t token = next_random(&state);
+		const bool changed =
+			modified && (line % MODIFIED_LINE_STRIDE == 3U ||
+				     line >= lines);
+		if (changed) {
+			token = ~token;
+		}
+		if (fprintf(file, "%06zu:%06zu %016llx %s\n", index, line,
+			    (unsigned long long)token,
+			    changed ? "changed by the benchmark generator"
+				    : "synthetic benchmark payload line") <
+		    0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool write_binary(FILE *file, const bench_repo_spec *spec,
+			 size_t index, bool modified)
+{
+	uint64_t state = spec->seed + index;
+	unsigned char chunk[256];
+	for (size_t written = 0; written < spec->file_size;) {
+		for (size_t i = 0; i < sizeof(chunk); i += sizeof(uint64_t)) {
+			const uint64_t value = next_random(&state);
+			memcpy(&chunk[i], &value, sizeof(value));
+		}
+		chunk[0] = '\0'; // keeps the content detected as binary
+		if (modified && written == 0U) {
+			chunk[1] ^= 0xffU;
+		}
+		size_t count = spec->file_size - written;
+		if (count > sizeof(chunk)) {
+			count = sizeof(chunk);
+		}
+		if (fwrite(chunk, 1, count, file) != count) {
+			return false;
+		}
+		written += count;
+	}
+	return true;
+}
+
+static int write_file(const char *directory, const char *relative,
+		      const bench_repo_spec *spec, size_t index,
+		      bool binary, bool modified)
+{
+	FORMAT_MSG(path, PATH_MAX, "%s/%s", directory, relative);
+	if (make_parents(path) != 0) {
+		fprintf(stderr, "Error: unable to create parents of %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Error: unable to create %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	bool ok = binary ? write_binary(file, spec, index, modified)
+			 : write_text(file, spec, index, modified);
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Error: unable to write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int report_git_error(const char *context, int error_code)
+{
+	const git_error *err = git_error_last();
+	fprintf(stderr, "%s: %s (code %d)\n", context,
+		err && err->message ? err->message : "libgit2 error",
+		error_code);
+	return error_code;
+}
+
+static int commit_baseline(git_repository *repo, const bench_repo_spec *spec)
+{
+	git_index *index = nullptr;
+	git_tree *tree = nullptr;
+	git_signature *signature = nullptr;
+	git_oid tree_id;
+	git_oid commit_id;
+
+	int rc = git_repository_index(&index, repo);
+	for (size_t i = 0; rc == 0 && i < spec->files; ++i) {
+		char relative[PATH_MAX];
+		bench_repo_path(spec, i, relative, sizeof(relative));
+		rc = git_index_add_bypath(index, relative);
+	}
+	if (rc == 0) {
+		rc = git_index_write(index);
+	}
+	if (rc == 0) {
+		rc = git_index_write_tree(&tree_id, index);
+	}
+	if (rc == 0) {
+		rc = git_tree_lookup(&tree, repo, &tree_id);
+	}
+	if (rc == 0) {
+		// a fixed timestamp keeps the generated history reproducible
+		rc = git_signature_new(&signature, "patchutils bench",
+				       "bench@patchutils.invalid", 0, 0);
+	}
+	if (rc == 0) {
+		rc = git_commit_create_v(&commit_id, repo, "HEAD", signature,
+					 signature, nullptr,
+					 "Synthetic baseline\n", tree, 0);
+	}
+	if (rc < 0) {
+		report_git_error("Unable to commit the baseline", rc);
+	}
+
+	git_signature_free(signature);
+	git_tree_free(tree);
+	git_index_free(index);
+	return rc;
+}
+
+int bench_generate_repo(const bench_repo_spec *spec, const char *directory)
+{
+	assert(spec);
+	assert(directory);
+
+	if (spec->modified > spec->files) {
+		fprintf(stderr, "Error: cannot modify %zu of %zu files\n",
+			spec->modified, spec->files);
+		return -1;
+	}
+	if (mkdir(directory, 0755) != 0) {
+		fprintf(stderr, "Error: unable to create %s: %s\n", directory,
+			strerror(errno));
+		return -1;
+	}
+
+	git_repository *repo = nullptr;
+	int rc = git_repository_init(&repo, directory, false);
+	if (rc < 0) {
+		return report_git_error("Unable to initialize the repository",
+					rc);
+	}
+
+	char relative[PATH_MAX];
+	for (size_t i = 0; rc == 0 && i < spec->files; ++i) {
+		bench_repo_path(spec, i, relative, sizeof(relative));
+		rc = write_file(directory, relative, spec, i,
+				is_binary(spec, i), false);
+	}
+	if (rc == 0) {
+		rc = commit_baseline(repo, spec);
+	}
+	for (size_t i = 0; rc == 0 && i < spec->modified; ++i) {
+		bench_repo_path(spec, i, relative, sizeof(relative));
+		rc = write_file(directory, relative, spec, i,
+				is_binary(spec, i), true);
+	}
+	for (size_t i = 0; rc == 0 && i < spec->untracked; ++i) {
+		untracked_path(spec, i, relative, sizeof(relative));
+		rc = write_file(directory, relative, spec, spec->files + i,
+				false, false);
+	}
+
+	git_repository_free(repo);
+	return rc;
+}
+
+static bool write_patch_lines(FILE *output, char prefix, size_t file,
+			      size_t first, size_t count, uint64_t *state)
+{
+	for (size_t line = first; line < first + count; ++line) {
+		if (fprintf(output, "%c%06zu:%06zu %016llx\n", prefix, file,
+			    line, (unsigned long long)next_random(state)) < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int bench_generate_patch(const bench_patch_spec *spec, FILE *output)
+{
+	assert(spec);
+	assert(output);
+
+	uint64_t state = spec->seed;
+	const size_t span = 2U * PATCH_CONTEXT_LINES + spec->lines;
+	bool ok = true;
+	for (size_t file = 0; ok && file < spec->files; ++file) {
+		char path[PATH_MAX];
+		FORMAT_MSG_INTO(path, "dir%03zu/file%06zu.c",
+				file % PATCH_DIRECTORIES, file);
+		ok = fprintf(output,
+			     "diff --git a/%s b/%s\n"
+			     "index 1111111..2222222 100644\n"
+			     "--- a/%s\n"
+			     "+++ b/%s\n",
+			     path, path, path, path) > 0;
+
+		for (size_t hunk = 0; ok && hunk < spec->hunks; ++hunk) {
+			const size_t start =
+				1U + hunk * (span + PATCH_HUNK_GAP);
+			const size_t changed = start + PATCH_CONTEXT_LINES;
+			ok = fprintf(output, "@@ -%zu,%zu +%zu,%zu @@\n", start,
+				     span, start, span) > 0 &&
+			     write_patch_lines(output, ' ', file, start,
+					       PATCH_CONTEXT_LINES, &state) &&
+			     write_patch_lines(output, '-', file, changed,
+					       spec->lines, &state) &&
+			     write_patch_lines(output, '+', file, changed,
+					       spec->lines, &state) &&
+			     write_patch_lines(output, ' ', file,
+					       changed + spec->lines,
+					       PATCH_CONTEXT_LINES, &state);
+		}
+	}
+	if (!ok || ferror(output)) {
+		fprintf(stderr, "Error: unable to write the synthetic patch\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+			struct FTW *ftw)
+{
+	(void)st;
+	(void)type;
+	(void)ftw;
+	return remove(path);
+}
+
+int bench_remove_tree(const char *path)
+{
+	struct stat st;
+	if (lstat(path, &st) != 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+		fprintf(stderr, "Error: unable to remove %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Shape of a synthetic working tree. Files are spread over |directories|
+// top-level directories, committed once, and then the first |modified| of
+// them are rewritten in place; |untracked| new files are added on top.
+typedef struct {
+	size_t files;
+	size_t modified;
+	size_t untracked;
+	size_t directories;
+	size_t file_size;	 // approximate bytes per file
+	unsigned binary_percent; // share of files written as binary blobs
+	uint64_t seed;
+} bench_repo_spec;
+
+// Shape of a synthetic git-style patch: |files| sections of |hunks| hunks,
+// each changing |lines| lines between three lines of context.
+typedef struct {
+	size_t files;
+	size_t hunks;
+	size_t lines;
+	uint64_t seed;
+} bench_patch_spec;
+
+void bench_repo_spec_defaults(bench_repo_spec *spec);
+void bench_patch_spec_defaults(bench_patch_spec *spec);
+
+// Relative path of file |index| in a repository generated from |spec|.
+void bench_repo_path(const bench_repo_spec *spec, size_t index, char *buffer,
+		     size_t size);
+// Creates the repository in |directory|, which must not exist yet.
+int bench_generate_repo(const bench_repo_spec *spec, const char *directory);
+int bench_generate_patch(const bench_patch_spec *spec, FILE *output);
+// Removes |path| and everything below it; a missing path is not an error.
+int bench_remove_tree(const char *path);
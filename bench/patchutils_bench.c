@@ -0,0 +1,595 @@
+#include "generate.h"
+
+#include "libs/git/git.h"
+#include "libs/patch/patch.h"
+#include "libs/util/util.h"
+
+#include <errno.h>
+#include <git2.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_REPEAT 5U
+#define DEFAULT_WORK_DIR "bench-work"
+#define UI_SIZE "40x120"
+
+// Key script for the update-patch flow: add every available file, mark
+// every section for refresh, then finalize. Each screen ends in a message
+// box that Enter dismisses.
+static const char update_patch_keys[] = "# generated by patchutils-bench\n"
+					"<Enter>a<Enter><Enter>\n"
+					"<Down*2><Enter>a<Enter><Enter>\n"
+					"<Down*3><Enter><Enter>\n";
+
+typedef struct {
+	bench_repo_spec repo;
+	bench_patch_spec patch;
+	size_t repeat;
+	const char *work_dir;
+	const char *json_path;
+	const char *tool;
+} bench_options;
+
+typedef struct {
+	const bench_options *options;
+	char work[PATH_MAX]; // absolute scratch directory of this benchmark
+	double *samples;
+	size_t sample_count;
+	size_t sample_capacity;
+	size_t items; // units of work per sample, for per-item comparisons
+	double ui_ms; // key handling time reported by the headless UI
+	bool has_ui_ms;
+} bench_run;
+
+typedef struct {
+	const char *name;
+	bool needs_tool;
+	int (*run)(bench_run *run);
+} bench_case;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s gen-repo <dir> [options]\n"
+		"       %s gen-patch <file> [options]\n"
+		"       %s run <benchmark> [options]\n"
+		"\n"
+		"Benchmarks: patch_parse, collect_status, write_diff,\n"
+		"            split_patch, update_patch\n"
+		"\n"
+		"Repository:  --files N --modified N --untracked N\n"
+		"             --directories N --size BYTES --binary PERCENT\n"
+		"Patch:       --files N --hunks N --lines N\n"
+		"Common:      --seed N\n"
+		"Run:         --repeat N --work-dir DIR --json FILE\n"
+		"             --tool PATH (split-patch or update-patch)\n",
+		prog, prog, prog);
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static bool parse_count(const char *text, size_t *out)
+{
+	char *end = nullptr;
+	errno = 0;
+	const unsigned long long value = strtoull(text, &end, 10);
+	if (errno != 0 || end == text || *end != '\0' || text[0] == '-') {
+		return false;
+	}
+	*out = (size_t)value;
+	return true;
+}
+
+static bool parse_options(int argc, char **argv, bench_options *options)
+{
+	bench_repo_spec_defaults(&options->repo);
+	bench_patch_spec_defaults(&options->patch);
+	options->repeat = DEFAULT_REPEAT;
+	options->work_dir = DEFAULT_WORK_DIR;
+
+	for (int i = 0; i < argc; ++i) {
+		const char *name = argv[i];
+		if (i + 1 >= argc) {
+			fprintf(stderr, "Error: %s needs a value\n", name);
+			return false;
+		}
+		const char *value = argv[++i];
+		size_t count = 0U;
+
+		if (strcmp(name, "--work-dir") == 0) {
+			options->work_dir = value;
+			continue;
+		}
+		if (strcmp(name, "--json") == 0) {
+			options->json_path = value;
+			continue;
+		}
+		if (strcmp(name, "--tool") == 0) {
+			options->tool = value;
+			continue;
+		}
+		if (!parse_count(value, &count)) {
+			fprintf(stderr, "Error: invalid value for %s: %s\n",
+				name, value);
+			return false;
+		}
+		if (strcmp(name, "--files") == 0) {
+			options->repo.files = count;
+			options->patch.files = count;
+		} else if (strcmp(name, "--modified") == 0) {
+			options->repo.modified = count;
+		} else if (strcmp(name, "--untracked") == 0) {
+			options->repo.untracked = count;
+		} else if (strcmp(name, "--directories") == 0) {
+			options->repo.directories = count;
+		} else if (strcmp(name, "--size") == 0) {
+			options->repo.file_size = count;
+		} else if (strcmp(name, "--binary") == 0 && count <= 100U) {
+			options->repo.binary_percent = (unsigned)count;
+		} else if (strcmp(name, "--hunks") == 0) {
+			options->patch.hunks = count;
+		} else if (strcmp(name, "--lines") == 0) {
+			options->patch.lines = count;
+		} else if (strcmp(name, "--seed") == 0) {
+			options->repo.seed = count;
+			options->patch.seed = count;
+		} else if (strcmp(name, "--repeat") == 0 && count > 0U) {
+			options->repeat = count;
+		} else {
+			fprintf(stderr, "Error: unknown option %s %s\n", name,
+				value);
+			return false;
+		}
+	}
+	return true;
+}
+
+static int write_patch_file(const bench_patch_spec *spec, const char *path)
+{
+	FILE *output = fopen(path, "w");
+	if (!output) {
+		fprintf(stderr, "Error: unable to create %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	int rc = bench_generate_patch(spec, output);
+	if (fclose(output) != 0 && rc == 0) {
+		fprintf(stderr, "Error: unable to write %s\n", path);
+		rc = -1;
+	}
+	return rc;
+}
+
+static int write_text_file(const char *path, const char *text)
+{
+	FILE *output = fopen(path, "w");
+	if (!output) {
+		fprintf(stderr, "Error: unable to create %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	const size_t length = strlen(text);
+	const bool ok = fwrite(text, 1, length, output) == length;
+	return fclose(output) == 0 && ok ? 0 : -1;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+	FILE *input = fopen(from, "rb");
+	FILE *output = input ? fopen(to, "wb") : nullptr;
+	bool ok = input && output;
+	char chunk[65536];
+	size_t got;
+	while (ok && (got = fread(chunk, 1, sizeof(chunk), input)) > 0) {
+		ok = fwrite(chunk, 1, got, output) == got;
+	}
+	ok = ok && !ferror(input);
+	if (input) {
+		fclose(input);
+	}
+	if (output && fclose(output) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "Error: unable to copy %s to %s\n", from, to);
+	}
+	return ok ? 0 : -1;
+}
+
+// Runs |argv| in |directory| with stdout discarded. |script| and |record|
+// select the headless UI when they are not nullptr.
+static int run_tool(char *const argv[], const char *directory,
+		    const char *script, const char *record)
+{
+	const pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		FILE *null_out = freopen("/dev/null", "w", stdout);
+		if (!null_out || chdir(directory) != 0) {
+			_exit(127);
+		}
+		if (script) {
+			setenv("PATCHUTILS_UI_SCRIPT", script, 1);
+			setenv("PATCHUTILS_UI_RECORD", record, 1);
+			setenv("PATCHUTILS_UI_SIZE", UI_SIZE, 1);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, "Error: waitpid failed: %s\n",
+				strerror(errno));
+			return -1;
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Error: %s failed (status %d)\n", argv[0],
+			status);
+		return -1;
+	}
+	return 0;
+}
+
+static bool sample(bench_run *run, double started)
+{
+	if (!utils_array_reserve((void **)&run->samples, &run->sample_capacity,
+				 run->sample_count + 1U,
+				 sizeof(*run->samples))) {
+		return false;
+	}
+	run->samples[run->sample_count++] = now_ms() - started;
+	return true;
+}
+
+static bool count_section(const patch_section *section, void *userdata)
+{
+	(void)section;
+	++*(size_t *)userdata;
+	return true;
+}
+
+static int bench_patch_parse(bench_run *run)
+{
+	FORMAT_MSG(input_path, PATH_MAX, "%s/input.patch", run->work);
+	if (write_patch_file(&run->options->patch, input_path) != 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < run->options->repeat; ++i) {
+		const double started = now_ms();
+		FILE *input = fopen(input_path, "r");
+		size_t sections = 0U;
+		const bool ok =
+			input && patch_parse(input, count_section, &sections);
+		if (input) {
+			fclose(input);
+		}
+		if (!ok || !sample(run, started)) {
+			fprintf(stderr, "Error: unable to parse %s\n",
+				input_path);
+			return -1;
+		}
+		run->items = sections;
+	}
+	return 0;
+}
+
+static int open_fixture_repo(bench_run *run, git_repository **out_repo)
+{
+	FORMAT_MSG(repo_path, PATH_MAX, "%s/repo", run->work);
+	if (bench_generate_repo(&run->options->repo, repo_path) != 0) {
+		return -1;
+	}
+	const int rc = gitutils_open_repository(out_repo, repo_path);
+	if (rc < 0) {
+		fprintf(stderr, "Error: unable to open %s (code %d)\n",
+			repo_path, rc);
+	}
+	return rc;
+}
+
+static int bench_collect_status(bench_run *run)
+{
+	git_repository *repo = nullptr;
+	int rc = open_fixture_repo(run, &repo);
+
+	for (size_t i = 0; rc == 0 && i < run->options->repeat; ++i) {
+		gitutils_status_list list = {0};
+		const double started = now_ms();
+		rc = gitutils_collect_status(repo, &list);
+		if (rc == 0 && !sample(run, started)) {
+			rc = -1;
+		}
+		run->items = list.count;
+		gitutils_status_list_free(&list);
+	}
+
+	git_repository_free(repo);
+	return rc;
+}
+
+static int bench_write_diff(bench_run *run)
+{
+	git_repository *repo = nullptr;
+	gitutils_status_list list = {0};
+	int rc = open_fixture_repo(run, &repo);
+	if (rc == 0) {
+		rc = gitutils_collect_status(repo, &list);
+	}
+	FILE *sink = rc == 0 ? fopen("/dev/null", "w") : nullptr;
+	if (rc == 0 && !sink) {
+		rc = -1;
+	}
+
+	for (size_t i = 0; rc == 0 && i < run->options->repeat; ++i) {
+		const double started = now_ms();
+		for (size_t j = 0; rc == 0 && j < list.count; ++j) {
+			bool has_changes = false;
+			rc = gitutils_write_diff_for_path(
+				repo, list.entries[j].path, sink, &has_changes);
+		}
+		if (rc == 0 && !sample(run, started)) {
+			rc = -1;
+		}
+		run->items = list.count;
+	}
+
+	if (sink) {
+		fclose(sink);
+	}
+	gitutils_status_list_free(&list);
+	git_repository_free(repo);
+	return rc;
+}
+
+static int bench_split_patch(bench_run *run)
+{
+	FORMAT_MSG(input_path, PATH_MAX, "%s/input.patch", run->work);
+	FORMAT_MSG(output_dir, PATH_MAX, "%s/out", run->work);
+	if (write_patch_file(&run->options->patch, input_path) != 0) {
+		return -1;
+	}
+
+	char *argv[] = {(char *)run->options->tool, input_path, nullptr};
+	for (size_t i = 0; i < run->options->repeat; ++i) {
+		if (bench_remove_tree(output_dir) != 0 ||
+		    mkdir(output_dir, 0755) != 0) {
+			return -1;
+		}
+		const double started = now_ms();
+		if (run_tool(argv, output_dir, nullptr, nullptr) != 0 ||
+		    !sample(run, started)) {
+			return -1;
+		}
+	}
+	run->items = run->options->patch.files;
+	return 0;
+}
+
+static bool read_ui_summary(const char *record_path, double *out_ms)
+{
+	FILE *record = fopen(record_path, "r");
+	if (!record) {
+		return false;
+	}
+	char line[512];
+	bool found = false;
+	while (fgets(line, sizeof(line), record)) {
+		size_t keys = 0U;
+		if (sscanf(line, "{\"summary\":{\"keys\":%zu,\"total_ms\":%lf",
+			   &keys, out_ms) == 2) {
+			found = true;
+		}
+	}
+	fclose(record);
+	return found;
+}
+
+static int bench_update_patch(bench_run *run)
+{
+	git_repository *repo = nullptr;
+	gitutils_status_list list = {0};
+	int rc = open_fixture_repo(run, &repo);
+	if (rc == 0) {
+		rc = gitutils_collect_status(repo, &list);
+	}
+
+	// the starting patch holds every other changed file, so both the
+	// Add and the Update screens have work to do
+	FORMAT_MSG(base_path, PATH_MAX, "%s/base.patch", run->work);
+	FILE *base = rc == 0 ? fopen(base_path, "w") : nullptr;
+	if (rc == 0 && !base) {
+		rc = -1;
+	}
+	for (size_t i = 0; rc == 0 && i < list.count; i += 2U) {
+		bool has_changes = false;
+		rc = gitutils_write_diff_for_path(repo, list.entries[i].path,
+						  base, &has_changes);
+	}
+	if (base && fclose(base) != 0) {
+		rc = -1;
+	}
+	run->items = list.count;
+	gitutils_status_list_free(&list);
+	git_repository_free(repo);
+	if (rc != 0) {
+		return rc;
+	}
+
+	FORMAT_MSG(script_path, PATH_MAX, "%s/update.keys", run->work);
+	FORMAT_MSG(record_path, PATH_MAX, "%s/update.jsonl", run->work);
+	FORMAT_MSG(patch_path, PATH_MAX, "%s/current.patch", run->work);
+	FORMAT_MSG(repo_path, PATH_MAX, "%s/repo", run->work);
+	if (write_text_file(script_path, update_patch_keys) != 0) {
+		return -1;
+	}
+
+	char *argv[] = {(char *)run->options->tool, patch_path, nullptr};
+	for (size_t i = 0; i < run->options->repeat; ++i) {
+		if (copy_file(base_path, patch_path) != 0) {
+			return -1;
+		}
+		const double started = now_ms();
+		if (run_tool(argv, repo_path, script_path, record_path) != 0 ||
+		    !sample(run, started)) {
+			return -1;
+		}
+		run->has_ui_ms = read_ui_summary(record_path, &run->ui_ms);
+	}
+	return 0;
+}
+
+static const bench_case bench_cases[] = {
+	{"patch_parse", false, bench_patch_parse},
+	{"collect_status", false, bench_collect_status},
+	{"write_diff", false, bench_write_diff},
+	{"split_patch", true, bench_split_patch},
+	{"update_patch", true, bench_update_patch},
+};
+
+static int compare_doubles(const void *lhs, const void *rhs)
+{
+	const double a = *(const double *)lhs;
+	const double b = *(const double *)rhs;
+	return (a > b) - (a < b);
+}
+
+static void write_result(FILE *out, const char *name, const bench_run *run)
+{
+	const bench_options *options = run->options;
+	double total = 0.0;
+	for (size_t i = 0; i < run->sample_count; ++i) {
+		total += run->samples[i];
+	}
+	const size_t n = run->sample_count;
+	const double median = n % 2U ? run->samples[n / 2U]
+				     : (run->samples[n / 2U - 1U] +
+					run->samples[n / 2U]) /
+					       2.0;
+
+	fprintf(out,
+		"{\"benchmark\":\"%s\",\"params\":{\"files\":%zu,"
+		"\"modified\":%zu,\"untracked\":%zu,\"directories\":%zu,"
+		"\"size\":%zu,\"binary\":%u,\"hunks\":%zu,\"lines\":%zu,"
+		"\"seed\":%llu},\"repeat\":%zu,\"items\":%zu,"
+		"\"min_ms\":%.3f,\"median_ms\":%.3f,\"mean_ms\":%.3f,"
+		"\"max_ms\":%.3f",
+		name, options->repo.files, options->repo.modified,
+		options->repo.untracked, options->repo.directories,
+		options->repo.file_size, options->repo.binary_percent,
+		options->patch.hunks, options->patch.lines,
+		(unsigned long long)options->repo.seed, n, run->items,
+		run->samples[0], median, total / (double)n,
+		run->samples[n - 1U]);
+	if (run->has_ui_ms) {
+		fprintf(out, ",\"ui_key_ms\":%.3f", run->ui_ms);
+	}
+	fputs("}\n", out);
+}
+
+static int run_benchmark(const char *name, const bench_options *options)
+{
+	const bench_case *found = nullptr;
+	for (size_t i = 0; i < sizeof(bench_cases) / sizeof(*bench_cases);
+	     ++i) {
+		if (strcmp(bench_cases[i].name, name) == 0) {
+			found = &bench_cases[i];
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "Error: unknown benchmark %s\n", name);
+		return 1;
+	}
+	if (found->needs_tool && !options->tool) {
+		fprintf(stderr, "Error: %s needs --tool\n", name);
+		return 1;
+	}
+
+	bench_run run = {.options = options};
+	FORMAT_MSG(work, PATH_MAX, "%s/%s", options->work_dir, name);
+	if (mkdir(options->work_dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: unable to create %s: %s\n",
+			options->work_dir, strerror(errno));
+		return 1;
+	}
+	// fixtures are rebuilt from the spec on every run
+	if (bench_remove_tree(work) != 0 || mkdir(work, 0755) != 0 ||
+	    !realpath(work, run.work)) {
+		fprintf(stderr, "Error: unable to prepare %s\n", work);
+		return 1;
+	}
+
+	int rc = found->run(&run);
+	if (rc == 0 && run.sample_count > 0U) {
+		qsort(run.samples, run.sample_count, sizeof(*run.samples),
+		      compare_doubles);
+		write_result(stdout, name, &run);
+		if (options->json_path) {
+			FILE *json = fopen(options->json_path, "a");
+			if (!json) {
+				fprintf(stderr,
+					"Error: unable to open %s: %s\n",
+					options->json_path, strerror(errno));
+				rc = -1;
+			} else {
+				write_result(json, name, &run);
+				fclose(json);
+			}
+		}
+	}
+	utils_free(run.samples);
+	return rc == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	bench_options options = {0};
+	if (!parse_options(argc - 3, argv + 3, &options)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int rc = gitutils_init();
+	if (rc < 0) {
+		fprintf(stderr, "Failed to initialize libgit2 (code %d)\n", rc);
+		return 1;
+	}
+
+	int ret = 1;
+	if (strcmp(argv[1], "gen-repo") == 0) {
+		ret = bench_generate_repo(&options.repo, argv[2]) == 0 ? 0 : 1;
+	} else if (strcmp(argv[1], "gen-patch") == 0) {
+		ret = write_patch_file(&options.patch, argv[2]) == 0 ? 0 : 1;
+	} else if (strcmp(argv[1], "run") == 0) {
+		ret = run_benchmark(argv[2], &options);
+	} else {
+		usage(argv[0]);
+	}
+
+	git_libgit2_shutdown();
+	return ret;
+}
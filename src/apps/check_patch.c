@@ -0,0 +1,303 @@
+#include "libs/git/git.h"
+#include "libs/patch/patch.h"
+#include "libs/util/compress.h"
+#include "libs/util/trace.h"
+#include "libs/util/util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <git2.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	bool cached;
+	bool quiet;
+	const char *patch_path;
+} check_options;
+
+typedef struct {
+	char *path;
+	size_t offset;
+	size_t length;
+	gitutils_apply_check result;
+	int error;
+} check_job;
+
+typedef struct {
+	char *patch; // the whole patch file; jobs point into it
+	size_t patch_length;
+	check_job *jobs;
+	size_t count;
+	size_t capacity;
+	bool cached;
+	atomic_size_t next; // next job a worker will claim
+} check_batch;
+
+typedef struct {
+	check_batch *batch;
+	git_repository *repo; // borrowed from the pool
+	pthread_t thread;
+} check_worker;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--cached] [--quiet] <patch-file>\n"
+		"\n"
+		"Checks that every section of the patch still applies to the "
+		"working\n"
+		"tree (or the index with --cached) without changing either.\n",
+		prog);
+}
+
+static int parse_arguments(int argc, char **argv, check_options *opts)
+{
+	static const struct option long_options[] = {
+		{"cached", no_argument, nullptr, 'c'},
+		{"quiet", no_argument, nullptr, 'q'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
+	};
+
+	int ch;
+	while ((ch = getopt_long(argc, argv, "cqh", long_options, nullptr)) !=
+	       -1) {
+		switch (ch) {
+		case 'c':
+			opts->cached = true;
+			break;
+		case 'q':
+			opts->quiet = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return -1;
+	}
+	opts->patch_path = argv[optind];
+	return 0;
+}
+
+static void report_git_error(const char *context, int error_code)
+{
+	const git_error *err = git_error_last();
+	if (err && err->message) {
+		fprintf(stderr, "%s: %s (code %d)\n", context, err->message,
+			error_code);
+	} else {
+		fprintf(stderr, "%s: libgit2 error %d\n", context, error_code);
+	}
+}
+
+static bool add_job(const patch_section *section, void *userdata)
+{
+	check_batch *batch = userdata;
+	if (!utils_array_reserve((void **)&batch->jobs, &batch->capacity,
+				 batch->count + 1U, sizeof(*batch->jobs))) {
+		return false;
+	}
+
+	char *path = utils_strdup(section->path);
+	if (!path) {
+		return false;
+	}
+	batch->jobs[batch->count++] = (check_job){
+		.path = path,
+		.offset = section->offset,
+		.length = section->length,
+	};
+	return true;
+}
+
+static void run_job(check_batch *batch, git_repository *repo, size_t index)
+{
+	check_job *job = &batch->jobs[index];
+	TRACE_SCOPE_DETAIL("check.section", job->path);
+	job->error = gitutils_check_apply(repo, batch->patch + job->offset,
+					  job->length, batch->cached,
+					  &job->result);
+}
+
+static void *check_worker_main(void *arg)
+{
+	check_worker *worker = arg;
+	check_batch *batch = worker->batch;
+	for (size_t index; (index = atomic_fetch_add(&batch->next, 1U)) <
+			   batch->count;) {
+		run_job(batch, worker->repo, index);
+	}
+	return nullptr;
+}
+
+// Sections are independent, so they are spread over one repository handle
+// per worker; the calling thread takes whatever the workers leave.
+static void run_checks(git_repository *repo, check_batch *batch)
+{
+	gitutils_diff_pool pool = {0};
+	if (batch->count > 1U) {
+		gitutils_diff_pool_open(repo, batch->count, &pool);
+	}
+	check_worker *workers =
+		pool.count ? utils_calloc(pool.count, sizeof(*workers))
+			   : nullptr;
+
+	size_t started = 0U;
+	for (; workers && started < pool.count; ++started) {
+		workers[started] = (check_worker){
+			.batch = batch,
+			.repo = pool.repos[started],
+		};
+		if (pthread_create(&workers[started].thread, nullptr,
+				   check_worker_main, &workers[started]) != 0) {
+			break;
+		}
+	}
+
+	for (size_t index; (index = atomic_fetch_add(&batch->next, 1U)) <
+			   batch->count;) {
+		run_job(batch, repo, index);
+	}
+
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(workers[i].thread, nullptr);
+	}
+	utils_free(workers);
+	gitutils_diff_pool_dispose(&pool);
+}
+
+static void print_hunk(const gitutils_hunk_check *hunk, size_t index)
+{
+	printf("    hunk %zu @@ -%zu,%zu +%zu,%zu @@ %s\n", index + 1U,
+	       hunk->old_start, hunk->old_lines, hunk->new_start,
+	       hunk->new_lines, hunk->applies ? "applies" : "conflicts");
+}
+
+// Prints one line per section, plus the hunks of those that fail, and
+// returns how many sections do not apply.
+static size_t print_report(const check_batch *batch, bool quiet)
+{
+	size_t failed = 0U;
+	for (size_t i = 0; i < batch->count; ++i) {
+		const check_job *job = &batch->jobs[i];
+		const gitutils_apply_check *result = &job->result;
+		if (job->error == 0 && result->applies) {
+			if (!quiet) {
+				printf("ok       %s\n", job->path);
+			}
+			continue;
+		}
+
+		++failed;
+		if (result->hunk_count == 0U) {
+			printf("%s %s: %s\n",
+			       job->error < 0 ? "error   " : "conflict",
+			       job->path, result->message);
+			continue;
+		}
+		printf("conflict %s: %s\n", job->path, result->message);
+		for (size_t h = 0; h < result->hunk_count; ++h) {
+			print_hunk(&result->hunks[h], h);
+		}
+	}
+	return failed;
+}
+
+static void batch_dispose(check_batch *batch)
+{
+	for (size_t i = 0; i < batch->count; ++i) {
+		utils_free(batch->jobs[i].path);
+		gitutils_apply_check_dispose(&batch->jobs[i].result);
+	}
+	utils_free(batch->jobs);
+	utils_free(batch->patch);
+}
+
+static int run_check_patch(const check_options *opts)
+{
+	check_batch batch = {.cached = opts->cached};
+
+	FILE *file = fopen(opts->patch_path, "rb");
+	FILE *input = file ? utils_decompress_open(file, true, nullptr)
+			   : nullptr;
+	if (!input) {
+		fprintf(stderr, "Error: unable to open %s: %s\n",
+			opts->patch_path, strerror(errno));
+		if (file) {
+			fclose(file);
+		}
+		return 1;
+	}
+	bool ok = utils_read_stream(input, &batch.patch, &batch.patch_length);
+	fclose(input);
+
+	// the sections are indexed and checked straight from the one copy
+	// of the patch in memory
+	ok = ok && patch_scan_buffer(batch.patch, batch.patch_length, add_job,
+				     &batch);
+	if (!ok) {
+		fprintf(stderr, "Error: unable to read %s\n", opts->patch_path);
+		batch_dispose(&batch);
+		return 1;
+	}
+	if (batch.count == 0U) {
+		fprintf(stderr, "No patch sections were found in %s\n",
+			opts->patch_path);
+		batch_dispose(&batch);
+		return 1;
+	}
+
+	int rc = gitutils_init();
+	if (rc < 0) {
+		report_git_error("Failed to initialize libgit2", rc);
+		batch_dispose(&batch);
+		return 1;
+	}
+
+	git_repository *repo = nullptr;
+	rc = gitutils_open_repository(&repo, ".");
+	if (rc < 0) {
+		report_git_error("Not inside a git repository", rc);
+		batch_dispose(&batch);
+		git_libgit2_shutdown();
+		return 1;
+	}
+
+	run_checks(repo, &batch);
+	const size_t failed = print_report(&batch, opts->quiet);
+	if (failed > 0U) {
+		fprintf(stderr, "%zu of %zu sections do not apply\n", failed,
+			batch.count);
+	} else {
+		fprintf(stderr, "All %zu sections apply\n", batch.count);
+	}
+
+	batch_dispose(&batch);
+	git_repository_free(repo);
+	git_libgit2_shutdown();
+	return failed > 0U ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	check_options opts = {0};
+	if (parse_arguments(argc, argv, &opts) < 0) {
+		return 1;
+	}
+	utils_trace_start();
+	utils_mem_report_at_exit();
+
+	return run_check_patch(&opts);
+}
@@ -1,23 +1,44 @@
 #include "libs/git/git.h"
 #include "libs/ui/ui.h"
+#include "libs/util/compress.h"
+#include "libs/util/trace.h"
 #include "libs/util/util.h"
 
-#include <assert.h>
 #include <errno.h>
+#include <getopt.h>
 #include <git2.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+typedef struct {
+	const char *output;
+	const char *compress; // --compress format, already validated
+	bool all;
+	bool batch;
+	char **pathspecs;
+	size_t pathspec_count;
+} create_options;
+
 typedef struct {
 	git_repository *repo;
 	gitutils_status_list status_list;
 	gitutils_status_entry **ordered;
 	ui_list_item *items;
+	ui_selection selection;
+	ui_item_feed *feed; // interactive mode: status streams in here
+	pthread_t loader;
+	bool loader_running;
+	int load_error;
+	gitutils_diffstat_cache *diffstats;
 	FILE *patch_file;
+	const char *compress;
+	char *write_buffer;
 	bool ui_active;
+	bool opened_patch;
 	bool created_patch;
 	char patch_name[512];
 } Context;
@@ -44,18 +65,32 @@ static void report_git_error(const char *context, int error_code)
 
 static int finalize(Context *ctx, bool git_ready, int exit_code)
 {
+	if (ctx->loader_running) {
+		// the feed is closed by now, so the loader stops at its next
+		// entry
+		pthread_join(ctx->loader, nullptr);
+		ctx->loader_running = false;
+	}
+
 	if (ctx->patch_file) {
 		fclose(ctx->patch_file);
 		ctx->patch_file = nullptr;
 	}
 
-	if (!ctx->created_patch && ctx->patch_name[0] != '\0') {
-		int ret = remove(ctx->patch_name);
-		assert(ret);
+	utils_free(ctx->write_buffer);
+	ctx->write_buffer = nullptr;
+
+	if (ctx->opened_patch && !ctx->created_patch) {
+		remove(ctx->patch_name);
 	}
 
-	free(ctx->items);
-	free(ctx->ordered);
+	gitutils_diffstat_cache_free(ctx->diffstats);
+	ctx->diffstats = nullptr;
+	ui_selection_dispose(&ctx->selection);
+	ui_item_feed_free(ctx->feed);
+	ctx->feed = nullptr;
+	utils_free(ctx->items);
+	utils_free(ctx->ordered);
 	gitutils_status_list_free(&ctx->status_list);
 
 	if (ctx->ui_active) {
@@ -73,186 +108,515 @@ static int finalize(Context *ctx, bool git_ready, int exit_code)
 	return exit_code;
 }
 
-static int run_create_patch(void)
+static void usage(const char *prog)
 {
-	Context ctx = {
-		.repo = nullptr,
-		.status_list = {.entries = nullptr, .count = 0U},
-		.ordered = nullptr,
-		.items = nullptr,
-		.patch_file = nullptr,
-		.ui_active = false,
-		.created_patch = false,
-		.patch_name = {0},
+	fprintf(stderr,
+		"Usage: %s [--output -|FILE] [--compress gzip|zstd] [--all] "
+		"[pathspec...]\n"
+		"\n"
+		"Without arguments, files are chosen interactively. With "
+		"--all or a\n"
+		"pathspec, the patch is written directly to FILE (default: "
+		"stdout).\n"
+		"The patch is compressed as --compress says, or else when its "
+		"name ends\n"
+		"in .gz or .zst.\n",
+		prog);
+}
+
+static int parse_arguments(int argc, char **argv, create_options *opts)
+{
+	static const struct option long_options[] = {
+		{"output", required_argument, nullptr, 'o'},
+		{"compress", required_argument, nullptr, 'z'},
+		{"all", no_argument, nullptr, 'a'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
 	};
 
-	bool git_ready = false;
+	int ch;
+	while ((ch = getopt_long(argc, argv, "o:z:ah", long_options,
+				 nullptr)) != -1) {
+		switch (ch) {
+		case 'o':
+			opts->output = optarg;
+			break;
+		case 'z': {
+			utils_compression format;
+			if (!utils_compression_parse(optarg, &format)) {
+				fprintf(stderr,
+					"Error: unknown --compress format %s\n",
+					optarg);
+				return -1;
+			}
+			if (!utils_compression_supported(format)) {
+				fprintf(stderr, "Error: %s compression is not "
+						"available in this build\n",
+					optarg);
+				return -1;
+			}
+			opts->compress = optarg;
+			break;
+		}
+		case 'a':
+			opts->all = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
 
-	int rc = git_libgit2_init();
-	if (rc < 0) {
-		report_git_error("Failed to initialize libgit2", rc);
-		return 1;
+	opts->pathspecs = argv + optind;
+	opts->pathspec_count = (size_t)(argc - optind);
+	opts->batch = opts->all || opts->pathspec_count > 0U;
+
+	if (opts->output && !opts->batch) {
+		fprintf(stderr, "Error: --output requires --all or a "
+				"pathspec\n");
+		return -1;
+	}
+	if (opts->all && opts->pathspec_count > 0U) {
+		fprintf(stderr, "Error: --all cannot be combined with "
+				"pathspecs\n");
+		return -1;
 	}
-	git_ready = true;
 
-	rc = gitutils_open_repository(&ctx.repo, ".");
-	if (rc < 0) {
-		report_git_error("Not inside a git repository", rc);
-		return finalize(&ctx, git_ready, 1);
+	return 0;
+}
+
+// --compress wins; otherwise the name's suffix picks the format.
+static utils_compression patch_compression(const Context *ctx)
+{
+	utils_compression format = UTILS_COMPRESS_NONE;
+	if (ctx->compress) {
+		utils_compression_parse(ctx->compress, &format);
+		return format;
 	}
+	return utils_compression_of_name(ctx->patch_name);
+}
 
-	rc = gitutils_collect_status(ctx.repo, &ctx.status_list);
-	if (rc < 0) {
-		report_git_error("Failed to gather repository status", rc);
-		return finalize(&ctx, git_ready, 1);
+static int open_patch_output(Context *ctx)
+{
+	FILE *file = stdout;
+	if (strcmp(ctx->patch_name, "-") != 0) {
+		file = fopen(ctx->patch_name, "w");
+		if (!file) {
+			return -1;
+		}
+		ctx->opened_patch = true;
 	}
 
-	if (ctx.status_list.count == 0U) {
-		printf("No modified or untracked files found\n");
-		return finalize(&ctx, git_ready, 0);
+	// closing the compressed stream ends it and closes the file, but
+	// leaves stdout open
+	const utils_compression format = patch_compression(ctx);
+	ctx->patch_file = utils_compress_open(file, file != stdout, format);
+	if (!ctx->patch_file) {
+		if (file != stdout) {
+			fclose(file);
+		}
+		return -1;
 	}
 
-	ctx.ordered = calloc(ctx.status_list.count, sizeof(*ctx.ordered));
-	if (!ctx.ordered) {
-		fprintf(stderr, "Out of memory\n");
-		return finalize(&ctx, git_ready, 1);
+	ctx->write_buffer = utils_buffer_stream(ctx->patch_file);
+	return 0;
+}
+
+static const ui_list_item *feed_item(Context *ctx, size_t index)
+{
+	return &ui_item_feed_items(ctx->feed, nullptr)[index];
+}
+
+static bool describe_item(size_t index, char *buffer, size_t size,
+			  void *userdata)
+{
+	Context *ctx = userdata;
+	const ui_list_item *item = feed_item(ctx, index);
+	return gitutils_diffstat_cache_describe(ctx->diffstats, item->label,
+						item->description, buffer,
+						size);
+}
+
+static bool preview_item(size_t index, char **out_text, size_t *out_length,
+			 void *userdata)
+{
+	Context *ctx = userdata;
+	FILE *memory = open_memstream(out_text, out_length);
+	if (!memory) {
+		return false;
 	}
 
-	for (size_t i = 0; i < ctx.status_list.count; ++i) {
-		ctx.ordered[i] = &ctx.status_list.entries[i];
+	bool has_changes = false;
+	int rc = gitutils_write_diff_for_path(
+		ctx->repo, feed_item(ctx, index)->label, memory, &has_changes);
+	return fclose(memory) == 0 && (rc == 0 || rc == GIT_ENOTFOUND);
+}
+
+static int write_selected_diffs(Context *ctx, const ui_list_item *items,
+				size_t *written_files,
+				const char **failed_path)
+{
+	const char **paths =
+		utils_calloc(ctx->selection.selected, sizeof(*paths));
+	if (!paths) {
+		*failed_path = "(out of memory)";
+		return GIT_ERROR;
 	}
-	qsort(ctx.ordered, ctx.status_list.count, sizeof(*ctx.ordered),
-	      compare_entries);
 
-	if (ui_initialize() != 0) {
-		fprintf(stderr, "Failed to initialize terminal UI\n");
-		return finalize(&ctx, git_ready, 1);
+	size_t count = 0U;
+	for (size_t i = ui_selection_next(&ctx->selection, 0U); i != SIZE_MAX;
+	     i = ui_selection_next(&ctx->selection, i + 1U)) {
+		paths[count++] = items[i].label;
 	}
-	ctx.ui_active = true;
 
-	ctx.items = calloc(ctx.status_list.count, sizeof(*ctx.items));
-	if (!ctx.items) {
-		fprintf(stderr, "Out of memory\n");
-		return finalize(&ctx, git_ready, 1);
+	size_t failed = 0U;
+	int rc = gitutils_write_diffs(ctx->repo, paths, count, ctx->patch_file,
+				      written_files, &failed);
+	if (rc < 0) {
+		*failed_path = failed < count ? paths[failed] : "(patch)";
 	}
 
-	for (size_t i = 0; i < ctx.status_list.count; ++i) {
-		const gitutils_status_entry *entry = ctx.ordered[i];
-		ctx.items[i] = (ui_list_item){
-			.label = entry->path,
-			.description =
-				entry->status == GITUTILS_STATUS_UNTRACKED
-					? "Untracked"
-					: "Modified",
-			.selected = false,
+	utils_free(paths);
+	return rc;
+}
+
+static int close_patch_output(Context *ctx)
+{
+	FILE *file = ctx->patch_file;
+	ctx->patch_file = nullptr;
+	return fclose(file);
+}
+
+static int run_batch(Context *ctx, const create_options *opts, bool git_ready)
+{
+	git_pathspec *pathspec = nullptr;
+	if (!opts->all) {
+		const git_strarray specs = {
+			.strings = opts->pathspecs,
+			.count = opts->pathspec_count,
 		};
+		int rc = git_pathspec_new(&pathspec, &specs);
+		if (rc < 0) {
+			report_git_error("Invalid pathspec", rc);
+			return finalize(ctx, git_ready, 1);
+		}
+	}
+
+	for (size_t i = 0; i < ctx->status_list.count; ++i) {
+		const char *path = ctx->ordered[i]->path;
+		const bool match = !pathspec || git_pathspec_matches_path(
+							pathspec, 0U, path) > 0;
+		ui_selection_set(&ctx->selection, i, match);
+	}
+	git_pathspec_free(pathspec);
+
+	if (ctx->selection.selected == 0U) {
+		fprintf(stderr, "No modified or untracked files match\n");
+		return finalize(ctx, git_ready, 1);
+	}
+
+	const char *output = opts->output ? opts->output : "-";
+	FORMAT_MSG_INTO(ctx->patch_name, "%s", output);
+	if (open_patch_output(ctx) < 0) {
+		fprintf(stderr, "Error: unable to open %s: %s\n", output,
+			strerror(errno));
+		return finalize(ctx, git_ready, 1);
+	}
+
+	size_t written_files = 0U;
+	const char *failed_path = nullptr;
+	int rc = write_selected_diffs(ctx, ctx->items, &written_files,
+				      &failed_path);
+	if (rc < 0) {
+		report_git_error(failed_path, rc);
+		return finalize(ctx, git_ready, 1);
+	}
+
+	if (close_patch_output(ctx) != 0) {
+		fprintf(stderr, "Error: failed to write %s: %s\n", output,
+			strerror(errno));
+		return finalize(ctx, git_ready, 1);
+	}
+
+	if (written_files == 0U) {
+		fprintf(stderr, "No changes were written to the patch\n");
+		return finalize(ctx, git_ready, 1);
+	}
+
+	ctx->created_patch = true;
+	return finalize(ctx, git_ready, 0);
+}
+
+static bool load_status_entry(const gitutils_status_entry *entry,
+			      void *userdata)
+{
+	Context *ctx = userdata;
+	return ui_item_feed_push(ctx->feed, entry->path,
+				 entry->status == GITUTILS_STATUS_UNTRACKED
+					 ? "Untracked"
+					 : "Modified");
+}
+
+static bool load_status_progress(const char *part, size_t done, size_t total,
+				 void *userdata)
+{
+	Context *ctx = userdata;
+	if (!part) {
+		return true;
 	}
+	FORMAT_MSG(message, 160, "%s (%zu of %zu)",
+		   *part ? part : "repository", done + 1U, total);
+	return ui_item_feed_progress(ctx->feed, message);
+}
+
+static void *load_status_main(void *arg)
+{
+	Context *ctx = arg;
+	int rc = gitutils_collect_status_stream(
+		ctx->repo, load_status_entry, load_status_progress, ctx);
+	if (rc == GIT_EUSER) {
+		// the list was closed before the scan completed
+		rc = 0;
+	}
+	if (rc < 0) {
+		const git_error *err = git_error_last();
+		FORMAT_MSG(message, 160, "%s",
+			   err && err->message ? err->message
+					       : "unable to read status");
+		ui_item_feed_finish(ctx->feed, message);
+	} else {
+		ui_item_feed_finish(ctx->feed, nullptr);
+	}
+	ctx->load_error = rc;
+	return nullptr;
+}
 
-	const int selected_result = ui_multiselect(
-		"Select Files", "Choose files to include in patch:", ctx.items,
-		ctx.status_list.count);
+static int run_interactive(Context *ctx, bool git_ready)
+{
+	if (ui_initialize() != 0) {
+		fprintf(stderr, "Failed to initialize terminal UI\n");
+		return finalize(ctx, git_ready, 1);
+	}
+	ctx->ui_active = true;
+
+	// status is collected on a loader thread and streamed into the list,
+	// so the first frame does not wait for the whole working tree
+	ctx->feed = ui_item_feed_new();
+	if (!ctx->feed || pthread_create(&ctx->loader, nullptr,
+					 load_status_main, ctx) != 0) {
+		ui_show_error("Status Error", "Unable to start loading.");
+		return finalize(ctx, git_ready, 1);
+	}
+	ctx->loader_running = true;
+
+	ctx->diffstats = gitutils_diffstat_cache_new(ctx->repo);
+	const ui_multiselect_options options = {
+		.describe = ctx->diffstats ? describe_item : nullptr,
+		.preview = preview_item,
+		.userdata = ctx,
+		.selection = &ctx->selection,
+		.tree = true,
+	};
+	const int selected_result = ui_multiselect_feed(
+		"Select Files", "Choose files to include in patch:", ctx->feed,
+		&options);
 	if (selected_result < 0) {
 		fprintf(stderr, "Operation cancelled\n");
-		return finalize(&ctx, git_ready, 0);
+		return finalize(ctx, git_ready, 0);
 	}
 
-	size_t selected_count = 0U;
-	for (size_t i = 0; i < ctx.status_list.count; ++i) {
-		selected_count += ctx.items[i].selected ? 1U : 0U;
+	size_t item_count = 0U;
+	const ui_list_item *items = ui_item_feed_items(ctx->feed, &item_count);
+	if (item_count == 0U) {
+		pthread_join(ctx->loader, nullptr);
+		ctx->loader_running = false;
+		if (ctx->load_error < 0) {
+			ui_show_error("Status Error",
+				      "Failed to gather repository status.");
+			return finalize(ctx, git_ready, 1);
+		}
+		ui_show_message("No Changes",
+				"No modified or untracked files found.");
+		return finalize(ctx, git_ready, 0);
 	}
 
-	if (selected_count == 0U) {
+	if (ctx->selection.selected == 0U) {
 		ui_show_message("No Selection", "No files selected.");
-		return finalize(&ctx, git_ready, 0);
+		return finalize(ctx, git_ready, 0);
 	}
 
 	if (ui_prompt_string("Patch Name",
 			     "Enter the patch file name:", "changes.patch",
-			     ctx.patch_name, sizeof(ctx.patch_name)) < 0) {
+			     ctx->patch_name, sizeof(ctx->patch_name)) < 0) {
 		fprintf(stderr, "Operation cancelled\n");
-		return finalize(&ctx, git_ready, 0);
+		return finalize(ctx, git_ready, 0);
 	}
 
-	size_t name_len = strlen(ctx.patch_name);
+	size_t name_len = strlen(ctx->patch_name);
 	if (name_len == 0U) {
 		ui_show_error("Invalid Name", "Patch name cannot be empty.");
-		return finalize(&ctx, git_ready, 1);
+		return finalize(ctx, git_ready, 1);
 	}
 
+	// a name with a compression suffix is taken as it is
 	static const char *suffix = ".patch";
 	const size_t suffix_len = strlen(suffix);
-	if (name_len < suffix_len ||
-	    strcmp(ctx.patch_name + name_len - suffix_len, suffix) != 0) {
-		if (name_len + suffix_len >= sizeof(ctx.patch_name)) {
+	if (utils_compression_of_name(ctx->patch_name) ==
+		    UTILS_COMPRESS_NONE &&
+	    (name_len < suffix_len ||
+	     strcmp(ctx->patch_name + name_len - suffix_len, suffix) != 0)) {
+		if (name_len + suffix_len >= sizeof(ctx->patch_name)) {
 			ui_show_error("Invalid Name",
 				      "Patch name is too long.");
-			return finalize(&ctx, git_ready, 1);
+			return finalize(ctx, git_ready, 1);
 		}
-		strncat(ctx.patch_name, suffix,
-			sizeof(ctx.patch_name) - name_len - 1U);
+		strncat(ctx->patch_name, suffix,
+			sizeof(ctx->patch_name) - name_len - 1U);
 		name_len += suffix_len;
 	}
 
-	if (access(ctx.patch_name, F_OK) == 0 &&
+	if (access(ctx->patch_name, F_OK) == 0 &&
 	    !ui_confirm("Overwrite?", "Patch file exists. Overwrite it?")) {
 		fprintf(stderr, "Operation cancelled\n");
-		return finalize(&ctx, git_ready, 0);
+		return finalize(ctx, git_ready, 0);
 	}
 
-	ctx.patch_file = fopen(ctx.patch_name, "w");
-	if (!ctx.patch_file) {
-		FORMAT_MSG(msg, sizeof(ctx.patch_name), "Unable to open %s: %s",
-			   ctx.patch_name, strerror(errno));
+	if (open_patch_output(ctx) < 0) {
+		FORMAT_MSG(msg, sizeof(ctx->patch_name),
+			   "Unable to open %s: %s", ctx->patch_name,
+			   strerror(errno));
 		ui_show_error("File Error", msg);
-		return finalize(&ctx, git_ready, 1);
+		return finalize(ctx, git_ready, 1);
 	}
 
 	size_t written_files = 0U;
-	for (size_t i = 0; i < ctx.status_list.count; ++i) {
-		if (!ctx.items[i].selected) {
-			continue;
-		}
-
-		const char *path = ctx.ordered[i]->path;
-		bool has_changes = false;
-		rc = gitutils_write_diff_for_path(ctx.repo, path,
-						  ctx.patch_file, &has_changes);
-		if (rc < 0 && rc != GIT_ENOTFOUND) {
-			FORMAT_MSG(msg, sizeof(ctx.patch_name),
-				   "Failed to diff %s", path);
-			ui_show_error("Diff Error", msg);
-			return finalize(&ctx, git_ready, 1);
-		}
-
-		if (has_changes) {
-			++written_files;
-		}
+	const char *failed_path = nullptr;
+	const int rc =
+		write_selected_diffs(ctx, items, &written_files, &failed_path);
+	if (rc < 0) {
+		FORMAT_MSG(msg, sizeof(ctx->patch_name), "Failed to diff %s",
+			   failed_path);
+		ui_show_error("Diff Error", msg);
+		return finalize(ctx, git_ready, 1);
 	}
 
-	if (fclose(ctx.patch_file) != 0) {
-		ctx.patch_file = nullptr;
+	if (close_patch_output(ctx) != 0) {
 		ui_show_error("File Error",
 			      "Failed to close patch file for writing.");
-		return finalize(&ctx, git_ready, 1);
+		return finalize(ctx, git_ready, 1);
 	}
-	ctx.patch_file = nullptr;
 
 	if (written_files == 0U) {
 		ui_show_error("Empty Patch",
 			      "No changes were written to the patch.");
-		return finalize(&ctx, git_ready, 1);
+		return finalize(ctx, git_ready, 1);
 	}
 
-	ctx.created_patch = true;
+	ctx->created_patch = true;
 
-	FORMAT_MSG(success, sizeof(ctx.patch_name),
-		   "Patch created successfully: %s", ctx.patch_name);
+	FORMAT_MSG(success, sizeof(ctx->patch_name),
+		   "Patch created successfully: %s", ctx->patch_name);
 	ui_show_message("Success", success);
 
-	return finalize(&ctx, git_ready, 0);
+	return finalize(ctx, git_ready, 0);
+}
+
+static int run_create_patch(const create_options *opts)
+{
+	Context ctx = {
+		.repo = nullptr,
+		.status_list = {.entries = nullptr, .count = 0U},
+		.ordered = nullptr,
+		.items = nullptr,
+		.selection = {0},
+		.feed = nullptr,
+		.loader_running = false,
+		.load_error = 0,
+		.diffstats = nullptr,
+		.patch_file = nullptr,
+		.compress = opts->compress,
+		.write_buffer = nullptr,
+		.ui_active = false,
+		.opened_patch = false,
+		.created_patch = false,
+		.patch_name = {0},
+	};
+
+	bool git_ready = false;
+
+	int rc = gitutils_init();
+	if (rc < 0) {
+		report_git_error("Failed to initialize libgit2", rc);
+		return 1;
+	}
+	git_ready = true;
+
+	rc = gitutils_open_repository(&ctx.repo, ".");
+	if (rc < 0) {
+		report_git_error("Not inside a git repository", rc);
+		return finalize(&ctx, git_ready, 1);
+	}
+
+	if (!opts->batch) {
+		return run_interactive(&ctx, git_ready);
+	}
+
+	rc = gitutils_collect_status(ctx.repo, &ctx.status_list);
+	if (rc < 0) {
+		report_git_error("Failed to gather repository status", rc);
+		return finalize(&ctx, git_ready, 1);
+	}
+
+	if (ctx.status_list.count == 0U) {
+		fprintf(stderr, "No modified or untracked files found\n");
+		return finalize(&ctx, git_ready, 1);
+	}
+
+	ctx.ordered = utils_calloc(ctx.status_list.count, sizeof(*ctx.ordered));
+	if (!ctx.ordered) {
+		fprintf(stderr, "Out of memory\n");
+		return finalize(&ctx, git_ready, 1);
+	}
+
+	for (size_t i = 0; i < ctx.status_list.count; ++i) {
+		ctx.ordered[i] = &ctx.status_list.entries[i];
+	}
+	qsort(ctx.ordered, ctx.status_list.count, sizeof(*ctx.ordered),
+	      compare_entries);
+
+	ctx.items = utils_calloc(ctx.status_list.count, sizeof(*ctx.items));
+	if (!ctx.items ||
+	    !ui_selection_init(&ctx.selection, ctx.status_list.count)) {
+		fprintf(stderr, "Out of memory\n");
+		return finalize(&ctx, git_ready, 1);
+	}
+
+	for (size_t i = 0; i < ctx.status_list.count; ++i) {
+		const gitutils_status_entry *entry = ctx.ordered[i];
+		ctx.items[i] = (ui_list_item){
+			.label = entry->path,
+			.description =
+				entry->status == GITUTILS_STATUS_UNTRACKED
+					? "Untracked"
+					: "Modified",
+			.selected = false,
+		};
+	}
+
+	return run_batch(&ctx, opts, git_ready);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-	return run_create_patch();
+	create_options opts = {0};
+	if (parse_arguments(argc, argv, &opts) < 0) {
+		return 1;
+	}
+	utils_trace_start();
+	utils_mem_report_at_exit();
+
+	return run_create_patch(&opts);
 }
@@ -0,0 +1,438 @@
+#include "libs/patch/patch.h"
+#include "libs/util/compress.h"
+#include "libs/util/trace.h"
+#include "libs/util/util.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	char *path;
+	size_t offset;
+	size_t length;
+	uint64_t hash;
+	bool matched;
+} section_entry;
+
+// One version of the patch, read once and indexed in place.
+typedef struct {
+	char *data;
+	size_t length;
+	section_entry *sections;
+	size_t count;
+	size_t capacity;
+	utils_strmap by_path; // path -> first section index + 1
+} patch_version;
+
+typedef struct {
+	const char *text; // starts at the hunk's @@ line
+	size_t length;
+	uint64_t hash; // of everything but the line numbers
+} hunk_span;
+
+// How many of the hunks not walked past yet carry |hash|.
+typedef struct {
+	uint64_t hash;
+	size_t count;
+	bool used;
+} pending_slot;
+
+typedef struct {
+	hunk_span *items;
+	size_t count;
+	size_t capacity;
+	size_t header_length; // bytes before the first hunk
+	uint64_t header_hash; // of the header without its index line
+	// open-addressed counts of the hunk hashes, so telling whether a
+	// hash still comes up later is one probe instead of a scan
+	pending_slot *pending;
+	size_t pending_capacity;
+	size_t pending_mask;
+} hunk_list;
+
+typedef struct {
+	size_t unchanged;
+	size_t changed;
+	size_t added;
+	size_t dropped;
+} interdiff_stats;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s <old-patch> <new-patch>\n"
+		"\n"
+		"Shows what changed between two versions of a patch, hunk by "
+		"hunk.\n"
+		"Exits with 0 when they match and 1 when they differ.\n",
+		prog);
+}
+
+static const char *section_text(const patch_version *version,
+				const section_entry *section)
+{
+	return version->data + section->offset;
+}
+
+static bool add_section(const patch_section *section, void *userdata)
+{
+	patch_version *version = userdata;
+	if (!utils_array_reserve((void **)&version->sections,
+				 &version->capacity, version->count + 1U,
+				 sizeof(*version->sections))) {
+		return false;
+	}
+
+	char *path = utils_strdup(section->path);
+	if (!path) {
+		return false;
+	}
+	version->sections[version->count++] = (section_entry){
+		.path = path,
+		.offset = section->offset,
+		.length = section->length,
+		.hash = utils_hash_bytes(version->data + section->offset,
+					 section->length),
+	};
+	if (!utils_strmap_get(&version->by_path, path)) {
+		return utils_strmap_put(&version->by_path, path,
+					(void *)(uintptr_t)version->count);
+	}
+	return true;
+}
+
+static bool load_version(patch_version *version, const char *path)
+{
+	TRACE_SCOPE_DETAIL("interdiff.load", path);
+	FILE *file = fopen(path, "r");
+	FILE *input = file ? utils_decompress_open(file, true, nullptr)
+			   : nullptr;
+	if (!input) {
+		fprintf(stderr, "Error: unable to open %s: %s\n", path,
+			strerror(errno));
+		if (file) {
+			fclose(file);
+		}
+		return false;
+	}
+	bool ok = utils_read_stream(input, &version->data, &version->length);
+	fclose(input);
+
+	ok = ok && patch_scan_buffer(version->data, version->length,
+				     add_section, version);
+	if (!ok) {
+		fprintf(stderr, "Error: unable to read %s\n", path);
+	}
+	return ok;
+}
+
+static void version_dispose(patch_version *version)
+{
+	for (size_t i = 0; i < version->count; ++i) {
+		utils_free(version->sections[i].path);
+	}
+	utils_free(version->sections);
+	utils_strmap_dispose(&version->by_path, nullptr);
+	utils_free(version->data);
+}
+
+static section_entry *find_section(const patch_version *version,
+				   const char *path)
+{
+	const uintptr_t slot =
+		(uintptr_t)utils_strmap_get(&version->by_path, path);
+	return slot ? &version->sections[slot - 1U] : nullptr;
+}
+
+static bool same_section(const patch_version *old_version,
+			 const section_entry *old_section,
+			 const patch_version *new_version,
+			 const section_entry *new_section)
+{
+	return old_section->hash == new_section->hash &&
+	       old_section->length == new_section->length &&
+	       memcmp(section_text(old_version, old_section),
+		      section_text(new_version, new_section),
+		      new_section->length) == 0;
+}
+
+// A hunk that only moved keeps its hash: the "@@ -a,b +c,d @@" ranges
+// are left out, the function context and body are not.
+static uint64_t hunk_hash(const char *text, size_t length)
+{
+	const char *end = text + length;
+	const char *ranges_end = memmem(text + 2, length - 2U, "@@", 2);
+	const char *body = ranges_end && ranges_end < end ? ranges_end + 2
+							   : text;
+	return utils_hash_bytes(body, (size_t)(end - body));
+}
+
+static uint64_t header_hash(const char *text, size_t length)
+{
+	// the index line names blobs and changes with any content change;
+	// the hunks already account for that
+	uint64_t hash = 0U;
+	for (const char *cursor = text, *end = text + length; cursor < end;) {
+		const size_t line = utils_line_length(cursor, end);
+		if (strncmp(cursor, "index ", line < 6U ? line : 6U) != 0) {
+			hash = hash * 31U + utils_hash_bytes(cursor, line);
+		}
+		cursor += line;
+	}
+	return hash;
+}
+
+static bool split_hunks(const char *text, size_t length, hunk_list *out)
+{
+	out->count = 0U;
+	out->header_length = length;
+	hunk_span *current = nullptr;
+	for (const char *cursor = text, *end = text + length; cursor < end;) {
+		const size_t line = utils_line_length(cursor, end);
+		patch_hunk hunk;
+		if (*cursor == '@' &&
+		    patch_parse_hunk_header(cursor, line, &hunk)) {
+			if (!utils_array_reserve((void **)&out->items,
+						 &out->capacity,
+						 out->count + 1U,
+						 sizeof(*out->items))) {
+				return false;
+			}
+			if (out->count == 0U) {
+				out->header_length = (size_t)(cursor - text);
+			}
+			current = &out->items[out->count++];
+			*current = (hunk_span){.text = cursor};
+		}
+		if (current) {
+			current->length += line;
+		}
+		cursor += line;
+	}
+
+	for (size_t i = 0; i < out->count; ++i) {
+		out->items[i].hash =
+			hunk_hash(out->items[i].text, out->items[i].length);
+	}
+	out->header_hash = header_hash(text, out->header_length);
+	return true;
+}
+
+// Writes every line of |text| behind |marker|.
+static void write_marked(FILE *output, char marker, const char *text,
+			 size_t length)
+{
+	for (const char *cursor = text, *end = text + length; cursor < end;) {
+		const size_t line = utils_line_length(cursor, end);
+		fputc(marker, output);
+		fwrite(cursor, 1U, line, output);
+		if (cursor[line - 1U] != '\n') {
+			fputc('\n', output);
+		}
+		cursor += line;
+	}
+}
+
+static pending_slot *find_pending(const hunk_list *hunks, uint64_t hash)
+{
+	for (size_t i = (size_t)hash & hunks->pending_mask;;
+	     i = (i + 1U) & hunks->pending_mask) {
+		pending_slot *slot = &hunks->pending[i];
+		if (!slot->used || slot->hash == hash) {
+			return slot;
+		}
+	}
+}
+
+// Counts the hash of every hunk; write_hunk_diff() takes each one back
+// out as it walks past its hunk.
+static bool count_pending(hunk_list *hunks)
+{
+	size_t size = 16U;
+	while (size < 2U * hunks->count) {
+		size *= 2U;
+	}
+	if (!utils_array_reserve((void **)&hunks->pending,
+				 &hunks->pending_capacity, size,
+				 sizeof(*hunks->pending))) {
+		return false;
+	}
+	memset(hunks->pending, 0, size * sizeof(*hunks->pending));
+	hunks->pending_mask = size - 1U;
+
+	for (size_t i = 0; i < hunks->count; ++i) {
+		pending_slot *slot = find_pending(hunks, hunks->items[i].hash);
+		slot->hash = hunks->items[i].hash;
+		slot->used = true;
+		++slot->count;
+	}
+	return true;
+}
+
+static void pass_pending(hunk_list *hunks, const hunk_span *hunk)
+{
+	--find_pending(hunks, hunk->hash)->count;
+}
+
+static bool hunk_ahead(const hunk_list *hunks, uint64_t hash)
+{
+	return find_pending(hunks, hash)->count > 0U;
+}
+
+// Walks both hunk lists in order: matching hunks are named once, the rest
+// are shown as removed or added.
+static void write_hunk_diff(FILE *output, const hunk_list *old_hunks,
+			    hunk_list *new_hunks)
+{
+	size_t i = 0U;
+	size_t j = 0U;
+	while (i < old_hunks->count || j < new_hunks->count) {
+		const hunk_span *old_hunk =
+			i < old_hunks->count ? &old_hunks->items[i] : nullptr;
+		const hunk_span *new_hunk =
+			j < new_hunks->count ? &new_hunks->items[j] : nullptr;
+		if (old_hunk && new_hunk && old_hunk->hash == new_hunk->hash) {
+			// the @@ line names the hunk where it now stands
+			const char *end = new_hunk->text + new_hunk->length;
+			write_marked(output, ' ', new_hunk->text,
+				     utils_line_length(new_hunk->text, end));
+			pass_pending(new_hunks, new_hunk);
+			++i;
+			++j;
+		} else if (old_hunk &&
+			   (!new_hunk ||
+			    !hunk_ahead(new_hunks, old_hunk->hash))) {
+			write_marked(output, '-', old_hunk->text,
+				     old_hunk->length);
+			++i;
+		} else {
+			write_marked(output, '+', new_hunk->text,
+				     new_hunk->length);
+			pass_pending(new_hunks, new_hunk);
+			++j;
+		}
+	}
+}
+
+static bool write_changed(FILE *output, const patch_version *old_version,
+			  const section_entry *old_section,
+			  const patch_version *new_version,
+			  const section_entry *new_section,
+			  hunk_list *old_hunks, hunk_list *new_hunks)
+{
+	TRACE_SCOPE_DETAIL("interdiff.section", new_section->path);
+	const char *old_text = section_text(old_version, old_section);
+	const char *new_text = section_text(new_version, new_section);
+	if (!split_hunks(old_text, old_section->length, old_hunks) ||
+	    !split_hunks(new_text, new_section->length, new_hunks) ||
+	    !count_pending(new_hunks)) {
+		return false;
+	}
+
+	fprintf(output, "=== %s changed\n", new_section->path);
+	if (old_hunks->header_hash != new_hunks->header_hash) {
+		write_marked(output, '-', old_text, old_hunks->header_length);
+		write_marked(output, '+', new_text, new_hunks->header_length);
+	}
+	write_hunk_diff(output, old_hunks, new_hunks);
+	return true;
+}
+
+static bool write_interdiff(FILE *output, patch_version *old_version,
+			    const patch_version *new_version,
+			    interdiff_stats *stats)
+{
+	TRACE_SCOPE("interdiff.write");
+	hunk_list old_hunks = {0};
+	hunk_list new_hunks = {0};
+	bool ok = true;
+
+	for (size_t i = 0; ok && i < new_version->count; ++i) {
+		const section_entry *new_section = &new_version->sections[i];
+		section_entry *old_section =
+			find_section(old_version, new_section->path);
+		if (old_section && old_section->matched) {
+			old_section = nullptr;
+		}
+
+		if (!old_section) {
+			fprintf(output, "=== %s added\n", new_section->path);
+			write_marked(output, '+',
+				     section_text(new_version, new_section),
+				     new_section->length);
+			++stats->added;
+			continue;
+		}
+
+		old_section->matched = true;
+		if (same_section(old_version, old_section, new_version,
+				 new_section)) {
+			++stats->unchanged;
+			continue;
+		}
+		ok = write_changed(output, old_version, old_section,
+				   new_version, new_section, &old_hunks,
+				   &new_hunks);
+		++stats->changed;
+	}
+
+	for (size_t i = 0; ok && i < old_version->count; ++i) {
+		const section_entry *old_section = &old_version->sections[i];
+		if (!old_section->matched) {
+			fprintf(output, "=== %s dropped\n", old_section->path);
+			write_marked(output, '-',
+				     section_text(old_version, old_section),
+				     old_section->length);
+			++stats->dropped;
+		}
+	}
+
+	utils_free(old_hunks.items);
+	utils_free(new_hunks.items);
+	utils_free(new_hunks.pending);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		usage(argv[0]);
+		return 2;
+	}
+	utils_trace_start();
+	utils_mem_report_at_exit();
+
+	patch_version old_version = {0};
+	patch_version new_version = {0};
+	if (!load_version(&old_version, argv[1]) ||
+	    !load_version(&new_version, argv[2])) {
+		version_dispose(&old_version);
+		version_dispose(&new_version);
+		return 2;
+	}
+
+	utils_buffer_stdout();
+	interdiff_stats stats = {0};
+	bool ok = write_interdiff(stdout, &old_version, &new_version, &stats);
+	ok = fflush(stdout) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Error: unable to write the interdiff\n");
+	} else {
+		fprintf(stderr,
+			"%zu sections unchanged, %zu changed, %zu added, "
+			"%zu dropped\n",
+			stats.unchanged, stats.changed, stats.added,
+			stats.dropped);
+	}
+
+	version_dispose(&old_version);
+	version_dispose(&new_version);
+	if (!ok) {
+		return 2;
+	}
+	return stats.changed + stats.added + stats.dropped > 0U ? 1 : 0;
+}
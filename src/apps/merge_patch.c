@@ -0,0 +1,767 @@
+#include "libs/patch/patch.h"
+#include "libs/util/trace.h"
+#include "libs/util/util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	const char *output;
+	char **patches; // inputs, in the order their hunks take precedence
+	size_t patch_count;
+} merge_options;
+
+// A distinct section kept for a file; identical repeats are dropped.
+typedef struct {
+	char *data;
+	size_t length;
+	uint64_t hash;
+	size_t source; // index of the input it came from
+} kept_section;
+
+typedef struct {
+	patch_hunk range;
+	const char *text; // into a kept section, @@ line included
+	char *owned;	  // the text of hunks folded together, if any
+	size_t source;
+	size_t order; // arrival order, so sorting keeps earlier inputs first
+	bool kept;
+} merge_hunk;
+
+// One preimage line of overlapping hunks folded together, with the lines
+// inserted in front of it.
+typedef struct {
+	const char *text; // without its ' ' or '-', newline included
+	size_t length;
+	bool removed;
+	const char *inserted; // the '+' lines as they came, signs included
+	size_t inserted_length;
+	size_t inserted_lines;
+} merge_slot;
+
+// Hunks folded into |hunk|: |slots| hold preimage lines |start| up to
+// |start + count|, and one more slot for insertions after the last.
+typedef struct {
+	merge_hunk *hunk;
+	merge_slot *slots;
+	size_t start;
+	size_t count;
+	size_t capacity;
+	bool combined; // some other hunk added changes
+} merge_run;
+
+typedef struct {
+	const char *path; // the files map's key
+	kept_section *sections;
+	size_t section_count;
+	size_t section_capacity;
+	size_t header_length; // of the first section, up to its first hunk
+	merge_hunk *hunks;
+	size_t hunk_count;
+	size_t hunk_capacity;
+} merge_file;
+
+typedef struct {
+	const merge_options *opts;
+	utils_strmap files; // path -> merge_file
+	size_t source;	    // input being read
+	size_t sections;
+	size_t duplicate_sections;
+	size_t duplicate_hunks;
+	size_t conflicts;
+} merge_state;
+
+typedef struct {
+	merge_state *state;
+	merge_file *file;
+	const char *data;
+} hunk_context;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--output -|FILE] <patch-file>...\n"
+		"\n"
+		"Combines patches made against the same tree into one patch "
+		"with the\n"
+		"files in sorted order. Repeated sections and hunks are kept "
+		"once,\n"
+		"and overlapping hunks that change different lines become one "
+		"hunk;\n"
+		"hunks that change the same lines differently are reported and "
+		"left\n"
+		"out, keeping the one from the earlier patch.\n",
+		prog);
+}
+
+static int parse_arguments(int argc, char **argv, merge_options *opts)
+{
+	static const struct option long_options[] = {
+		{"output", required_argument, nullptr, 'o'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
+	};
+
+	int ch;
+	while ((ch = getopt_long(argc, argv, "o:h", long_options, nullptr)) !=
+	       -1) {
+		switch (ch) {
+		case 'o':
+			opts->output = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return -1;
+	}
+	opts->patches = argv + optind;
+	opts->patch_count = (size_t)(argc - optind);
+	return 0;
+}
+
+static bool is_index_line(const char *line, size_t length)
+{
+	return length >= 6U && strncmp(line, "index ", 6) == 0;
+}
+
+// Section headers match when they agree on everything but the index line,
+// which names blobs and so differs whenever the hunks do.
+static bool same_header(const char *a, size_t a_length, const char *b,
+			size_t b_length)
+{
+	const char *a_end = a + a_length;
+	const char *b_end = b + b_length;
+	for (;;) {
+		size_t a_line = a < a_end ? utils_line_length(a, a_end) : 0U;
+		if (is_index_line(a, a_line)) {
+			a += a_line;
+			continue;
+		}
+		size_t b_line = b < b_end ? utils_line_length(b, b_end) : 0U;
+		if (is_index_line(b, b_line)) {
+			b += b_line;
+			continue;
+		}
+		if (a_line != b_line || memcmp(a, b, a_line) != 0) {
+			return false;
+		}
+		if (a_line == 0U) {
+			return true;
+		}
+		a += a_line;
+		b += b_line;
+	}
+}
+
+static bool first_hunk(const patch_hunk *hunk, void *userdata)
+{
+	size_t *header_length = userdata;
+	*header_length = hunk->offset;
+	return false;
+}
+
+static size_t header_length(const patch_section *section)
+{
+	size_t length = section->length;
+	patch_section_hunks(section, first_hunk, &length);
+	return length;
+}
+
+static bool add_hunk(const patch_hunk *hunk, void *userdata)
+{
+	hunk_context *ctx = userdata;
+	merge_file *file = ctx->file;
+	if (!utils_array_reserve((void **)&file->hunks, &file->hunk_capacity,
+				 file->hunk_count + 1U, sizeof(*file->hunks))) {
+		return false;
+	}
+	file->hunks[file->hunk_count] = (merge_hunk){
+		.range = *hunk,
+		.text = ctx->data + hunk->offset,
+		.source = ctx->state->source,
+		.order = file->hunk_count,
+	};
+	++file->hunk_count;
+	return true;
+}
+
+static bool add_section(const patch_section *section, void *userdata)
+{
+	merge_state *state = userdata;
+	const char *path = nullptr;
+	merge_file *file = utils_strmap_get_or_add(&state->files, section->path,
+						   sizeof(*file), &path);
+	if (!file) {
+		return false;
+	}
+	file->path = path;
+	++state->sections;
+
+	const uint64_t hash = utils_hash_bytes(section->data, section->length);
+	for (size_t i = 0; i < file->section_count; ++i) {
+		const kept_section *kept = &file->sections[i];
+		if (kept->hash == hash && kept->length == section->length &&
+		    memcmp(kept->data, section->data, section->length) == 0) {
+			++state->duplicate_sections;
+			return true;
+		}
+	}
+
+	const size_t header = header_length(section);
+	if (file->section_count > 0U) {
+		const kept_section *first = &file->sections[0];
+		// also catches sections without hunks, such as binary ones,
+		// whose whole text counts as header
+		if (!same_header(first->data, file->header_length,
+				 section->data, header)) {
+			fprintf(stderr,
+				"conflict %s: %s and %s change the file "
+				"differently; keeping %s\n",
+				file->path, state->opts->patches[first->source],
+				state->opts->patches[state->source],
+				state->opts->patches[first->source]);
+			++state->conflicts;
+			return true;
+		}
+	}
+
+	if (!utils_array_reserve((void **)&file->sections,
+				 &file->section_capacity,
+				 file->section_count + 1U,
+				 sizeof(*file->sections))) {
+		return false;
+	}
+	char *data = utils_malloc(section->length);
+	if (!data) {
+		return false;
+	}
+	memcpy(data, section->data, section->length);
+	if (file->section_count == 0U) {
+		file->header_length = header;
+	}
+	file->sections[file->section_count++] = (kept_section){
+		.data = data,
+		.length = section->length,
+		.hash = hash,
+		.source = state->source,
+	};
+
+	// hunks point into the copy, which lives as long as the file
+	const patch_section copy = {
+		.path = section->path,
+		.data = data,
+		.length = section->length,
+	};
+	hunk_context ctx = {.state = state, .file = file, .data = data};
+	return patch_section_hunks(&copy, add_hunk, &ctx);
+}
+
+static bool read_inputs(merge_state *state)
+{
+	TRACE_SCOPE("merge.read");
+	const merge_options *opts = state->opts;
+	for (size_t i = 0; i < opts->patch_count; ++i) {
+		FILE *input = fopen(opts->patches[i], "r");
+		if (!input) {
+			fprintf(stderr, "Error: unable to open %s: %s\n",
+				opts->patches[i], strerror(errno));
+			return false;
+		}
+
+		state->source = i;
+		const bool ok = patch_parse(input, add_section, state);
+		fclose(input);
+		if (!ok) {
+			fprintf(stderr, "Error: unable to read %s\n",
+				opts->patches[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static int compare_hunks(const void *lhs, const void *rhs)
+{
+	const merge_hunk *a = lhs;
+	const merge_hunk *b = rhs;
+	if (a->range.old_start != b->range.old_start) {
+		return a->range.old_start < b->range.old_start ? -1 : 1;
+	}
+	return a->order < b->order ? -1 : a->order > b->order;
+}
+
+// First preimage line a hunk touches and the one past its last. A pure
+// insertion claims the line it follows, as in overlap-patch.
+static size_t hunk_end(const patch_hunk *range)
+{
+	return range->old_start + (range->old_lines ? range->old_lines : 1U);
+}
+
+static const char *hunk_body(const merge_hunk *hunk)
+{
+	return hunk->text +
+	       utils_line_length(hunk->text, hunk->text + hunk->range.length);
+}
+
+// Whatever follows the ranges on the @@ line, function context included.
+static const char *hunk_trailer(const merge_hunk *hunk)
+{
+	const char *body = hunk_body(hunk);
+	const size_t header = (size_t)(body - hunk->text);
+	const char *trailer = memmem(hunk->text + 2, header - 2U, "@@", 2);
+	return trailer ? trailer + 2 : body;
+}
+
+// The first preimage line a hunk replaces; an insertion names the line
+// before its gap.
+static size_t first_line(const patch_hunk *range)
+{
+	return range->old_lines ? range->old_start : range->old_start + 1U;
+}
+
+static bool same_hunk(const merge_hunk *a, const merge_hunk *b)
+{
+	const char *a_body = hunk_body(a);
+	const char *b_body = hunk_body(b);
+	const size_t a_length = a->range.length - (size_t)(a_body - a->text);
+	const size_t b_length = b->range.length - (size_t)(b_body - b->text);
+	return a->range.old_start == b->range.old_start &&
+	       a->range.old_lines == b->range.old_lines &&
+	       a_length == b_length && memcmp(a_body, b_body, a_length) == 0;
+}
+
+// Makes room in |run| for preimage lines up to |end|.
+static bool run_extend(merge_run *run, size_t end)
+{
+	if (end <= run->start + run->count) {
+		return true;
+	}
+	const size_t count = end - run->start;
+	if (!utils_array_reserve((void **)&run->slots, &run->capacity,
+				 count + 1U, sizeof(*run->slots))) {
+		return false;
+	}
+	memset(run->slots + run->count + 1U, 0,
+	       (count - run->count) * sizeof(*run->slots));
+	run->count = count;
+	return true;
+}
+
+// Folds the body of |hunk| into |run|. Without |apply| it only checks
+// that the hunk's preimage agrees with the lines already there and that
+// each of its changes is new or a repeat, setting |changed| when any is
+// new; with it, it records them.
+static bool run_fold(merge_run *run, const merge_hunk *hunk, bool apply,
+		     bool *changed)
+{
+	const patch_hunk *range = &hunk->range;
+	const char *cursor = hunk_body(hunk);
+	const char *end = hunk->text + range->length;
+	size_t slot = first_line(range) - run->start;
+	size_t old_lines = 0U;
+	size_t new_lines = 0U;
+	while (old_lines < range->old_lines || new_lines < range->new_lines) {
+		if (cursor >= end) {
+			return false;
+		}
+
+		if (*cursor == '+') {
+			// the insertions in one gap move as a block
+			const char *inserted = cursor;
+			size_t lines = 0U;
+			while (cursor < end && *cursor == '+' &&
+			       new_lines < range->new_lines) {
+				cursor += utils_line_length(cursor, end);
+				++lines;
+				++new_lines;
+			}
+			merge_slot *target = &run->slots[slot];
+			const size_t length = (size_t)(cursor - inserted);
+			if (target->inserted) {
+				if (target->inserted_length != length ||
+				    memcmp(target->inserted, inserted,
+					   length) != 0) {
+					return false;
+				}
+				continue;
+			}
+			*changed = true;
+			if (apply) {
+				target->inserted = inserted;
+				target->inserted_length = length;
+				target->inserted_lines = lines;
+			}
+			continue;
+		}
+
+		const size_t length = utils_line_length(cursor, end);
+		// some tools drop the space of an empty context line
+		const bool bare = *cursor == '\n';
+		if ((!bare && *cursor != ' ' && *cursor != '-') ||
+		    old_lines == range->old_lines) {
+			return false;
+		}
+		const char *text = bare ? cursor : cursor + 1;
+		const size_t text_length = bare ? length : length - 1U;
+		const bool removed = *cursor == '-';
+		merge_slot *target = &run->slots[slot++];
+		if (target->text && (target->length != text_length ||
+				     memcmp(target->text, text,
+					    text_length) != 0)) {
+			return false;
+		}
+		if (removed && !target->removed) {
+			*changed = true;
+		}
+		if (apply) {
+			target->text = text;
+			target->length = text_length;
+			target->removed = target->removed || removed;
+		}
+		++old_lines;
+		new_lines += removed ? 0U : 1U;
+		cursor += length;
+	}
+	// a "\ No newline" marker would have to travel with its line
+	return cursor >= end || *cursor != '\\';
+}
+
+static bool run_start(merge_run *run, merge_hunk *hunk)
+{
+	run->hunk = hunk;
+	run->start = first_line(&hunk->range);
+	run->count = 0U;
+	run->combined = false;
+	if (!utils_array_reserve((void **)&run->slots, &run->capacity, 1U,
+				 sizeof(*run->slots))) {
+		return false;
+	}
+	ZeroMemory(&run->slots[0]);
+	bool changed = false;
+	return run_extend(run, run->start + hunk->range.old_lines) &&
+	       run_fold(run, hunk, true, &changed);
+}
+
+// Gives the run's hunk the text of everything folded into it.
+static bool run_finish(merge_run *run)
+{
+	merge_hunk *hunk = run->hunk;
+	run->hunk = nullptr;
+	if (!hunk || !run->combined) {
+		return true;
+	}
+
+	size_t new_lines = 0U;
+	size_t body = 0U;
+	for (size_t i = 0; i <= run->count; ++i) {
+		const merge_slot *slot = &run->slots[i];
+		new_lines += slot->inserted_lines;
+		body += slot->inserted_length;
+		if (slot->text) {
+			new_lines += slot->removed ? 0U : 1U;
+			body += 1U + slot->length;
+		}
+	}
+
+	const char *trailer = hunk_trailer(hunk);
+	const size_t trailer_length = (size_t)(hunk_body(hunk) - trailer);
+	char header[96];
+	FORMAT_MSG_INTO(header, "@@ -%zu,%zu +%zu,%zu @@", run->start,
+			run->count, hunk->range.new_start, new_lines);
+	const size_t header_length = strlen(header);
+	const size_t length = header_length + trailer_length + body;
+	char *text = utils_malloc(length);
+	if (!text) {
+		return false;
+	}
+
+	char *out = text;
+	memcpy(out, header, header_length);
+	out += header_length;
+	memcpy(out, trailer, trailer_length);
+	out += trailer_length;
+	for (size_t i = 0; i <= run->count; ++i) {
+		const merge_slot *slot = &run->slots[i];
+		if (slot->inserted) {
+			memcpy(out, slot->inserted, slot->inserted_length);
+			out += slot->inserted_length;
+		}
+		if (slot->text) {
+			*out++ = slot->removed ? '-' : ' ';
+			memcpy(out, slot->text, slot->length);
+			out += slot->length;
+		}
+	}
+
+	utils_free(hunk->owned);
+	hunk->owned = text;
+	hunk->text = text;
+	hunk->range.old_start = run->start;
+	hunk->range.old_lines = run->count;
+	hunk->range.new_lines = new_lines;
+	hunk->range.length = length;
+	return true;
+}
+
+// Folds |hunk| into the kept hunk it overlaps when their preimages agree
+// and it changes other lines, or only repeats changes already there.
+static bool run_add(merge_state *state, merge_run *run, merge_hunk *last,
+		    const merge_hunk *hunk, bool *folded)
+{
+	*folded = false;
+	if (!run->hunk && !run_start(run, last)) {
+		return false;
+	}
+	// an insertion in front of the run has no slot to go to
+	if (first_line(&hunk->range) < run->start) {
+		return true;
+	}
+
+	const size_t count = run->count;
+	if (!run_extend(run, first_line(&hunk->range) +
+				     hunk->range.old_lines)) {
+		return false;
+	}
+	bool changed = false;
+	if (!run_fold(run, hunk, false, &changed)) {
+		run->count = count;
+		return true;
+	}
+
+	*folded = true;
+	if (!changed) {
+		++state->duplicate_hunks;
+		return true;
+	}
+	run_fold(run, hunk, true, &changed);
+	run->combined = true;
+	// later hunks overlap the combined range, not just the first one's
+	last->range.old_start = run->start;
+	last->range.old_lines = run->count;
+	return true;
+}
+
+// Orders the hunks of |file| by preimage position and keeps those that
+// compose. A hunk overlapping one already kept is folded into it when the
+// two change different lines and agree on the lines they share; otherwise
+// it is a repeat of it or a conflict.
+static bool resolve_file(merge_state *state, merge_file *file)
+{
+	qsort(file->hunks, file->hunk_count, sizeof(*file->hunks),
+	      compare_hunks);
+
+	merge_run run = {0};
+	merge_hunk *last = nullptr;
+	bool ok = true;
+	for (size_t i = 0; ok && i < file->hunk_count; ++i) {
+		merge_hunk *hunk = &file->hunks[i];
+		if (!last || hunk->range.old_start >= hunk_end(&last->range)) {
+			ok = run_finish(&run);
+			hunk->kept = true;
+			last = hunk;
+			continue;
+		}
+
+		if (same_hunk(last, hunk)) {
+			++state->duplicate_hunks;
+			continue;
+		}
+		bool folded = false;
+		ok = run_add(state, &run, last, hunk, &folded);
+		if (!ok || folded) {
+			continue;
+		}
+		const char *end = hunk->text + hunk->range.length;
+		const size_t line = utils_line_length(hunk->text, end);
+		fprintf(stderr,
+			"conflict %s: %s changes lines a hunk from %s changes "
+			"differently and was left out: %.*s",
+			file->path, state->opts->patches[hunk->source],
+			state->opts->patches[last->source], (int)line,
+			hunk->text);
+		++state->conflicts;
+	}
+	ok = ok && run_finish(&run);
+	utils_free(run.slots);
+	return ok;
+}
+
+static void write_range(FILE *output, char sign, size_t start, size_t lines)
+{
+	fprintf(output, "%c%zu", sign, start);
+	if (lines != 1U) {
+		fprintf(output, ",%zu", lines);
+	}
+}
+
+// Writes |hunk| with its postimage start moved by the net line count of
+// the hunks kept before it, since those may come from other inputs.
+static void write_hunk(FILE *output, const merge_hunk *hunk, long long delta)
+{
+	const patch_hunk *range = &hunk->range;
+	const long long first = (long long)range->old_start +
+				(range->old_lines ? 0 : 1) + delta;
+	const long long new_start = range->new_lines ? first : first - 1;
+
+	const char *end = hunk->text + range->length;
+	// whatever follows the ranges on the @@ line is kept as it was
+	const char *trailer = hunk_trailer(hunk);
+
+	fputs("@@ ", output);
+	write_range(output, '-', range->old_start, range->old_lines);
+	fputc(' ', output);
+	write_range(output, '+', new_start > 0 ? (size_t)new_start : 0U,
+		    range->new_lines);
+	fputs(" @@", output);
+	fwrite(trailer, 1U, (size_t)(end - trailer), output);
+}
+
+static void write_file(FILE *output, const merge_file *file)
+{
+	const kept_section *first = &file->sections[0];
+	// the index line of one input does not describe a file merged from
+	// several, and apply does not need it
+	const bool merged = file->section_count > 1U;
+	for (const char *cursor = first->data,
+			*end = first->data + file->header_length;
+	     cursor < end;) {
+		const size_t line = utils_line_length(cursor, end);
+		if (!merged || !is_index_line(cursor, line)) {
+			fwrite(cursor, 1U, line, output);
+		}
+		cursor += line;
+	}
+
+	long long delta = 0;
+	for (size_t i = 0; i < file->hunk_count; ++i) {
+		const merge_hunk *hunk = &file->hunks[i];
+		if (hunk->kept) {
+			write_hunk(output, hunk, delta);
+			delta += (long long)hunk->range.new_lines -
+				 (long long)hunk->range.old_lines;
+		}
+	}
+}
+
+static int compare_files(const void *lhs, const void *rhs)
+{
+	const merge_file *a = *(const merge_file *const *)lhs;
+	const merge_file *b = *(const merge_file *const *)rhs;
+	return strcmp(a->path, b->path);
+}
+
+static bool write_merged(merge_state *state, FILE *output)
+{
+	TRACE_SCOPE("merge.write");
+	const utils_strmap *files = &state->files;
+	merge_file **ordered = utils_calloc(files->count ? files->count : 1U,
+					    sizeof(*ordered));
+	if (!ordered) {
+		return false;
+	}
+
+	size_t count = 0U;
+	for (size_t i = 0; i < files->capacity; ++i) {
+		if (files->keys[i]) {
+			ordered[count++] = files->values[i];
+		}
+	}
+	qsort(ordered, count, sizeof(*ordered), compare_files);
+
+	bool ok = true;
+	for (size_t i = 0; ok && i < count; ++i) {
+		// a file every input dropped on conflict has nothing to write
+		if (ordered[i]->section_count > 0U) {
+			ok = resolve_file(state, ordered[i]);
+			if (ok) {
+				write_file(output, ordered[i]);
+			}
+		}
+	}
+	utils_free(ordered);
+	return ok;
+}
+
+static void free_merge_file(void *value)
+{
+	merge_file *file = value;
+	for (size_t i = 0; i < file->section_count; ++i) {
+		utils_free(file->sections[i].data);
+	}
+	for (size_t i = 0; i < file->hunk_count; ++i) {
+		utils_free(file->hunks[i].owned);
+	}
+	utils_free(file->sections);
+	utils_free(file->hunks);
+	utils_free(file);
+}
+
+static int run_merge_patch(const merge_options *opts)
+{
+	merge_state state = {.opts = opts};
+	if (!read_inputs(&state)) {
+		utils_strmap_dispose(&state.files, free_merge_file);
+		return 1;
+	}
+
+	const char *name = opts->output ? opts->output : "-";
+	FILE *output = strcmp(name, "-") == 0 ? stdout : fopen(name, "w");
+	if (!output) {
+		fprintf(stderr, "Error: unable to open %s: %s\n", name,
+			strerror(errno));
+		utils_strmap_dispose(&state.files, free_merge_file);
+		return 1;
+	}
+	char *write_buffer = nullptr;
+	if (output == stdout) {
+		utils_buffer_stdout();
+	} else {
+		write_buffer = utils_buffer_stream(output);
+	}
+
+	bool ok = write_merged(&state, output);
+	ok = fflush(output) == 0 && ok;
+	if (output != stdout) {
+		ok = fclose(output) == 0 && ok;
+	}
+	utils_free(write_buffer);
+
+	if (!ok) {
+		fprintf(stderr, "Error: failed to write %s\n", name);
+	} else {
+		fprintf(stderr,
+			"%zu sections from %zu patches into %zu files; %zu "
+			"duplicate sections, %zu duplicate hunks, %zu "
+			"conflicts\n",
+			state.sections, opts->patch_count, state.files.count,
+			state.duplicate_sections, state.duplicate_hunks,
+			state.conflicts);
+	}
+	utils_strmap_dispose(&state.files, free_merge_file);
+	return ok && state.conflicts == 0U ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	merge_options opts = {0};
+	if (parse_arguments(argc, argv, &opts) < 0) {
+		return 1;
+	}
+	utils_trace_start();
+	utils_mem_report_at_exit();
+
+	return run_merge_patch(&opts);
+}
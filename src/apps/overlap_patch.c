@@ -0,0 +1,575 @@
+#include "libs/patch/patch.h"
+#include "libs/util/interval.h"
+#include "libs/util/trace.h"
+#include "libs/util/util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	bool dot;
+	char **patches; // the series, in application order
+	size_t patch_count;
+} overlap_options;
+
+// One hunk of one file. A whole-file entry stands for a section that
+// creates, deletes or renames the file: every other patch touching the file
+// depends on it, whatever lines they change.
+typedef struct {
+	size_t patch;
+	patch_hunk range;
+	bool whole;
+} overlap_hunk;
+
+// Every hunk of one file across the whole series, in series order.
+typedef struct {
+	const char *path; // the files map's key
+	overlap_hunk *hunks;
+	size_t count;
+	size_t capacity;
+} file_ranges;
+
+// Lines of one file some patch wrote, as intervals whose |value| is that
+// patch, in the coordinates of the file after the patches seen so far.
+typedef struct {
+	utils_interval *lines;
+	size_t count;
+	size_t capacity;
+} written_lines;
+
+typedef struct {
+	size_t from; // the earlier patch
+	size_t to;   // the later patch, which depends on |from|
+	const char *path;
+} overlap_edge;
+
+typedef struct {
+	utils_strmap files; // path -> file_ranges
+	overlap_edge *edges;
+	size_t edge_count;
+	size_t edge_capacity;
+	size_t hunk_count;
+} overlap_state;
+
+typedef struct {
+	overlap_state *state;
+	size_t patch;
+	file_ranges *file;
+	bool whole;
+} section_context;
+
+typedef struct {
+	overlap_state *state;
+	const file_ranges *file;
+	size_t patch; // the later patch, whose preimage is queried
+	bool failed;
+} query_context;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--dot] <patch-file>...\n"
+		"\n"
+		"Reads a patch series in application order and reports which "
+		"patches\n"
+		"touch lines an earlier patch wrote, or create, delete or "
+		"rename a file\n"
+		"another patch touches, so reordering or dropping them would "
+		"conflict.\n"
+		"--dot prints the graph for Graphviz.\n",
+		prog);
+}
+
+static int parse_arguments(int argc, char **argv, overlap_options *opts)
+{
+	static const struct option long_options[] = {
+		{"dot", no_argument, nullptr, 'd'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
+	};
+
+	int ch;
+	while ((ch = getopt_long(argc, argv, "dh", long_options, nullptr)) !=
+	       -1) {
+		switch (ch) {
+		case 'd':
+			opts->dot = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return -1;
+	}
+	opts->patches = argv + optind;
+	opts->patch_count = (size_t)(argc - optind);
+	return 0;
+}
+
+static bool append_hunk(file_ranges *file, const overlap_hunk *hunk)
+{
+	if (!utils_array_reserve((void **)&file->hunks, &file->capacity,
+				 file->count + 1U, sizeof(*file->hunks))) {
+		return false;
+	}
+	file->hunks[file->count++] = *hunk;
+	return true;
+}
+
+static file_ranges *find_file(overlap_state *state, const char *path)
+{
+	const char *key = nullptr;
+	file_ranges *file = utils_strmap_get_or_add(&state->files, path,
+						    sizeof(*file), &key);
+	if (file) {
+		file->path = key;
+	}
+	return file;
+}
+
+static bool add_hunk(const patch_hunk *hunk, void *userdata)
+{
+	section_context *ctx = userdata;
+	++ctx->state->hunk_count;
+	if (ctx->whole) {
+		return true;
+	}
+
+	// "-0,0" creates the file and "+0,0" empties it, even without the
+	// git header lines that say so
+	ctx->whole = (hunk->old_start == 0U && hunk->old_lines == 0U) ||
+		     (hunk->new_start == 0U && hunk->new_lines == 0U);
+	const overlap_hunk entry = {
+		.patch = ctx->patch,
+		.range = *hunk,
+		.whole = ctx->whole,
+	};
+	return append_hunk(ctx->file, &entry);
+}
+
+static bool header_line(const char *line, size_t length, const char *prefix)
+{
+	const size_t prefix_length = strlen(prefix);
+	return length >= prefix_length &&
+	       memcmp(line, prefix, prefix_length) == 0;
+}
+
+// Tells from the lines before the first hunk whether the section creates,
+// deletes or renames its file; |old_path| receives a rename's source.
+static bool section_whole_file(const patch_section *section, char *old_path,
+			       size_t size)
+{
+	static const char rename_from[] = "rename from ";
+	old_path[0] = '\0';
+	bool whole = false;
+	const char *end = section->data ? section->data + section->length
+					: nullptr;
+	const char *line = section->data;
+	while (line && line < end && *line != '@') {
+		size_t length = utils_line_length(line, end);
+		const char *next = line + length;
+		if (length > 0U && line[length - 1U] == '\n') {
+			--length;
+		}
+
+		if (header_line(line, length, rename_from)) {
+			const size_t skip = sizeof(rename_from) - 1U;
+			utils_format_message((message_buf){old_path, size},
+					     "%.*s", (int)(length - skip),
+					     line + skip);
+			whole = true;
+		} else if (header_line(line, length, "new file mode") ||
+			   header_line(line, length, "deleted file mode") ||
+			   header_line(line, length, "copy from ") ||
+			   header_line(line, length, "--- /dev/null") ||
+			   header_line(line, length, "+++ /dev/null")) {
+			whole = true;
+		}
+		line = next;
+	}
+	return whole;
+}
+
+static bool add_section(const patch_section *section, void *userdata)
+{
+	section_context *ctx = userdata;
+	ctx->file = find_file(ctx->state, section->path);
+	if (!ctx->file) {
+		return false;
+	}
+
+	char old_path[512];
+	ctx->whole = section_whole_file(section, old_path, sizeof(old_path));
+	if (ctx->whole) {
+		const overlap_hunk whole = {.patch = ctx->patch, .whole = true};
+		if (!append_hunk(ctx->file, &whole)) {
+			return false;
+		}
+		// a rename also ends the file under its old name
+		if (old_path[0] && strcmp(old_path, section->path) != 0) {
+			file_ranges *source = find_file(ctx->state, old_path);
+			if (!source || !append_hunk(source, &whole)) {
+				return false;
+			}
+		}
+	}
+	return patch_section_hunks(section, add_hunk, ctx);
+}
+
+static bool read_series(const overlap_options *opts, overlap_state *state)
+{
+	TRACE_SCOPE("overlap.read");
+	for (size_t i = 0; i < opts->patch_count; ++i) {
+		FILE *input = fopen(opts->patches[i], "r");
+		if (!input) {
+			fprintf(stderr, "Error: unable to open %s: %s\n",
+				opts->patches[i], strerror(errno));
+			return false;
+		}
+
+		section_context ctx = {.state = state, .patch = i};
+		const bool ok = patch_parse(input, add_section, &ctx);
+		fclose(input);
+		if (!ok) {
+			fprintf(stderr, "Error: unable to read %s\n",
+				opts->patches[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool record_overlap(const utils_interval *interval, void *userdata)
+{
+	query_context *ctx = userdata;
+	if (interval->value >= ctx->patch) {
+		return true;
+	}
+
+	overlap_state *state = ctx->state;
+	if (!utils_array_reserve((void **)&state->edges, &state->edge_capacity,
+				 state->edge_count + 1U,
+				 sizeof(*state->edges))) {
+		ctx->failed = true;
+		return false;
+	}
+	state->edges[state->edge_count++] = (overlap_edge){
+		.from = interval->value,
+		.to = ctx->patch,
+		.path = ctx->file->path,
+	};
+	return true;
+}
+
+// The lines one side of a hunk covers, context included: a neighbour that
+// only shares context still stops a patch from applying. A side without
+// lines claims the line it follows.
+static utils_interval hunk_lines(size_t start, size_t lines, size_t patch)
+{
+	return (utils_interval){
+		.start = start,
+		.end = start + (lines ? lines : 1U),
+		.value = patch,
+	};
+}
+
+// The first line a hunk side replaces; an empty side names the line
+// before the gap.
+static size_t first_line(size_t start, size_t lines)
+{
+	return lines ? start : start + 1U;
+}
+
+static int compare_hunks(const void *lhs, const void *rhs)
+{
+	const overlap_hunk *a = lhs;
+	const overlap_hunk *b = rhs;
+	if (a->range.old_start != b->range.old_start) {
+		return a->range.old_start < b->range.old_start ? -1 : 1;
+	}
+	return 0;
+}
+
+// Where |line| of the file ends up once one patch's |hunks| are applied.
+// A line the patch rewrote lands at the same offset into the postimage,
+// or at its end when the hunk shrank.
+static size_t map_line(const overlap_hunk *hunks, size_t count, size_t line)
+{
+	if (line == SIZE_MAX) {
+		return line;
+	}
+
+	size_t lo = 0U;
+	size_t hi = count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2U;
+		const patch_hunk *hunk = &hunks[mid].range;
+		if (first_line(hunk->old_start, hunk->old_lines) <= line) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0U) {
+		return line;
+	}
+
+	const patch_hunk *hunk = &hunks[lo - 1U].range;
+	const size_t offset =
+		line - first_line(hunk->old_start, hunk->old_lines);
+	const size_t new_first = first_line(hunk->new_start, hunk->new_lines);
+	if (offset < hunk->old_lines) {
+		return new_first +
+		       (offset < hunk->new_lines ? offset : hunk->new_lines);
+	}
+	return new_first + hunk->new_lines + (offset - hunk->old_lines);
+}
+
+static bool add_written(written_lines *written, utils_interval lines)
+{
+	if (!utils_array_reserve((void **)&written->lines, &written->capacity,
+				 written->count + 1U,
+				 sizeof(*written->lines))) {
+		return false;
+	}
+	written->lines[written->count++] = lines;
+	return true;
+}
+
+// Reports the earlier patches whose lines the preimage of |hunks| touches.
+static bool find_dependencies(query_context *ctx, const written_lines *written,
+			      const overlap_hunk *hunks, size_t count,
+			      bool whole)
+{
+	utils_interval_tree tree;
+	if (!utils_interval_tree_build(&tree, written->lines, written->count)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < count && !ctx->failed; ++i) {
+		const patch_hunk *hunk = &hunks[i].range;
+		const utils_interval lines =
+			whole ? (utils_interval){.end = SIZE_MAX}
+			      : hunk_lines(hunk->old_start, hunk->old_lines,
+					   ctx->patch);
+		utils_interval_tree_query(&tree, lines.start, lines.end,
+					  record_overlap, ctx);
+		if (whole) {
+			break;
+		}
+	}
+	utils_interval_tree_dispose(&tree);
+	return !ctx->failed;
+}
+
+// Moves the written lines through the shifts of one patch's |hunks| and
+// adds the postimage of those hunks.
+static bool apply_hunks(written_lines *written, overlap_hunk *hunks,
+			size_t count, bool whole, size_t patch)
+{
+	if (whole) {
+		// nothing before a replaced file carries over; what comes
+		// later depends on this patch alone
+		written->count = 0U;
+		return add_written(written, (utils_interval){.end = SIZE_MAX,
+							     .value = patch});
+	}
+
+	qsort(hunks, count, sizeof(*hunks), compare_hunks);
+	for (size_t i = 0; i < written->count; ++i) {
+		utils_interval *lines = &written->lines[i];
+		lines->start = map_line(hunks, count, lines->start);
+		lines->end = map_line(hunks, count, lines->end);
+		if (lines->end <= lines->start) {
+			lines->end = lines->start + 1U;
+		}
+	}
+	for (size_t i = 0; i < count; ++i) {
+		const patch_hunk *hunk = &hunks[i].range;
+		if (!add_written(written, hunk_lines(hunk->new_start,
+						     hunk->new_lines, patch))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Replays the series on one file. Each patch's preimage is compared with
+// the lines the earlier patches wrote, mapped forward through the line
+// shifts of every patch in between.
+static bool analyze_file(overlap_state *state, file_ranges *file)
+{
+	written_lines written = {0};
+	query_context ctx = {.state = state, .file = file};
+	bool ok = true;
+	for (size_t first = 0U; ok && first < file->count;) {
+		ctx.patch = file->hunks[first].patch;
+		bool whole = false;
+		size_t last = first;
+		for (; last < file->count &&
+		       file->hunks[last].patch == ctx.patch;
+		     ++last) {
+			whole = whole || file->hunks[last].whole;
+		}
+
+		ok = find_dependencies(&ctx, &written, file->hunks + first,
+				       last - first, whole) &&
+		     apply_hunks(&written, file->hunks + first, last - first,
+				 whole, ctx.patch);
+		first = last;
+	}
+	utils_free(written.lines);
+	return ok;
+}
+
+static int compare_edges(const void *lhs, const void *rhs)
+{
+	const overlap_edge *a = lhs;
+	const overlap_edge *b = rhs;
+	if (a->to != b->to) {
+		return a->to < b->to ? -1 : 1;
+	}
+	if (a->from != b->from) {
+		return a->from < b->from ? -1 : 1;
+	}
+	return strcmp(a->path, b->path);
+}
+
+// Sorts the edges by dependent patch and drops repeats, which appear when
+// several hunks of one file overlap.
+static bool analyze_series(overlap_state *state)
+{
+	TRACE_SCOPE("overlap.analyze");
+	const utils_strmap *files = &state->files;
+	for (size_t i = 0; i < files->capacity; ++i) {
+		if (files->keys[i] && !analyze_file(state, files->values[i])) {
+			return false;
+		}
+	}
+
+	qsort(state->edges, state->edge_count, sizeof(*state->edges),
+	      compare_edges);
+	size_t kept = 0U;
+	for (size_t i = 0; i < state->edge_count; ++i) {
+		if (kept == 0U ||
+		    compare_edges(&state->edges[kept - 1U], &state->edges[i]) !=
+			    0) {
+			state->edges[kept++] = state->edges[i];
+		}
+	}
+	state->edge_count = kept;
+	return true;
+}
+
+static void print_text(const overlap_options *opts, const overlap_state *state)
+{
+	bool *related = utils_calloc(opts->patch_count, sizeof(*related));
+	for (size_t i = 0; i < state->edge_count;) {
+		const overlap_edge *edge = &state->edges[i];
+		printf("%s depends on %s:", opts->patches[edge->to],
+		       opts->patches[edge->from]);
+		for (; i < state->edge_count &&
+		       state->edges[i].to == edge->to &&
+		       state->edges[i].from == edge->from;
+		     ++i) {
+			printf(" %s", state->edges[i].path);
+		}
+		putchar('\n');
+		if (related) {
+			related[edge->from] = true;
+			related[edge->to] = true;
+		}
+	}
+
+	for (size_t i = 0; related && i < opts->patch_count; ++i) {
+		if (!related[i]) {
+			printf("%s is independent\n", opts->patches[i]);
+		}
+	}
+	utils_free(related);
+}
+
+static void print_dot_string(const char *text)
+{
+	putchar('"');
+	for (; *text; ++text) {
+		if (*text == '"' || *text == '\\') {
+			putchar('\\');
+		}
+		putchar(*text);
+	}
+	putchar('"');
+}
+
+static void print_dot(const overlap_options *opts, const overlap_state *state)
+{
+	printf("digraph series {\n");
+	for (size_t i = 0; i < opts->patch_count; ++i) {
+		putchar('\t');
+		print_dot_string(opts->patches[i]);
+		printf(";\n");
+	}
+	for (size_t i = 0; i < state->edge_count; ++i) {
+		const overlap_edge *edge = &state->edges[i];
+		putchar('\t');
+		print_dot_string(opts->patches[edge->from]);
+		printf(" -> ");
+		print_dot_string(opts->patches[edge->to]);
+		printf(" [label=");
+		print_dot_string(edge->path);
+		printf("];\n");
+	}
+	printf("}\n");
+}
+
+static void free_file_ranges(void *value)
+{
+	file_ranges *file = value;
+	utils_free(file->hunks);
+	utils_free(file);
+}
+
+int main(int argc, char **argv)
+{
+	overlap_options opts = {0};
+	if (parse_arguments(argc, argv, &opts) < 0) {
+		return 1;
+	}
+	utils_trace_start();
+	utils_mem_report_at_exit();
+
+	overlap_state state = {0};
+	int exit_code = 1;
+	if (read_series(&opts, &state)) {
+		if (analyze_series(&state)) {
+			if (opts.dot) {
+				print_dot(&opts, &state);
+			} else {
+				print_text(&opts, &state);
+			}
+			fprintf(stderr,
+				"%zu patches, %zu files, %zu hunks, %zu "
+				"overlaps\n",
+				opts.patch_count, state.files.count,
+				state.hunk_count, state.edge_count);
+			exit_code = 0;
+		} else {
+			fprintf(stderr, "Out of memory\n");
+		}
+	}
+
+	utils_free(state.edges);
+	utils_strmap_dispose(&state.files, free_file_ranges);
+	return exit_code;
+}
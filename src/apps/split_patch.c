@@ -1,16 +1,357 @@
 #include "libs/patch/patch.h"
+#include "libs/util/compress.h"
+#include "libs/util/tar.h"
+#include "libs/util/trace.h"
 #include "libs/util/util.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// directories tree output keeps open before it starts over
+#define DIR_CACHE_LIMIT 256U
+// what an incremental run wrote, kept next to the outputs
+#define MANIFEST_NAME ".split-patch.manifest"
+#define MANIFEST_TEMP_NAME ".split-patch.manifest.tmp"
+
+typedef enum {
+	SPLIT_TO_FILES,	 // flattened names in the current directory
+	SPLIT_TO_TREE,	 // the section paths mirrored under a directory
+	SPLIT_TO_TAR,	 // members of one tar archive
+	SPLIT_TO_STREAM, // delimited on stdout, for --emit
+} split_target;
+
+typedef enum {
+	SPLIT_EMIT_NUL,	   // each piece followed by a NUL byte
+	SPLIT_EMIT_LENGTH, // each piece after a "length name" line
+} split_emit;
+
+typedef struct {
+	bool by_hunk;
+	bool list;
+	bool incremental;
+	size_t max_lines; // 0 unless parts are bounded by size
+	const char **includes;
+	size_t include_count;
+	size_t include_capacity;
+	const char **excludes;
+	size_t exclude_count;
+	size_t exclude_capacity;
+	split_target target;
+	const char *destination; // --tree directory or --tar file
+	split_emit emit;
+	utils_compression compression;
+	const char *input_path;
+} split_options;
+
+// An output recorded by the previous incremental run.
+typedef struct {
+	uint64_t hash;
+	size_t length;
+	bool seen;   // produced again by this run
+	char path[]; // of its section, or "" when not known
+} manifest_entry;
+
+// Where the pieces go. Tree output keeps the directories it has opened, so
+// each file costs one openat() instead of a walk down its path; archive
+// output appends members and records where each one landed; --emit output
+// appends the pieces to stdout.
+typedef struct {
+	const split_options *opts;
+	utils_compression file_compression; // of each output file
+	int root;			    // the --tree directory
+	utils_strmap dirs;		    // directory under |root| -> fd + 1
+	FILE *stream;			    // the archive or --emit stream
+	bool stream_on_stdout;
+	char *stream_buffer;
+	utils_tar_writer tar;
+	char *index; // "offset\tlength\tname" per member
+	size_t index_length;
+	size_t index_capacity;
+	utils_strmap previous; // name -> manifest_entry, for --incremental
+	char *manifest;	       // "hash\tlength\tpath\tname" per output
+	size_t manifest_length;
+	size_t manifest_capacity;
+	size_t written;
+	size_t unchanged;
+	size_t removed;
+} split_sink;
+
+typedef struct {
+	const split_options *opts;
+	split_sink *sink;
+	size_t sections; // sections selected so far
+} section_splitter;
+
+// Streams hunks into part files; only the header of the current section is
+// held, so it can be repeated at the top of every part. Archive members
+// need their size up front and incremental output compares a part before
+// writing it, so for those the part is collected first.
+typedef struct {
+	const split_options *opts;
+	split_sink *sink;
+	char *header;
+	size_t header_length;
+	size_t header_capacity;
+	char *buffer; // the part, when it cannot be streamed
+	size_t buffer_length;
+	size_t buffer_capacity;
+	char path[512];	    // of the current section
+	char filename[600]; // of the part being written
+	FILE *output;	    // the part, when streamed to a file
+	bool writing;	    // a part is open
+	size_t part;	    // parts written for the current section
+	size_t part_lines;
+	size_t sections;
+	bool skipping; // the current section was filtered out
+} hunk_splitter;
 
 static void usage(const char *prog)
 {
-	fprintf(stderr, "Usage: %s <patch-file>\n", prog);
+	fprintf(stderr,
+		"Usage: %s [--by-hunk | --max-lines N] [--include GLOB]... "
+		"[--exclude GLOB]...\n"
+		"          [--tree DIR | --tar FILE | --emit nul|length] "
+		"[--compress gzip|zstd]\n"
+		"          [--incremental] [--list] <patch-file | ->\n"
+		"\n"
+		"Writes one patch per file section. --by-hunk writes one patch "
+		"per hunk\n"
+		"instead, and --max-lines groups hunks into patches of at most "
+		"N lines;\n"
+		"both repeat the file header in every part.\n"
+		"\n"
+		"--include and --exclude select sections by path; a section "
+		"is kept when\n"
+		"it matches any --include (or none are given) and no "
+		"--exclude. --list\n"
+		"prints the selected paths instead of writing them.\n"
+		"\n"
+		"By default the patches get flattened names in the current "
+		"directory.\n"
+		"--tree mirrors the section paths under DIR, and --tar writes "
+		"them all\n"
+		"into one archive (- for stdout) that ends with a patch.index "
+		"member.\n"
+		"--emit writes them to stdout one after another, each followed "
+		"by a NUL\n"
+		"byte, or each after a \"LENGTH NAME\" line giving its size in "
+		"bytes.\n"
+		"--compress writes each patch compressed, with a .gz or .zst "
+		"suffix; with\n"
+		"--tar it compresses the archive, which a FILE ending in .gz, "
+		".tgz or\n"
+		".zst asks for too.\n"
+		"--incremental leaves outputs whose content did not change "
+		"untouched and\n"
+		"removes those a previous run wrote for sections that are "
+		"gone.\n"
+		"\n"
+		"With - the patch is read from stdin. Only one section, or one "
+		"part, is\n"
+		"held in memory at a time.\n",
+		prog);
+}
+
+// The patterns live for the whole run, so they come from plain malloc like
+// the stdout buffer: an accounted block would keep the arena out.
+static bool add_pattern(const char ***patterns, size_t *count,
+			size_t *capacity, const char *pattern)
+{
+	if (*count == *capacity) {
+		const size_t grown = *capacity ? *capacity * 2U : 8U;
+		const char **resized =
+			realloc(*patterns, grown * sizeof(**patterns));
+		if (!resized) {
+			return false;
+		}
+		*patterns = resized;
+		*capacity = grown;
+	}
+	(*patterns)[(*count)++] = pattern;
+	return true;
+}
+
+static int set_target(split_options *opts, split_target target,
+		      const char *destination)
+{
+	if (opts->target != SPLIT_TO_FILES) {
+		fprintf(stderr, "Error: --tree, --tar and --emit cannot be "
+				"combined\n");
+		return -1;
+	}
+	opts->target = target;
+	opts->destination = destination;
+	return 0;
+}
+
+static int parse_arguments(int argc, char **argv, split_options *opts)
+{
+	static const struct option long_options[] = {
+		{"by-hunk", no_argument, nullptr, 'H'},
+		{"max-lines", required_argument, nullptr, 'n'},
+		{"include", required_argument, nullptr, 'i'},
+		{"exclude", required_argument, nullptr, 'x'},
+		{"list", no_argument, nullptr, 'l'},
+		{"tree", required_argument, nullptr, 't'},
+		{"tar", required_argument, nullptr, 'a'},
+		{"emit", required_argument, nullptr, 'e'},
+		{"compress", required_argument, nullptr, 'z'},
+		{"incremental", no_argument, nullptr, 'I'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
+	};
+
+	bool compress_given = false;
+	int ch;
+	while ((ch = getopt_long(argc, argv, "Hn:i:x:lt:a:e:z:Ih",
+				 long_options, nullptr)) != -1) {
+		switch (ch) {
+		case 'H':
+			opts->by_hunk = true;
+			break;
+		case 'n': {
+			// strtoull would take "-5" and wrap it, so the
+			// number must start with a digit
+			char *end = nullptr;
+			errno = 0;
+			const unsigned long long value =
+				strtoull(optarg, &end, 10);
+			if (!isdigit((unsigned char)optarg[0]) ||
+			    errno == ERANGE || value > SIZE_MAX || !end ||
+			    *end != '\0' || value == 0U) {
+				fprintf(stderr,
+					"Error: --max-lines needs a positive "
+					"number\n");
+				return -1;
+			}
+			opts->max_lines = (size_t)value;
+			break;
+		}
+		case 'i':
+			if (!add_pattern(&opts->includes, &opts->include_count,
+					 &opts->include_capacity, optarg)) {
+				return -1;
+			}
+			break;
+		case 'x':
+			if (!add_pattern(&opts->excludes, &opts->exclude_count,
+					 &opts->exclude_capacity, optarg)) {
+				return -1;
+			}
+			break;
+		case 'l':
+			opts->list = true;
+			break;
+		case 't':
+			if (set_target(opts, SPLIT_TO_TREE, optarg) < 0) {
+				return -1;
+			}
+			break;
+		case 'a':
+			if (set_target(opts, SPLIT_TO_TAR, optarg) < 0) {
+				return -1;
+			}
+			break;
+		case 'e':
+			if (strcmp(optarg, "nul") == 0) {
+				opts->emit = SPLIT_EMIT_NUL;
+			} else if (strcmp(optarg, "length") == 0) {
+				opts->emit = SPLIT_EMIT_LENGTH;
+			} else {
+				fprintf(stderr,
+					"Error: --emit takes nul or length\n");
+				return -1;
+			}
+			if (set_target(opts, SPLIT_TO_STREAM, "-") < 0) {
+				return -1;
+			}
+			break;
+		case 'z':
+			if (!utils_compression_parse(optarg,
+						     &opts->compression)) {
+				fprintf(stderr,
+					"Error: unknown --compress format %s\n",
+					optarg);
+				return -1;
+			}
+			compress_given = true;
+			break;
+		case 'I':
+			opts->incremental = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (opts->by_hunk && opts->max_lines > 0U) {
+		fprintf(stderr, "Error: --by-hunk and --max-lines cannot be "
+				"combined\n");
+		return -1;
+	}
+	if (opts->incremental && (opts->target == SPLIT_TO_TAR ||
+				  opts->target == SPLIT_TO_STREAM)) {
+		fprintf(stderr, "Error: --incremental works on files, not on "
+				"--tar or --emit\n");
+		return -1;
+	}
+	if (!compress_given && opts->target == SPLIT_TO_TAR) {
+		opts->compression =
+			utils_compression_of_name(opts->destination);
+	}
+	if (!utils_compression_supported(opts->compression)) {
+		fprintf(stderr, "Error: this build cannot write %s files\n",
+			utils_compression_suffix(opts->compression));
+		return -1;
+	}
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return -1;
+	}
+	opts->input_path = argv[optind];
+	return 0;
+}
+
+static bool matches_any(const char *const *patterns, size_t count,
+			const char *path)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (fnmatch(patterns[i], path, 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool has_filters(const split_options *opts)
+{
+	return opts->include_count > 0U || opts->exclude_count > 0U;
+}
+
+// Globs match the whole path, and '*' crosses directories as it does in
+// git pathspecs.
+static bool path_selected(const split_options *opts, const char *path)
+{
+	if (opts->include_count > 0U &&
+	    !matches_any(opts->includes, opts->include_count, path)) {
+		return false;
+	}
+	return !matches_any(opts->excludes, opts->exclude_count, path);
 }
 
 static void sanitize_filename(const char *input, char *output, size_t size,
@@ -29,71 +370,830 @@ static void sanitize_filename(const char *input, char *output, size_t size,
 	}
 
 	if (out_idx == 0) {
-		FORMAT_MSG_INTO(output, "section_%zu", fallback_index);
+		utils_format_message((message_buf){output, size},
+				     "section_%zu", fallback_index);
 	} else {
 		output[out_idx] = '\0';
 	}
 }
 
-static bool write_section_callback(const patch_section *section, void *userdata)
+// Tree and archive output mirror a section path only if it stays inside
+// the destination: relative, with no empty, "." or ".." components.
+static bool mirrorable_path(const char *path)
+{
+	for (const char *cursor = path;;) {
+		const char *slash = strchr(cursor, '/');
+		const size_t length =
+			slash ? (size_t)(slash - cursor) : strlen(cursor);
+		// "." and ".." are both prefixes of ".."
+		const bool dots =
+			length <= 2U && strncmp(cursor, "..", length) == 0;
+		if (length == 0U || dots) {
+			return false;
+		}
+		if (!slash) {
+			return true;
+		}
+		cursor = slash + 1;
+	}
+}
+
+// Names the output for a section, or for one part of it when |part| is
+// not 0.
+static void output_name(const split_sink *sink, const char *path,
+			size_t index, size_t part, char *name, size_t size)
 {
-	size_t *section_counter = (size_t *)userdata;
+	char base[512];
+	if (sink->opts->target != SPLIT_TO_FILES && mirrorable_path(path)) {
+		FORMAT_MSG_INTO(base, "%s", path);
+	} else {
+		sanitize_filename(path, base, sizeof(base), index);
+	}
+
+	const char *suffix = utils_compression_suffix(sink->file_compression);
+	if (part > 0U) {
+		utils_format_message((message_buf){name, size},
+				     "%s.%04zu.patch%s", base, part, suffix);
+	} else {
+		utils_format_message((message_buf){name, size}, "%s.patch%s",
+				     base, suffix);
+	}
+}
+
+static void report_output(const split_sink *sink, const char *action,
+			  const char *name)
+{
+	// pieces on stdout leave no room for progress lines
+	if (sink->stream_on_stdout) {
+		return;
+	}
+	if (sink->opts->target == SPLIT_TO_TREE) {
+		printf("%s: %s/%s\n", action, sink->opts->destination, name);
+	} else {
+		printf("%s: %s\n", action, name);
+	}
+}
 
-	char sanitized[512];
-	sanitize_filename(section->path, sanitized, sizeof(sanitized),
-			  *section_counter);
-	++(*section_counter);
+// Directory output names are relative to.
+static int base_dir(const split_sink *sink)
+{
+	return sink->root >= 0 ? sink->root : AT_FDCWD;
+}
 
-	char filename[512];
-	FORMAT_MSG_INTO(filename, "%s.patch", sanitized);
+// Whether an output is written as it is produced, or collected first.
+static bool sink_streams(const split_sink *sink)
+{
+	return !sink->stream && !sink->opts->incremental;
+}
 
-	FILE *output = fopen(filename, "w");
+static void close_dirs(split_sink *sink)
+{
+	for (size_t i = 0; i < sink->dirs.capacity; ++i) {
+		if (sink->dirs.keys[i]) {
+			close((int)((uintptr_t)sink->dirs.values[i] - 1U));
+		}
+	}
+	utils_strmap_dispose(&sink->dirs, nullptr);
+}
+
+// Returns a descriptor for |dir| below the tree root, creating the
+// directories on the way. |dir| is modified while parents are looked up.
+static int open_dir(split_sink *sink, char *dir)
+{
+	const uintptr_t cached = (uintptr_t)utils_strmap_get(&sink->dirs, dir);
+	if (cached) {
+		return (int)(cached - 1U);
+	}
+
+	int parent = sink->root;
+	const char *name = dir;
+	char *slash = strrchr(dir, '/');
+	if (slash) {
+		*slash = '\0';
+		parent = open_dir(sink, dir);
+		*slash = '/';
+		name = slash + 1;
+	}
+	if (parent < 0 ||
+	    (mkdirat(parent, name, 0777) != 0 && errno != EEXIST)) {
+		return -1;
+	}
+
+	const int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0 &&
+	    !utils_strmap_put(&sink->dirs, dir, (void *)(uintptr_t)(fd + 1))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static FILE *create_in_tree(split_sink *sink, const char *name)
+{
+	char dir[600];
+	FORMAT_MSG_INTO(dir, "%s", name);
+	char *slash = strrchr(dir, '/');
+	int dir_fd = sink->root;
+	const char *base = name;
+	if (slash) {
+		*slash = '\0';
+		if (sink->dirs.count >= DIR_CACHE_LIMIT) {
+			close_dirs(sink);
+		}
+		dir_fd = open_dir(sink, dir);
+		base = name + (slash - dir) + 1;
+	}
+	if (dir_fd < 0) {
+		return nullptr;
+	}
+
+	const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	const int fd = openat(dir_fd, base, flags, 0666);
+	FILE *output = fd >= 0 ? fdopen(fd, "w") : nullptr;
+	if (!output && fd >= 0) {
+		close(fd);
+	}
+	return output;
+}
+
+// Opens a file to stream one output into, compressing if asked; not for
+// archive or --emit output.
+static FILE *sink_create(split_sink *sink, const char *name)
+{
+	TRACE_SCOPE_DETAIL("split.create", name);
+	FILE *file = sink->opts->target == SPLIT_TO_TREE
+			     ? create_in_tree(sink, name)
+			     : fopen(name, "w");
+	FILE *output = file ? utils_compress_open(file, true,
+						  sink->file_compression)
+			    : nullptr;
 	if (!output) {
-		fprintf(stderr, "Error: unable to create %s: %s\n", filename,
+		if (file) {
+			fclose(file);
+		}
+		fprintf(stderr, "Error: unable to create %s: %s\n", name,
 			strerror(errno));
+		return nullptr;
+	}
+	report_output(sink, "Extracting", name);
+	return output;
+}
+
+static bool load_manifest(split_sink *sink)
+{
+	const int fd = openat(base_dir(sink), MANIFEST_NAME,
+			      O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		// nothing to compare against on the first run
+		return errno == ENOENT;
+	}
+	FILE *input = fdopen(fd, "r");
+	if (!input) {
+		close(fd);
 		return false;
 	}
+	char *data = nullptr;
+	size_t length = 0U;
+	bool ok = utils_read_stream(input, &data, &length);
+	fclose(input);
 
-	printf("Extracting: %s\n", filename);
+	for (char *line = data; ok && line && *line;) {
+		char *newline = strchr(line, '\n');
+		if (newline) {
+			*newline = '\0';
+		}
+		char *field = nullptr;
+		const uint64_t hash = strtoull(line, &field, 16);
+		const size_t size =
+			*field == '\t' ? strtoull(field + 1, &field, 10) : 0U;
+		char *path = *field == '\t' ? field + 1 : nullptr;
+		char *name = path ? strchr(path, '\t') : nullptr;
+		if (name && name[1] != '\0') {
+			*name++ = '\0';
+			const size_t path_size = strlen(path) + 1U;
+			manifest_entry *entry =
+				utils_malloc(sizeof(*entry) + path_size);
+			ok = entry &&
+			     utils_strmap_put(&sink->previous, name, entry);
+			if (entry && !ok) {
+				utils_free(entry);
+			} else if (ok) {
+				entry->hash = hash;
+				entry->length = size;
+				entry->seen = false;
+				memcpy(entry->path, path, path_size);
+			}
+		}
+		line = newline ? newline + 1 : nullptr;
+	}
+	utils_free(data);
+	return ok;
+}
 
-	size_t written = fwrite(section->data, 1, section->length, output);
-	fclose(output);
+static bool same_content(const split_sink *sink, const char *name,
+			 const char *data, size_t length)
+{
+	const int fd = openat(base_dir(sink), name, O_RDONLY | O_CLOEXEC);
+	FILE *file = fd >= 0 ? fdopen(fd, "r") : nullptr;
+	// compressed outputs are compared by their text
+	FILE *input = file ? utils_decompress_open(file, true, nullptr)
+			   : nullptr;
+	if (!input) {
+		if (file) {
+			fclose(file);
+		} else if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+
+	char chunk[1U << 16];
+	size_t offset = 0U;
+	bool same = true;
+	for (size_t got; same && (got = fread(chunk, 1, sizeof(chunk), input));
+	     offset += got) {
+		same = offset + got <= length &&
+		       memcmp(chunk, data + offset, got) == 0;
+	}
+	same = same && !ferror(input) && offset == length;
+	fclose(input);
+	return same;
+}
+
+// Tells whether |name| already holds |data|: by the manifest when the
+// previous run recorded it, by reading the file back otherwise.
+static bool output_unchanged(split_sink *sink, const char *name,
+			     const char *data, size_t length, uint64_t hash)
+{
+	manifest_entry *entry = utils_strmap_get(&sink->previous, name);
+	if (entry) {
+		entry->seen = true;
+	}
+
+	// the size on disk only tells for uncompressed outputs
+	const bool sized = sink->file_compression == UTILS_COMPRESS_NONE;
+	struct stat info;
+	if (fstatat(base_dir(sink), name, &info, 0) != 0 ||
+	    !S_ISREG(info.st_mode) ||
+	    (sized && (uint64_t)info.st_size != length)) {
+		return false;
+	}
+	if (entry) {
+		return entry->hash == hash && entry->length == length;
+	}
+	return same_content(sink, name, data, length);
+}
+
+static bool manifest_append(split_sink *sink, const char *text)
+{
+	return utils_append_bytes(&sink->manifest, &sink->manifest_length,
+				  &sink->manifest_capacity, text, strlen(text));
+}
+
+// The name goes last so it may hold tabs; a section path holding one is
+// recorded as unknown.
+static bool record_output(split_sink *sink, const char *name,
+			  const char *path, uint64_t hash, size_t length)
+{
+	char sizes[64];
+	FORMAT_MSG_INTO(sizes, "%016" PRIx64 "\t%zu\t", hash, length);
+	return manifest_append(sink, sizes) &&
+	       manifest_append(sink, strchr(path, '\t') ? "" : path) &&
+	       manifest_append(sink, "\t") && manifest_append(sink, name) &&
+	       manifest_append(sink, "\n");
+}
+
+// Deletes an output of the previous run, then the directories that
+// leaves empty.
+static void remove_output(split_sink *sink, const char *name)
+{
+	// the manifest is only trusted with names this tool would write
+	if (!mirrorable_path(name)) {
+		return;
+	}
+	const int base = base_dir(sink);
+	if (unlinkat(base, name, 0) != 0) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "Warning: unable to remove %s: %s\n",
+				name, strerror(errno));
+		}
+		return;
+	}
+	report_output(sink, "Removing", name);
+	++sink->removed;
+
+	char dir[600];
+	FORMAT_MSG_INTO(dir, "%s", name);
+	for (char *slash; (slash = strrchr(dir, '/'));) {
+		*slash = '\0';
+		if (unlinkat(base, dir, AT_REMOVEDIR) != 0) {
+			break;
+		}
+	}
+}
+
+static bool write_manifest(split_sink *sink)
+{
+	const int base = base_dir(sink);
+	const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	const int fd = openat(base, MANIFEST_TEMP_NAME, flags, 0666);
+	FILE *output = fd >= 0 ? fdopen(fd, "w") : nullptr;
+	if (!output) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
 
-	if (written != section->length) {
+	const size_t written =
+		fwrite(sink->manifest, 1, sink->manifest_length, output);
+	const bool closed = fclose(output) == 0;
+	// renamed into place, so an interrupted run keeps the old manifest
+	return closed && written == sink->manifest_length &&
+	       renameat(base, MANIFEST_TEMP_NAME, base, MANIFEST_NAME) == 0;
+}
+
+// Removes the outputs of the previous run that this one did not produce.
+// Under --include or --exclude only the selected sections were split, so
+// an output of a section left out is kept, and stays in the manifest.
+static bool finish_incremental(split_sink *sink)
+{
+	TRACE_SCOPE("split.finish_incremental");
+	const split_options *opts = sink->opts;
+	const utils_strmap *previous = &sink->previous;
+	for (size_t i = 0; i < previous->capacity; ++i) {
+		const manifest_entry *entry = previous->values[i];
+		if (!previous->keys[i] || entry->seen) {
+			continue;
+		}
+		const bool selected = !has_filters(opts) ||
+				      (entry->path[0] != '\0' &&
+				       path_selected(opts, entry->path));
+		if (selected) {
+			remove_output(sink, previous->keys[i]);
+		} else if (!record_output(sink, previous->keys[i], entry->path,
+					  entry->hash, entry->length)) {
+			return false;
+		}
+	}
+
+	if (!write_manifest(sink)) {
+		fprintf(stderr, "Error: unable to write %s: %s\n",
+			MANIFEST_NAME, strerror(errno));
+		return false;
+	}
+	fflush(stdout);
+	fprintf(stderr, "%zu written, %zu unchanged, %zu removed\n",
+		sink->written, sink->unchanged, sink->removed);
+	return true;
+}
+
+// Appends one piece to the --emit stream. Patch text holds no NUL bytes,
+// binary changes included, so a NUL can end a piece.
+static bool emit_piece(split_sink *sink, const char *name, const char *data,
+		       size_t length)
+{
+	FILE *stream = sink->stream;
+	if (sink->opts->emit == SPLIT_EMIT_LENGTH) {
+		fprintf(stream, "%zu %s\n", length, name);
+	}
+	fwrite(data, 1, length, stream);
+	if (sink->opts->emit == SPLIT_EMIT_NUL) {
+		putc('\0', stream);
+	}
+	if (ferror(stream)) {
+		fprintf(stderr, "Error: failed to write %s to stdout\n", name);
+		return false;
+	}
+	return true;
+}
+
+static bool sink_write(split_sink *sink, const char *path, const char *name,
+		       const char *data, size_t length)
+{
+	if (sink->opts->target == SPLIT_TO_STREAM) {
+		return emit_piece(sink, name, data, length);
+	}
+	if (sink->stream) {
+		size_t offset = 0U;
+		if (!utils_tar_add(&sink->tar, name, data, length, &offset)) {
+			fprintf(stderr, "Error: failed to write %s to %s\n",
+				name, sink->opts->destination);
+			return false;
+		}
+		report_output(sink, "Extracting", name);
+
+		char entry[700];
+		FORMAT_MSG_INTO(entry, "%zu\t%zu\t%s\n", offset, length, name);
+		return utils_append_bytes(&sink->index, &sink->index_length,
+					  &sink->index_capacity, entry,
+					  strlen(entry));
+	}
+
+	if (sink->opts->incremental) {
+		const uint64_t hash = utils_hash_bytes(data, length);
+		if (!record_output(sink, name, path, hash, length)) {
+			return false;
+		}
+		if (output_unchanged(sink, name, data, length, hash)) {
+			++sink->unchanged;
+			return true;
+		}
+	}
+
+	FILE *output = sink_create(sink, name);
+	if (!output) {
+		return false;
+	}
+	const size_t written = fwrite(data, 1, length, output);
+	const bool closed = fclose(output) == 0;
+	if (written != length || !closed) {
 		fprintf(stderr, "Error: failed to write full contents to %s\n",
-			filename);
+			name);
 		return false;
 	}
+	++sink->written;
+	return true;
+}
 
+static bool sink_open(split_sink *sink, const split_options *opts)
+{
+	ZeroMemory(sink);
+	sink->opts = opts;
+	sink->root = -1;
+	// an archive or --emit stream is compressed as a whole instead
+	const bool to_stream = opts->target == SPLIT_TO_TAR ||
+			       opts->target == SPLIT_TO_STREAM;
+	sink->file_compression =
+		to_stream ? UTILS_COMPRESS_NONE : opts->compression;
+	const char *destination = opts->destination;
+
+	if (opts->target == SPLIT_TO_TREE) {
+		if (mkdir(destination, 0777) != 0 && errno != EEXIST) {
+			fprintf(stderr, "Error: unable to create %s: %s\n",
+				destination, strerror(errno));
+			return false;
+		}
+		sink->root =
+			open(destination, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (sink->root < 0) {
+			fprintf(stderr, "Error: unable to open %s: %s\n",
+				destination, strerror(errno));
+			return false;
+		}
+	} else if (to_stream) {
+		sink->stream_on_stdout = strcmp(destination, "-") == 0;
+		FILE *file = sink->stream_on_stdout ? stdout
+						     : fopen(destination, "wb");
+		sink->stream = file ? utils_compress_open(file, file != stdout,
+							   opts->compression)
+				     : nullptr;
+		if (!sink->stream) {
+			fprintf(stderr, "Error: unable to create %s: %s\n",
+				destination, strerror(errno));
+			if (file && file != stdout) {
+				fclose(file);
+			}
+			return false;
+		}
+		if (sink->stream == stdout) {
+			utils_buffer_stdout();
+		} else {
+			sink->stream_buffer = utils_buffer_stream(sink->stream);
+		}
+		if (opts->target == SPLIT_TO_TAR) {
+			utils_tar_init(&sink->tar, sink->stream);
+		}
+	}
+
+	if (opts->incremental && !load_manifest(sink)) {
+		fprintf(stderr, "Error: unable to read %s: %s\n", MANIFEST_NAME,
+			strerror(errno));
+		return false;
+	}
 	return true;
 }
 
-int main(int argc, char **argv)
+// Finishes the output. An archive gets its index member and end blocks
+// only when the split succeeded.
+static bool sink_close(split_sink *sink, bool ok)
 {
-	if (argc != 2) {
-		usage(argv[0]);
-		return 1;
+	if (sink->stream) {
+		TRACE_SCOPE("split.finish_stream");
+		// a failed split has reported its error already
+		bool written = !ok || sink->opts->target != SPLIT_TO_TAR ||
+			       (utils_tar_add(&sink->tar, "patch.index",
+					      sink->index, sink->index_length,
+					      nullptr) &&
+				utils_tar_finish(&sink->tar));
+		written = fflush(sink->stream) == 0 && written;
+		// a compressing stream over stdout leaves it open
+		if (sink->stream != stdout) {
+			written = fclose(sink->stream) == 0 && written;
+		}
+		if (!written) {
+			fprintf(stderr, "Error: failed to write %s\n",
+				sink->stream_on_stdout
+					? "stdout"
+					: sink->opts->destination);
+		}
+		ok = ok && written;
+	}
+	utils_free(sink->stream_buffer);
+	utils_free(sink->index);
+	utils_free(sink->manifest);
+	utils_strmap_dispose(&sink->previous, utils_free);
+	close_dirs(sink);
+	if (sink->root >= 0) {
+		close(sink->root);
+	}
+	return ok;
+}
+
+static bool write_section_callback(const patch_section *section, void *userdata)
+{
+	TRACE_SCOPE_DETAIL("split.write_section", section->path);
+	section_splitter *splitter = userdata;
+
+	char filename[600];
+	output_name(splitter->sink, section->path, splitter->sections, 0U,
+		    filename, sizeof(filename));
+	++splitter->sections;
+
+	return sink_write(splitter->sink, section->path, filename,
+			  section->data, section->length);
+}
+
+static bool write_part(hunk_splitter *splitter, const char *data,
+		       size_t length)
+{
+	if (splitter->output) {
+		fwrite(data, 1, length, splitter->output);
+		return true;
+	}
+	return utils_append_bytes(&splitter->buffer, &splitter->buffer_length,
+				  &splitter->buffer_capacity, data, length);
+}
+
+static bool close_part(hunk_splitter *splitter)
+{
+	if (!splitter->writing) {
+		return true;
+	}
+	splitter->writing = false;
+
+	if (!splitter->output) {
+		const size_t length = splitter->buffer_length;
+		splitter->buffer_length = 0U;
+		return sink_write(splitter->sink, splitter->path,
+				  splitter->filename, splitter->buffer, length);
+	}
+
+	const bool failed = ferror(splitter->output) != 0;
+	const bool closed = fclose(splitter->output) == 0;
+	splitter->output = nullptr;
+	if (failed || !closed) {
+		fprintf(stderr, "Error: failed to write full contents to %s\n",
+			splitter->filename);
+		return false;
+	}
+	return true;
+}
+
+// Starts the next part of the current section with a copy of its header.
+static bool open_part(hunk_splitter *splitter)
+{
+	if (!close_part(splitter)) {
+		return false;
+	}
+
+	output_name(splitter->sink, splitter->path, splitter->sections - 1U,
+		    ++splitter->part, splitter->filename,
+		    sizeof(splitter->filename));
+	TRACE_SCOPE_DETAIL("split.write_part", splitter->filename);
+	if (sink_streams(splitter->sink)) {
+		splitter->output =
+			sink_create(splitter->sink, splitter->filename);
+		if (!splitter->output) {
+			return false;
+		}
+	}
+
+	splitter->writing = true;
+	splitter->part_lines = 0U;
+	return write_part(splitter, splitter->header, splitter->header_length);
+}
+
+// Closes the last part of the current section. A section without hunks,
+// such as a binary or mode-only change, still gets a part of its own.
+static bool finish_section(hunk_splitter *splitter)
+{
+	if (splitter->part == 0U && splitter->header_length > 0U &&
+	    !open_part(splitter)) {
+		return false;
 	}
+	return close_part(splitter);
+}
+
+static bool split_line(const patch_line *line, void *userdata)
+{
+	hunk_splitter *splitter = userdata;
+	if (splitter->skipping && line->kind != PATCH_LINE_SECTION) {
+		return true;
+	}
+	switch (line->kind) {
+	case PATCH_LINE_SECTION:
+		if (!finish_section(splitter)) {
+			return false;
+		}
+		splitter->header_length = 0U;
+		splitter->part = 0U;
+		splitter->skipping = !path_selected(splitter->opts, line->path);
+		if (splitter->skipping) {
+			return true;
+		}
+		FORMAT_MSG_INTO(splitter->path, "%s", line->path);
+		++splitter->sections;
+		[[fallthrough]];
+	case PATCH_LINE_HEADER:
+		return utils_append_bytes(&splitter->header,
+					  &splitter->header_length,
+					  &splitter->header_capacity,
+					  line->text, line->length);
+	case PATCH_LINE_HUNK: {
+		// the ranges bound the hunk's size before its body is read:
+		// every body line is counted by at least one side
+		const size_t lines =
+			1U + line->hunk.old_lines + line->hunk.new_lines;
+		const bool full = splitter->opts->by_hunk ||
+				  (splitter->part_lines > 0U &&
+				   splitter->part_lines + lines >
+					   splitter->opts->max_lines);
+		if ((!splitter->writing || full) && !open_part(splitter)) {
+			return false;
+		}
+		splitter->part_lines += lines;
+		break;
+	}
+	case PATCH_LINE_BODY:
+		break;
+	}
+	return write_part(splitter, line->text, line->length);
+}
+
+static bool split_by_hunk(FILE *input, const split_options *opts,
+			  split_sink *sink, size_t *section_counter)
+{
+	hunk_splitter splitter = {.opts = opts, .sink = sink};
+	bool ok = patch_parse_lines(input, split_line, &splitter) &&
+		  finish_section(&splitter);
+	if (!ok && splitter.output) {
+		fclose(splitter.output);
+	}
+	utils_free(splitter.buffer);
+	utils_free(splitter.header);
+	*section_counter = splitter.sections;
+	return ok;
+}
 
-	const char *input_path = argv[1];
-	FILE *input = fopen(input_path, "r");
+static bool select_section(const char *path, void *userdata)
+{
+	const section_splitter *splitter = userdata;
+	return path_selected(splitter->opts, path);
+}
+
+static bool split_by_section(FILE *input, const split_options *opts,
+			     split_sink *sink, size_t *section_counter)
+{
+	section_splitter splitter = {.opts = opts, .sink = sink};
+	bool ok = patch_parse_filtered(input, select_section,
+				       write_section_callback, &splitter);
+	*section_counter = splitter.sections;
+	return ok;
+}
+
+// Sections are parsed one at a time and freed newest first, so a bump
+// allocator recycles the same chunk for the whole patch. It goes in before
+// the input and output are opened, since the swap is refused once any
+// block is live. Tree, archive and incremental output keep state of their
+// own across sections, which must not land in the arena.
+static utils_arena *arena_install(const split_options *opts)
+{
+	const bool stateless = (opts->target == SPLIT_TO_FILES ||
+				opts->target == SPLIT_TO_STREAM) &&
+			       !opts->incremental && !opts->list &&
+			       !opts->by_hunk && opts->max_lines == 0U;
+	utils_arena *arena = stateless ? utils_arena_new(0U) : nullptr;
+	const utils_allocator allocator = utils_arena_allocator(arena);
+	if (arena && !utils_mem_set_allocator(&allocator)) {
+		utils_arena_free(arena);
+		arena = nullptr;
+	}
+	return arena;
+}
+
+static void arena_remove(utils_arena *arena)
+{
+	// a block left behind would still point into the arena's chunks
+	if (arena && utils_mem_set_allocator(nullptr)) {
+		utils_arena_free(arena);
+	}
+}
+
+static bool list_section(const patch_section *section, void *userdata)
+{
+	section_splitter *splitter = userdata;
+	if (path_selected(splitter->opts, section->path)) {
+		printf("%s\n", section->path);
+		++splitter->sections;
+	}
+	return true;
+}
+
+// Only locates the sections, so listing a bundle copies none of it.
+static bool list_sections(FILE *input, const split_options *opts,
+			  size_t *section_counter)
+{
+	section_splitter splitter = {.opts = opts};
+	const bool ok = patch_scan(input, list_section, &splitter);
+	*section_counter = splitter.sections;
+	return ok;
+}
+
+static int run_split_patch(const split_options *opts)
+{
+	// "-" reads a pipe; sections are handled as they arrive, so memory
+	// stays bounded by the largest one
+	const bool from_stdin = strcmp(opts->input_path, "-") == 0;
+	const char *input_path = from_stdin ? "stdin" : opts->input_path;
+	utils_arena *arena = arena_install(opts);
+	FILE *file = from_stdin ? stdin : fopen(input_path, "r");
+	// decompressed here rather than by the parser, so a damaged stream
+	// can be told from a failed write
+	FILE *input = file ? utils_decompress_open(file, true, nullptr)
+			   : nullptr;
 	if (!input) {
 		fprintf(stderr, "Error: unable to open %s: %s\n", input_path,
 			strerror(errno));
+		if (file && file != stdin) {
+			fclose(file);
+		}
+		arena_remove(arena);
 		return 1;
 	}
 
 	size_t counter = 0U;
-	bool ok = patch_parse(input, write_section_callback, &counter);
+	bool ok;
+	if (opts->list) {
+		ok = list_sections(input, opts, &counter);
+	} else {
+		split_sink sink;
+		ok = sink_open(&sink, opts);
+		if (ok && (opts->by_hunk || opts->max_lines > 0U)) {
+			ok = split_by_hunk(input, opts, &sink, &counter);
+		} else if (ok) {
+			ok = split_by_section(input, opts, &sink, &counter);
+		}
+		// outputs are only pruned after the whole input was read and
+		// found to hold sections; anything less says nothing about
+		// which ones are gone
+		if (ok && opts->incremental && counter > 0U && !ferror(input)) {
+			ok = finish_incremental(&sink);
+		}
+		ok = sink_close(&sink, ok);
+	}
+	if (ferror(input)) {
+		fprintf(stderr, "Error: unable to read %s\n", input_path);
+		ok = false;
+	}
 	fclose(input);
+	arena_remove(arena);
 
-	if (!ok || counter == 0U) {
-		if (ok) {
-			fprintf(stderr, "No patch sections were found in %s\n",
-				input_path);
-		}
+	if (!ok) {
+		return 1;
+	}
+	if (counter == 0U) {
+		fprintf(stderr, "No patch sections were %s in %s\n",
+			has_filters(opts) ? "selected" : "found", input_path);
 		return 1;
 	}
 
 	return 0;
 }
+
+int main(int argc, char **argv)
+{
+	split_options opts = {0};
+	int rc = parse_arguments(argc, argv, &opts);
+	if (rc == 0) {
+		utils_trace_start();
+		utils_mem_report_at_exit();
+		rc = run_split_patch(&opts);
+	} else {
+		rc = 1;
+	}
+
+	free(opts.includes);
+	free(opts.excludes);
+	return rc;
+}
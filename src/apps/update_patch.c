@@ -1,6 +1,8 @@
 #include "libs/git/git.h"
 #include "libs/patch/patch.h"
 #include "libs/ui/ui.h"
+#include "libs/util/compress.h"
+#include "libs/util/trace.h"
 #include "libs/util/util.h"
 
 #include <errno.h>
@@ -35,6 +37,54 @@ typedef struct {
 	size_t capacity;
 } patch_sections;
 
+// Where untouched sections are copied from: the patch file itself by byte
+// range, or its decompressed text when the file is compressed. The updated
+// patch is written back in the same format.
+typedef struct {
+	utils_compression format;
+	char *text;
+	size_t length;
+} patch_source;
+
+typedef struct {
+	git_repository *repo;
+	gitutils_diffstat_cache *cache;
+	const ui_list_item *items;
+} describe_context;
+
+static bool describe_item(size_t index, char *buffer, size_t size,
+			  void *userdata)
+{
+	const describe_context *ctx = userdata;
+	return gitutils_diffstat_cache_describe(
+		ctx->cache, ctx->items[index].label,
+		ctx->items[index].description, buffer, size);
+}
+
+static bool preview_item(size_t index, char **out_text, size_t *out_length,
+			 void *userdata)
+{
+	const describe_context *ctx = userdata;
+	FILE *memory = open_memstream(out_text, out_length);
+	if (!memory) {
+		return false;
+	}
+
+	bool has_changes = false;
+	int rc = gitutils_write_diff_for_path(
+		ctx->repo, ctx->items[index].label, memory, &has_changes);
+	return fclose(memory) == 0 && (rc == 0 || rc == GIT_ENOTFOUND);
+}
+
+static ui_multiselect_options describe_options(describe_context *ctx)
+{
+	return (ui_multiselect_options){
+		.describe = ctx->cache ? describe_item : nullptr,
+		.preview = preview_item,
+		.userdata = ctx,
+	};
+}
+
 static void report_git_error(const char *context, int error_code)
 {
 	const git_error *err = git_error_last();
@@ -54,7 +104,7 @@ static void patch_sections_free(patch_sections *out)
 	for (size_t i = 0; i < out->count; ++i) {
 		patch_section_reset(&out->sections[i]);
 	}
-	free(out->sections);
+	utils_free(out->sections);
 }
 
 static bool collect_sections_callback(const patch_section *section,
@@ -66,31 +116,44 @@ static bool collect_sections_callback(const patch_section *section,
 		return false;
 	}
 
+	// only remember where the section lives; write_final_patch() copies
+	// untouched sections straight out of the original file
 	patch_section *slot = &dest->sections[dest->count++];
 	if (!patch_section_init(slot, section->path)) {
 		--dest->count;
 		return false;
 	}
-
-	if (!patch_section_append(slot, section->data, section->length)) {
-		patch_section_reset(slot);
-		--dest->count;
-		return false;
-	}
+	slot->offset = section->offset;
+	slot->length = section->length;
 
 	return true;
 }
 
-static int parse_patch_file(const char *path, patch_sections *out)
+static int parse_patch_file(const char *path, patch_sections *out,
+			    patch_source *source)
 {
-	FILE *input = fopen(path, "r");
+	FILE *file = fopen(path, "r");
+	FILE *input = file ? utils_decompress_open(file, true, &source->format)
+			   : nullptr;
 	if (!input) {
 		fprintf(stderr, "Error: unable to open %s: %s\n", path,
 			strerror(errno));
+		if (file) {
+			fclose(file);
+		}
 		return -1;
 	}
 
-	bool ok = patch_parse(input, collect_sections_callback, out);
+	bool ok;
+	if (source->format == UTILS_COMPRESS_NONE) {
+		ok = patch_scan(input, collect_sections_callback, out);
+	} else {
+		// offsets into a compressed file cannot be copied from, so
+		// the text is kept for write_final_patch()
+		ok = utils_read_stream(input, &source->text, &source->length) &&
+		     patch_scan_buffer(source->text, source->length,
+				       collect_sections_callback, out);
+	}
 	fclose(input);
 
 	if (!ok || out->count == 0U) {
@@ -112,10 +175,10 @@ static void patch_entry_list_free(patch_entry_list *list)
 	}
 	for (size_t i = 0; i < list->count; ++i) {
 		if (list->items[i].owns_path) {
-			free(list->items[i].path);
+			utils_free(list->items[i].path);
 		}
 	}
-	free(list->items);
+	utils_free(list->items);
 	list->items = nullptr;
 	list->count = 0;
 	list->capacity = 0;
@@ -138,34 +201,23 @@ static bool patch_entry_list_append(patch_entry_list *list, patch_entry entry)
 	return true;
 }
 
-static patch_entry *patch_entry_list_find(patch_entry_list *list,
-					  const char *path)
-{
-	if (!list || !path) {
-		return nullptr;
-	}
-	for (size_t i = 0; i < list->count; ++i) {
-		if (strcmp(list->items[i].path, path) == 0) {
-			return &list->items[i];
-		}
-	}
-	return nullptr;
-}
-
-static void patch_entry_list_remove_at(patch_entry_list *list, size_t index)
+// Drops every entry whose index is set in |selected| in one compacting pass.
+static void patch_entry_list_remove_selected(patch_entry_list *list,
+					     const ui_selection *selected)
 {
-	if (!list || index >= list->count) {
+	if (!list || !selected) {
 		return;
 	}
 
-	if (list->items[index].owns_path) {
-		free(list->items[index].path);
-	}
-
-	for (size_t i = index + 1; i < list->count; ++i) {
-		list->items[i - 1] = list->items[i];
+	size_t kept = 0U;
+	for (size_t i = 0; i < list->count; ++i) {
+		if (!ui_selection_test(selected, i)) {
+			list->items[kept++] = list->items[i];
+		} else if (list->items[i].owns_path) {
+			utils_free(list->items[i].path);
+		}
 	}
-	--list->count;
+	list->count = kept;
 }
 
 static int collect_patch_entries(patch_section *sections, size_t section_count,
@@ -189,7 +241,8 @@ static int collect_patch_entries(patch_section *sections, size_t section_count,
 	return 0;
 }
 
-static int handle_add_files(git_repository *repo, patch_entry_list *entries)
+static int handle_add_files(git_repository *repo, patch_entry_list *entries,
+			    gitutils_diffstat_cache *diffstats)
 {
 	gitutils_status_list status_list = {0};
 	int rc = gitutils_collect_status(repo, &status_list);
@@ -198,16 +251,28 @@ static int handle_add_files(git_repository *repo, patch_entry_list *entries)
 		return rc;
 	}
 
+	// index the patch's paths once instead of a linear find per file
+	utils_strmap in_patch = {0};
+	for (size_t i = 0; i < entries->count; ++i) {
+		if (!utils_strmap_put(&in_patch, entries->items[i].path,
+				      &entries->items[i])) {
+			utils_strmap_dispose(&in_patch, nullptr);
+			gitutils_status_list_free(&status_list);
+			return GIT_ERROR;
+		}
+	}
+
 	size_t available = 0;
-	ui_list_item *items = calloc(status_list.count, sizeof(*items));
+	ui_list_item *items = utils_calloc(status_list.count, sizeof(*items));
 	if (!items && status_list.count > 0) {
+		utils_strmap_dispose(&in_patch, nullptr);
 		gitutils_status_list_free(&status_list);
 		return GIT_ERROR;
 	}
 
 	for (size_t i = 0; i < status_list.count; ++i) {
 		gitutils_status_entry *entry = &status_list.entries[i];
-		if (patch_entry_list_find(entries, entry->path)) {
+		if (utils_strmap_get(&in_patch, entry->path)) {
 			continue;
 		}
 		items[available].label = entry->path;
@@ -217,43 +282,59 @@ static int handle_add_files(git_repository *repo, patch_entry_list *entries)
 		items[available].selected = false;
 		++available;
 	}
+	utils_strmap_dispose(&in_patch, nullptr);
 
 	if (available == 0) {
-		free(items);
+		utils_free(items);
 		gitutils_status_list_free(&status_list);
 		ui_show_message("Add Files",
 				"No modified or untracked files available.");
 		return 0;
 	}
 
-	int selection = ui_multiselect(
+	ui_selection selected = {0};
+	if (!ui_selection_init(&selected, available)) {
+		utils_free(items);
+		gitutils_status_list_free(&status_list);
+		return GIT_ERROR;
+	}
+
+	describe_context describe = {
+		.repo = repo, .cache = diffstats, .items = items};
+	ui_multiselect_options options = describe_options(&describe);
+	options.selection = &selected;
+	options.tree = true;
+	int selection = ui_multiselect_ex(
 		"Add Files", "Select files to add to the patch:", items,
-		available);
+		available, &options);
 	if (selection < 0) {
-		free(items);
+		ui_selection_dispose(&selected);
+		utils_free(items);
 		gitutils_status_list_free(&status_list);
 		return 0;
 	}
 
 	bool added_any = false;
-	for (size_t j = 0; j < available; ++j) {
-		if (!items[j].selected) {
-			continue;
-		}
-		if (patch_entry_list_find(entries, items[j].label)) {
-			continue;
-		}
+	if (!patch_entry_list_reserve(entries, selected.selected)) {
+		ui_selection_dispose(&selected);
+		utils_free(items);
+		gitutils_status_list_free(&status_list);
+		return GIT_ERROR;
+	}
+	for (size_t j = ui_selection_next(&selected, 0U); j != SIZE_MAX;
+	     j = ui_selection_next(&selected, j + 1U)) {
 		patch_entry new_entry = {
 			.section = nullptr,
-			.path = strdup(items[j].label),
+			.path = utils_strdup(items[j].label),
 			.owns_path = true,
 			.mark_for_update = false,
 			.is_original = false,
 		};
 		if (!new_entry.path ||
 		    !patch_entry_list_append(entries, new_entry)) {
-			free(new_entry.path);
-			free(items);
+			utils_free(new_entry.path);
+			ui_selection_dispose(&selected);
+			utils_free(items);
 			gitutils_status_list_free(&status_list);
 			return GIT_ERROR;
 		}
@@ -264,12 +345,15 @@ static int handle_add_files(git_repository *repo, patch_entry_list *entries)
 		ui_show_message("Add Files", "Files added to patch list.");
 	}
 
-	free(items);
+	ui_selection_dispose(&selected);
+	utils_free(items);
 	gitutils_status_list_free(&status_list);
 	return 0;
 }
 
-static void handle_remove_files(patch_entry_list *entries)
+static void handle_remove_files(git_repository *repo,
+				patch_entry_list *entries,
+				gitutils_diffstat_cache *diffstats)
 {
 	if (entries->count == 0) {
 		ui_show_message("Remove Files",
@@ -277,7 +361,7 @@ static void handle_remove_files(patch_entry_list *entries)
 		return;
 	}
 
-	ui_list_item *items = calloc(entries->count, sizeof(*items));
+	ui_list_item *items = utils_calloc(entries->count, sizeof(*items));
 	if (!items) {
 		ui_show_message("Remove Files", "Unable to allocate memory.");
 		return;
@@ -290,29 +374,33 @@ static void handle_remove_files(patch_entry_list *entries)
 		items[i].selected = false;
 	}
 
-	int selection = ui_multiselect(
+	ui_selection selected = {0};
+	if (!ui_selection_init(&selected, entries->count)) {
+		utils_free(items);
+		ui_show_message("Remove Files", "Unable to allocate memory.");
+		return;
+	}
+
+	describe_context describe = {
+		.repo = repo, .cache = diffstats, .items = items};
+	ui_multiselect_options options = describe_options(&describe);
+	options.selection = &selected;
+	options.tree = true;
+	int selection = ui_multiselect_ex(
 		"Remove Files", "Select files to remove from the patch:", items,
-		entries->count);
-	if (selection >= 0) {
-		bool removed_any = false;
-		for (ssize_t idx = (ssize_t)entries->count - 1; idx >= 0;
-		     --idx) {
-			if (items[idx].selected) {
-				patch_entry_list_remove_at(entries,
-							   (size_t)idx);
-				removed_any = true;
-			}
-		}
-		if (removed_any) {
-			ui_show_message("Remove Files",
-					"Selected files removed.");
-		}
+		entries->count, &options);
+	if (selection > 0) {
+		patch_entry_list_remove_selected(entries, &selected);
+		ui_show_message("Remove Files", "Selected files removed.");
 	}
 
-	free(items);
+	ui_selection_dispose(&selected);
+	utils_free(items);
 }
 
-static void handle_update_flags(patch_entry_list *entries)
+static void handle_update_flags(git_repository *repo,
+				patch_entry_list *entries,
+				gitutils_diffstat_cache *diffstats)
 {
 	if (entries->count == 0) {
 		ui_show_message("Update Files",
@@ -320,7 +408,7 @@ static void handle_update_flags(patch_entry_list *entries)
 		return;
 	}
 
-	ui_list_item *items = calloc(entries->count, sizeof(*items));
+	ui_list_item *items = utils_calloc(entries->count, sizeof(*items));
 	if (!items) {
 		ui_show_message("Update Files", "Unable to allocate memory.");
 		return;
@@ -333,10 +421,13 @@ static void handle_update_flags(patch_entry_list *entries)
 		items[i].selected = entries->items[i].mark_for_update;
 	}
 
-	int selection = ui_multiselect(
+	describe_context describe = {
+		.repo = repo, .cache = diffstats, .items = items};
+	const ui_multiselect_options options = describe_options(&describe);
+	int selection = ui_multiselect_ex(
 		"Update Files",
 		"Select files to refresh from current changes:", items,
-		entries->count);
+		entries->count, &options);
 	if (selection >= 0) {
 		for (size_t i = 0; i < entries->count; ++i) {
 			entries->items[i].mark_for_update = items[i].selected;
@@ -344,12 +435,40 @@ static void handle_update_flags(patch_entry_list *entries)
 		ui_show_message("Update Files", "Update selection recorded.");
 	}
 
-	free(items);
+	utils_free(items);
+}
+
+static void discard_temp_file(FILE *temp_file, const char *temp_path,
+			      int source_fd, const char *message)
+{
+	fclose(temp_file);
+	unlink(temp_path);
+	if (source_fd >= 0) {
+		close(source_fd);
+	}
+	ui_show_message("Finalize Patch", message);
+}
+
+static bool copy_section(const patch_source *source,
+			 const patch_section *section, int source_fd,
+			 FILE *output, int output_fd)
+{
+	if (source->text) {
+		return fwrite(source->text + section->offset, 1,
+			      section->length, output) == section->length;
+	}
+	// hand buffered diffs to the fd before the kernel appends the
+	// original bytes
+	return fflush(output) == 0 &&
+	       utils_copy_range(source_fd, (off_t)section->offset,
+				section->length, output_fd);
 }
 
-static int write_final_patch(const char *patch_path, git_repository *repo,
+static int write_final_patch(const char *patch_path,
+			     const patch_source *source, git_repository *repo,
 			     patch_entry_list *entries)
 {
+	TRACE_SCOPE("update.write_final_patch");
 	if (entries->count == 0) {
 		ui_show_message("Finalize Patch",
 				"No files selected. Patch not updated.");
@@ -373,22 +492,45 @@ static int write_final_patch(const char *patch_path, git_repository *repo,
 		strcpy(directory, ".");
 	}
 
+	// untouched sections are copied from here by byte range
+	int source_fd =
+		source->text ? -1 : open(patch_path, O_RDONLY | O_CLOEXEC);
+	if (source_fd < 0 && !source->text) {
+		FORMAT_MSG(msg, 512, "Unable to reopen %s: %s", patch_path,
+			   strerror(errno));
+		ui_show_message("Finalize Patch", msg);
+		return -1;
+	}
+
 	FORMAT_MSG_INTO(temp_template, "%s/.patchutilsXXXXXX", directory);
 
 	int temp_fd = mkstemp(temp_template);
 	if (temp_fd < 0) {
 		FORMAT_MSG(msg, 512, "Unable to create temporary file: %s",
 			   strerror(errno));
+		if (source_fd >= 0) {
+			close(source_fd);
+		}
 		ui_show_message("Finalize Patch", msg);
 		return -1;
 	}
 
-	FILE *temp_file = fdopen(temp_fd, "w");
+	FILE *raw_file = fdopen(temp_fd, "w");
+	FILE *temp_file = raw_file ? utils_compress_open(raw_file, true,
+							 source->format)
+				   : nullptr;
 	if (!temp_file) {
 		FORMAT_MSG(msg, 512, "Unable to open temporary file: %s",
 			   strerror(errno));
-		close(temp_fd);
+		if (raw_file) {
+			fclose(raw_file);
+		} else {
+			close(temp_fd);
+		}
 		unlink(temp_template);
+		if (source_fd >= 0) {
+			close(source_fd);
+		}
 		ui_show_message("Finalize Patch", msg);
 		return -1;
 	}
@@ -407,9 +549,8 @@ static int write_final_patch(const char *patch_path, git_repository *repo,
 			if (rc < 0 && rc != GIT_ENOTFOUND) {
 				FORMAT_MSG(msg, 512, "Failed to diff %s",
 					   entry->path);
-				fclose(temp_file);
-				unlink(temp_template);
-				ui_show_message("Finalize Patch", msg);
+				discard_temp_file(temp_file, temp_template,
+						  source_fd, msg);
 				return -1;
 			}
 
@@ -419,24 +560,23 @@ static int write_final_patch(const char *patch_path, git_repository *repo,
 				FORMAT_MSG(msg, 512,
 					   "No current changes for new file %s",
 					   entry->path);
-				fclose(temp_file);
-				unlink(temp_template);
-				ui_show_message("Finalize Patch", msg);
+				discard_temp_file(temp_file, temp_template,
+						  source_fd, msg);
 				return -1;
 			} else if (entry->mark_for_update) {
 				++skipped_updates;
 			}
 		} else if (entry->section) {
+			TRACE_SCOPE_DETAIL("update.copy_section", entry->path);
 			if (entry->section->length > 0) {
-				size_t written = fwrite(entry->section->data, 1,
-							entry->section->length,
-							temp_file);
-				if (written != entry->section->length) {
-					fclose(temp_file);
-					unlink(temp_template);
-					ui_show_message("Finalize Patch",
-							"Failed to write to "
-							"temporary file.");
+				if (!copy_section(source, entry->section,
+						  source_fd, temp_file,
+						  temp_fd)) {
+					discard_temp_file(
+						temp_file, temp_template,
+						source_fd,
+						"Failed to write to "
+						"temporary file.");
 					return -1;
 				}
 				wrote = true;
@@ -448,6 +588,10 @@ static int write_final_patch(const char *patch_path, git_repository *repo,
 		}
 	}
 
+	if (source_fd >= 0) {
+		close(source_fd);
+	}
+
 	fflush(temp_file);
 	if (fclose(temp_file) != 0) {
 		FORMAT_MSG(msg, 512, "Failed to close temporary file: %s",
@@ -489,7 +633,9 @@ static int write_final_patch(const char *patch_path, git_repository *repo,
 static int run_update_patch(const char *patch_path)
 {
 	patch_sections sections = {0};
-	if (parse_patch_file(patch_path, &sections) < 0) {
+	patch_source source = {0};
+	if (parse_patch_file(patch_path, &sections, &source) < 0) {
+		utils_free(source.text);
 		return 1;
 	}
 
@@ -497,15 +643,17 @@ static int run_update_patch(const char *patch_path)
 	if (collect_patch_entries(sections.sections, sections.count, &entries) <
 	    0) {
 		patch_sections_free(&sections);
+		utils_free(source.text);
 		fprintf(stderr, "Error: unable to load patch entries.\n");
 		return 1;
 	}
 
-	int rc = git_libgit2_init();
+	int rc = gitutils_init();
 	if (rc < 0) {
 		report_git_error("Failed to initialize libgit2", rc);
 		patch_entry_list_free(&entries);
 		patch_sections_free(&sections);
+		utils_free(source.text);
 		return 1;
 	}
 
@@ -515,6 +663,7 @@ static int run_update_patch(const char *patch_path)
 		report_git_error("Not inside a git repository", rc);
 		patch_entry_list_free(&entries);
 		patch_sections_free(&sections);
+		utils_free(source.text);
 		git_libgit2_shutdown();
 		return 1;
 	}
@@ -523,11 +672,15 @@ static int run_update_patch(const char *patch_path)
 		fprintf(stderr, "Failed to initialize terminal UI\n");
 		patch_entry_list_free(&entries);
 		patch_sections_free(&sections);
+		utils_free(source.text);
 		git_repository_free(repo);
 		git_libgit2_shutdown();
 		return 1;
 	}
 
+	// diffstats stay cached for the whole session, across every screen
+	gitutils_diffstat_cache *diffstats = gitutils_diffstat_cache_new(repo);
+
 	const char *menu_options[] = {
 		"Add Files to Patch", "Remove Files from Patch",
 		"Update Existing Files", "Finalize Patch"};
@@ -539,8 +692,10 @@ static int run_update_patch(const char *patch_path)
 				       "Choose an option:", menu_options, 4);
 		if (choice < 0) {
 			ui_shutdown();
+			gitutils_diffstat_cache_free(diffstats);
 			patch_entry_list_free(&entries);
 			patch_sections_free(&sections);
+			utils_free(source.text);
 			git_repository_free(repo);
 			git_libgit2_shutdown();
 			fprintf(stderr, "Operation cancelled\n");
@@ -549,13 +704,13 @@ static int run_update_patch(const char *patch_path)
 
 		switch (choice) {
 		case 0:
-			handle_add_files(repo, &entries);
+			handle_add_files(repo, &entries, diffstats);
 			break;
 		case 1:
-			handle_remove_files(&entries);
+			handle_remove_files(repo, &entries, diffstats);
 			break;
 		case 2:
-			handle_update_flags(&entries);
+			handle_update_flags(repo, &entries, diffstats);
 			break;
 		case 3:
 			done = true;
@@ -565,11 +720,13 @@ static int run_update_patch(const char *patch_path)
 		}
 	}
 
-	int ret = write_final_patch(patch_path, repo, &entries);
+	int ret = write_final_patch(patch_path, &source, repo, &entries);
 
 	ui_shutdown();
+	gitutils_diffstat_cache_free(diffstats);
 	patch_entry_list_free(&entries);
 	patch_sections_free(&sections);
+	utils_free(source.text);
 	git_repository_free(repo);
 	git_libgit2_shutdown();
 
@@ -582,6 +739,8 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Usage: %s <patch-file>\n", argv[0]);
 		return 1;
 	}
+	utils_trace_start();
+	utils_mem_report_at_exit();
 
 	const char *patch_path = argv[1];
 	struct stat st;
@@ -0,0 +1,339 @@
+#include "patchutils.h"
+
+#include "git/git.h"
+#include "patch/patch.h"
+#include "util/util.h"
+
+#include <git2.h>
+#include <stdint.h>
+
+struct patchutils_context {
+	git_repository *repo;
+	git_index *index; // held so it stays loaded between calls
+	gitutils_diff_pool pool;
+	bool pool_ready;
+	char error[512];
+};
+
+struct patchutils_patch_index {
+	patchutils_section *sections;
+	size_t count;
+	size_t capacity;
+	utils_strmap by_path; // path -> first section index + 1
+};
+
+const char *patchutils_version(int *major, int *minor, int *patch)
+{
+	if (major) {
+		*major = PATCHUTILS_VERSION_MAJOR;
+	}
+	if (minor) {
+		*minor = PATCHUTILS_VERSION_MINOR;
+	}
+	if (patch) {
+		*patch = PATCHUTILS_VERSION_PATCH;
+	}
+	return PATCHUTILS_VERSION;
+}
+
+typedef struct {
+	patchutils_section_callback callback;
+	void *userdata;
+	bool stopped;
+} parse_adapter;
+
+static bool forward_section(const patch_section *section, void *userdata)
+{
+	parse_adapter *adapter = userdata;
+	const patchutils_section public_section = {
+		.path = section->path,
+		.data = section->data,
+		.length = section->length,
+		.offset = section->offset,
+	};
+	if (!adapter->callback(&public_section, adapter->userdata)) {
+		adapter->stopped = true;
+		return false;
+	}
+	return true;
+}
+
+int patchutils_parse_patch(FILE *input, patchutils_section_callback callback,
+			   void *userdata)
+{
+	if (!input || !callback) {
+		return PATCHUTILS_EINVALID;
+	}
+
+	parse_adapter adapter = {.callback = callback, .userdata = userdata};
+	if (!patch_parse(input, forward_section, &adapter)) {
+		return adapter.stopped ? PATCHUTILS_EUSER : PATCHUTILS_ERROR;
+	}
+	return PATCHUTILS_OK;
+}
+
+int patchutils_parse_patch_buffer(const char *data, size_t length,
+				  patchutils_section_callback callback,
+				  void *userdata)
+{
+	if ((!data && length > 0U) || !callback) {
+		return PATCHUTILS_EINVALID;
+	}
+	if (length == 0U) {
+		return PATCHUTILS_OK;
+	}
+
+	FILE *input = fmemopen((void *)data, length, "r");
+	if (!input) {
+		return PATCHUTILS_ENOMEM;
+	}
+	const int error = patchutils_parse_patch(input, callback, userdata);
+	fclose(input);
+	return error;
+}
+
+static bool index_section(const patch_section *section, void *userdata)
+{
+	patchutils_patch_index *index = userdata;
+	if (!utils_array_reserve((void **)&index->sections, &index->capacity,
+				 index->count + 1U, sizeof(*index->sections))) {
+		return false;
+	}
+
+	char *path = utils_strdup(section->path);
+	if (!path) {
+		return false;
+	}
+	index->sections[index->count++] = (patchutils_section){
+		.path = path,
+		.length = section->length,
+		.offset = section->offset,
+	};
+	// a patch may touch a path twice; lookups return the first section
+	if (!utils_strmap_get(&index->by_path, path)) {
+		return utils_strmap_put(&index->by_path, path,
+					(void *)(uintptr_t)index->count);
+	}
+	return true;
+}
+
+int patchutils_patch_index_build(FILE *input, patchutils_patch_index **out)
+{
+	if (!input || !out) {
+		return PATCHUTILS_EINVALID;
+	}
+
+	*out = nullptr;
+	patchutils_patch_index *index = utils_calloc(1U, sizeof(*index));
+	if (!index) {
+		return PATCHUTILS_ENOMEM;
+	}
+	if (!patch_scan(input, index_section, index)) {
+		patchutils_patch_index_free(index);
+		return PATCHUTILS_ERROR;
+	}
+	*out = index;
+	return PATCHUTILS_OK;
+}
+
+void patchutils_patch_index_free(patchutils_patch_index *index)
+{
+	if (!index) {
+		return;
+	}
+	for (size_t i = 0; i < index->count; ++i) {
+		utils_free((char *)index->sections[i].path);
+	}
+	utils_free(index->sections);
+	utils_strmap_dispose(&index->by_path, nullptr);
+	utils_free(index);
+}
+
+size_t patchutils_patch_index_count(const patchutils_patch_index *index)
+{
+	return index ? index->count : 0U;
+}
+
+const patchutils_section *
+patchutils_patch_index_at(const patchutils_patch_index *index, size_t i)
+{
+	return index && i < index->count ? &index->sections[i] : nullptr;
+}
+
+const patchutils_section *
+patchutils_patch_index_find(const patchutils_patch_index *index,
+			    const char *path)
+{
+	if (!index || !path) {
+		return nullptr;
+	}
+	const uintptr_t slot =
+		(uintptr_t)utils_strmap_get(&index->by_path, path);
+	return slot ? &index->sections[slot - 1U] : nullptr;
+}
+
+// Maps a libgit2 result onto the public codes and keeps its message.
+static int context_fail(patchutils_context *ctx, int error)
+{
+	if (error >= 0) {
+		return PATCHUTILS_OK;
+	}
+
+	const git_error *err = git_error_last();
+	FORMAT_MSG_INTO(ctx->error, "%s (code %d)",
+			err && err->message ? err->message : "libgit2 error",
+			error);
+	switch (error) {
+	case GIT_ENOTFOUND:
+		return PATCHUTILS_ENOTFOUND;
+	case GIT_EUSER:
+		return PATCHUTILS_EUSER;
+	default:
+		return PATCHUTILS_ERROR;
+	}
+}
+
+int patchutils_context_open(patchutils_context **out, const char *path)
+{
+	if (!out) {
+		return PATCHUTILS_EINVALID;
+	}
+
+	*out = nullptr;
+	patchutils_context *ctx = utils_calloc(1U, sizeof(*ctx));
+	if (!ctx) {
+		return PATCHUTILS_ENOMEM;
+	}
+
+	// reference counted, so this is safe next to a host that also uses
+	// libgit2; the host's allocator settings are left alone
+	int error = git_libgit2_init();
+	if (error < 0) {
+		utils_free(ctx);
+		return PATCHUTILS_ERROR;
+	}
+
+	error = gitutils_open_repository(&ctx->repo, path);
+	if (error == 0) {
+		error = git_repository_index(&ctx->index, ctx->repo);
+	}
+	if (error < 0) {
+		const int result = context_fail(ctx, error);
+		patchutils_context_free(ctx);
+		return result;
+	}
+	*out = ctx;
+	return PATCHUTILS_OK;
+}
+
+void patchutils_context_free(patchutils_context *ctx)
+{
+	if (!ctx) {
+		return;
+	}
+	gitutils_diff_pool_dispose(&ctx->pool);
+	git_index_free(ctx->index);
+	git_repository_free(ctx->repo);
+	utils_free(ctx);
+	git_libgit2_shutdown();
+}
+
+int patchutils_context_refresh(patchutils_context *ctx)
+{
+	if (!ctx) {
+		return PATCHUTILS_EINVALID;
+	}
+
+	git_odb *odb = nullptr;
+	int error = git_index_read(ctx->index, false);
+	if (error == 0) {
+		error = git_repository_odb(&odb, ctx->repo);
+	}
+	if (error == 0) {
+		error = git_odb_refresh(odb);
+	}
+	git_odb_free(odb);
+	// worker handles cache their own object databases
+	gitutils_diff_pool_dispose(&ctx->pool);
+	ctx->pool_ready = false;
+	return context_fail(ctx, error);
+}
+
+const char *patchutils_context_workdir(const patchutils_context *ctx)
+{
+	return ctx ? git_repository_workdir(ctx->repo) : nullptr;
+}
+
+const char *patchutils_context_error(const patchutils_context *ctx)
+{
+	return ctx ? ctx->error : "";
+}
+
+static patchutils_file_status public_status(gitutils_file_status status)
+{
+	return status == GITUTILS_STATUS_UNTRACKED
+		       ? PATCHUTILS_STATUS_UNTRACKED
+		       : PATCHUTILS_STATUS_MODIFIED;
+}
+
+int patchutils_collect_status(patchutils_context *ctx,
+			      patchutils_status_callback callback,
+			      void *userdata)
+{
+	if (!ctx || !callback) {
+		return PATCHUTILS_EINVALID;
+	}
+
+	gitutils_status_list list = {0};
+	const int error = gitutils_collect_status(ctx->repo, &list);
+	if (error < 0) {
+		return context_fail(ctx, error);
+	}
+
+	int result = PATCHUTILS_OK;
+	for (size_t i = 0; i < list.count; ++i) {
+		const patchutils_status_entry entry = {
+			.path = list.entries[i].path,
+			.status = public_status(list.entries[i].status),
+		};
+		if (!callback(&entry, userdata)) {
+			result = PATCHUTILS_EUSER;
+			break;
+		}
+	}
+	gitutils_status_list_free(&list);
+	return result;
+}
+
+int patchutils_write_diff(patchutils_context *ctx, const char *path,
+			  FILE *output, bool *out_has_changes)
+{
+	if (!ctx || !path || !output) {
+		return PATCHUTILS_EINVALID;
+	}
+
+	const int error = gitutils_write_diff_for_path(ctx->repo, path, output,
+						       out_has_changes);
+	return error == GIT_ENOTFOUND ? PATCHUTILS_OK
+				      : context_fail(ctx, error);
+}
+
+int patchutils_write_diffs(patchutils_context *ctx, const char *const *paths,
+			   size_t count, FILE *output, size_t *out_written,
+			   size_t *out_failed)
+{
+	if (!ctx || (!paths && count > 0U) || !output) {
+		return PATCHUTILS_EINVALID;
+	}
+
+	// the worker handles are opened on the first batch and then reused,
+	// which is most of what a one-shot create-patch run pays for
+	if (!ctx->pool_ready && count > 1U) {
+		gitutils_diff_pool_open(ctx->repo, SIZE_MAX, &ctx->pool);
+		ctx->pool_ready = true;
+	}
+	const int error =
+		gitutils_write_diffs_pooled(ctx->repo, &ctx->pool, paths, count,
+					    output, out_written, out_failed);
+	return context_fail(ctx, error);
+}
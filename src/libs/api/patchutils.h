@@ -0,0 +1,119 @@
+#pragma once
+
+#include "version.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Public API of libpatchutils, for programs that want patch parsing,
+// status collection and diffs without spawning the command line tools.
+//
+// Only the patchutils_* symbols below are exported; their signatures stay
+// stable within a major version. Functions returning int give 0 on success
+// and one of the negative patchutils_error codes on failure.
+
+typedef enum {
+	PATCHUTILS_OK = 0,
+	PATCHUTILS_ERROR = -1,	   // generic failure, see the context message
+	PATCHUTILS_ENOMEM = -2,	   // out of memory
+	PATCHUTILS_EINVALID = -3,  // a required argument was missing
+	PATCHUTILS_ENOTFOUND = -4, // no repository at the given path
+	PATCHUTILS_EUSER = -5,	   // a callback asked to stop
+} patchutils_error;
+
+// Version of the library actually loaded, which may be newer than the
+// PATCHUTILS_VERSION the caller was compiled against.
+const char *patchutils_version(int *major, int *minor, int *patch);
+
+// Patch parsing
+
+typedef struct {
+	const char *path;   // new path, without the a/ or b/ prefix
+	const char *data;   // section text; nullptr when only indexed
+	size_t length;	    // bytes of the section text
+	size_t offset;	    // byte offset of the section in the input
+} patchutils_section;
+
+// Receives one section; |section| is only valid during the call. Returning
+// false stops parsing with PATCHUTILS_EUSER.
+typedef bool (*patchutils_section_callback)(const patchutils_section *section,
+					    void *userdata);
+
+// gzip and zstd input is decompressed on the fly when the library was
+// built with zlib or libzstd; offsets then index the decompressed text.
+int patchutils_parse_patch(FILE *input, patchutils_section_callback callback,
+			   void *userdata);
+int patchutils_parse_patch_buffer(const char *data, size_t length,
+				  patchutils_section_callback callback,
+				  void *userdata);
+
+// Section index: where every section of a patch lives, without its text.
+typedef struct patchutils_patch_index patchutils_patch_index;
+
+int patchutils_patch_index_build(FILE *input, patchutils_patch_index **out);
+void patchutils_patch_index_free(patchutils_patch_index *index);
+size_t patchutils_patch_index_count(const patchutils_patch_index *index);
+// Sections in input order; nullptr past the end.
+const patchutils_section *
+patchutils_patch_index_at(const patchutils_patch_index *index, size_t i);
+// First section for |path|, or nullptr.
+const patchutils_section *
+patchutils_patch_index_find(const patchutils_patch_index *index,
+			    const char *path);
+
+// Repository context
+
+// Keeps a repository, its index and the diff worker handles open between
+// calls. A context is not thread-safe; use one per thread.
+typedef struct patchutils_context patchutils_context;
+
+typedef enum {
+	PATCHUTILS_STATUS_MODIFIED,
+	PATCHUTILS_STATUS_UNTRACKED,
+} patchutils_file_status;
+
+typedef struct {
+	const char *path;
+	patchutils_file_status status;
+} patchutils_status_entry;
+
+// Receives one changed file; |entry| is only valid during the call.
+// Returning false stops the scan with PATCHUTILS_EUSER.
+typedef bool (*patchutils_status_callback)(const patchutils_status_entry *entry,
+					   void *userdata);
+
+// Opens the repository containing |path| (the current directory when
+// nullptr).
+int patchutils_context_open(patchutils_context **out, const char *path);
+void patchutils_context_free(patchutils_context *ctx);
+// Rereads the index and object database if they changed on disk. Calls
+// already see index changes; this also picks up newly written objects.
+int patchutils_context_refresh(patchutils_context *ctx);
+const char *patchutils_context_workdir(const patchutils_context *ctx);
+// Message for the last failure on |ctx|, or "" if there was none.
+const char *patchutils_context_error(const patchutils_context *ctx);
+
+// Modified and untracked files, in the order git status lists them.
+int patchutils_collect_status(patchutils_context *ctx,
+			      patchutils_status_callback callback,
+			      void *userdata);
+
+// Writes the unified diff of |path| against HEAD to |output|. A path with
+// no changes is not an error; |out_has_changes| tells whether it had any.
+int patchutils_write_diff(patchutils_context *ctx, const char *path,
+			  FILE *output, bool *out_has_changes);
+// Diffs |paths| on worker threads and writes them to |output| in order.
+// |out_written| counts files that had changes; on failure |out_failed|
+// receives the index of the offending path.
+int patchutils_write_diffs(patchutils_context *ctx, const char *const *paths,
+			   size_t count, FILE *output, size_t *out_written,
+			   size_t *out_failed);
+
+#ifdef __cplusplus
+}
+#endif
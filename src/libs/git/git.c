@@ -1,9 +1,19 @@
 #include "git.h"
 
+#include "util/trace.h"
 #include "util/util.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <git2/sys/alloc.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DIFF_WORKERS_MAX 8U
+#define DIFF_SLOTS_PER_WORKER 4U
 
 static int status_entry_should_include(unsigned int status)
 {
@@ -25,6 +35,60 @@ static int status_entry_should_include(unsigned int status)
 	return -1;
 }
 
+static void status_options_init(git_status_options *options)
+{
+	// unmodified files are filtered out anyway, so libgit2 is not asked
+	// to materialize an entry for every tracked path
+	git_status_options_init(options, GIT_STATUS_OPTIONS_VERSION);
+	options->show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+	options->flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED |
+			 GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS |
+			 GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+}
+
+static const char *status_entry_path(const git_status_entry *entry)
+{
+	if (entry->index_to_workdir && entry->index_to_workdir->new_file.path) {
+		return entry->index_to_workdir->new_file.path;
+	}
+	if (entry->head_to_index && entry->head_to_index->new_file.path) {
+		return entry->head_to_index->new_file.path;
+	}
+	return nullptr;
+}
+
+static void *libgit2_malloc(size_t size, const char *file, int line)
+{
+	(void)file;
+	(void)line;
+	return utils_malloc_tagged(UTILS_MEM_LIBGIT2, size);
+}
+
+static void *libgit2_realloc(void *ptr, size_t size, const char *file,
+			     int line)
+{
+	(void)file;
+	(void)line;
+	return ptr ? utils_realloc(ptr, size)
+		   : utils_malloc_tagged(UTILS_MEM_LIBGIT2, size);
+}
+
+int gitutils_init(void)
+{
+	// libgit2 keeps an allocator installed before its first init, so
+	// every block it ever hands out is accounted for
+	static git_allocator allocator = {
+		.gmalloc = libgit2_malloc,
+		.grealloc = libgit2_realloc,
+		.gfree = utils_free,
+	};
+	int error = git_libgit2_opts(GIT_OPT_SET_ALLOCATOR, &allocator);
+	if (error < 0) {
+		return error;
+	}
+	return git_libgit2_init();
+}
+
 int gitutils_open_repository(git_repository **out_repo, const char *path)
 {
 	if (!out_repo) {
@@ -37,6 +101,8 @@ int gitutils_open_repository(git_repository **out_repo, const char *path)
 
 int gitutils_collect_status(git_repository *repo, gitutils_status_list *list)
 {
+	TRACE_SCOPE("git.collect_status");
+	UTILS_MEM_SCOPE(UTILS_MEM_GIT);
 	if (!repo || !list) {
 		return GIT_ERROR;
 	}
@@ -45,12 +111,7 @@ int gitutils_collect_status(git_repository *repo, gitutils_status_list *list)
 	list->count = 0U;
 
 	git_status_options options;
-	git_status_options_init(&options, GIT_STATUS_OPTIONS_VERSION);
-	options.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
-	options.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED |
-			GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS |
-			GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH |
-			GIT_STATUS_OPT_INCLUDE_UNMODIFIED;
+	status_options_init(&options);
 
 	git_status_list *status_list = nullptr;
 	gitutils_status_entry *entries = nullptr;
@@ -63,7 +124,7 @@ int gitutils_collect_status(git_repository *repo, gitutils_status_list *list)
 
 	const size_t count = git_status_list_entrycount(status_list);
 	if (count > 0U) {
-		entries = calloc(count, sizeof(*entries));
+		entries = utils_calloc(count, sizeof(*entries));
 		if (!entries) {
 			error = GIT_ERROR;
 			goto cleanup;
@@ -82,20 +143,12 @@ int gitutils_collect_status(git_repository *repo, gitutils_status_list *list)
 			continue;
 		}
 
-		const char *path = nullptr;
-		if (entry->index_to_workdir &&
-		    entry->index_to_workdir->new_file.path) {
-			path = entry->index_to_workdir->new_file.path;
-		} else if (entry->head_to_index &&
-			   entry->head_to_index->new_file.path) {
-			path = entry->head_to_index->new_file.path;
-		}
-
+		const char *path = status_entry_path(entry);
 		if (!path) {
 			continue;
 		}
 
-		char *path_copy = strdup(path);
+		char *path_copy = utils_strdup(path);
 		if (!path_copy) {
 			error = GIT_ERROR;
 			goto cleanup;
@@ -107,20 +160,21 @@ int gitutils_collect_status(git_repository *repo, gitutils_status_list *list)
 	}
 
 	if (out_index == 0U) {
-		free(entries);
+		utils_free(entries);
 		entries = nullptr;
 	}
 
 	list->entries = entries;
 	list->count = out_index;
+	TRACE_COUNTER("status entries", out_index);
 
 cleanup:
 	if (error < 0) {
 		if (entries) {
 			for (size_t i = 0; i < out_index; ++i) {
-				free(entries[i].path);
+				utils_free(entries[i].path);
 			}
-			free(entries);
+			utils_free(entries);
 		}
 	}
 
@@ -136,16 +190,310 @@ void gitutils_status_list_free(gitutils_status_list *list)
 	}
 
 	for (size_t i = 0; i < list->count; ++i) {
-		free(list->entries[i].path);
+		utils_free(list->entries[i].path);
 	}
-	free(list->entries);
+	utils_free(list->entries);
 	list->entries = nullptr;
 	list->count = 0;
 }
 
+typedef struct {
+	char *name;
+	bool directory;
+} status_part;
+
+typedef struct {
+	status_part *items;
+	size_t count;
+	size_t capacity;
+} status_part_list;
+
+static bool status_part_add(status_part_list *parts, const char *name,
+			    size_t length, bool directory)
+{
+	// the index lists paths in order, so its repeats are adjacent
+	if (parts->count > 0U) {
+		status_part *last = &parts->items[parts->count - 1U];
+		if (strncmp(last->name, name, length) == 0 &&
+		    last->name[length] == '\0') {
+			last->directory |= directory;
+			return true;
+		}
+	}
+
+	if (!utils_array_reserve((void **)&parts->items, &parts->capacity,
+				 parts->count + 1U, sizeof(*parts->items))) {
+		return false;
+	}
+	char *copy = utils_strndup(name, length);
+	if (!copy) {
+		return false;
+	}
+	parts->items[parts->count++] = (status_part){copy, directory};
+	return true;
+}
+
+static void status_part_list_free(status_part_list *parts)
+{
+	for (size_t i = 0; i < parts->count; ++i) {
+		utils_free(parts->items[i].name);
+	}
+	utils_free(parts->items);
+	ZeroMemory(parts);
+}
+
+static int compare_status_parts(const void *lhs, const void *rhs)
+{
+	const status_part *a = lhs;
+	const status_part *b = rhs;
+	return strcmp(a->name, b->name);
+}
+
+static int status_parts_from_index(git_repository *repo,
+				   status_part_list *parts)
+{
+	git_index *index = nullptr;
+	int error = git_repository_index(&index, repo);
+	if (error < 0) {
+		return error;
+	}
+
+	const size_t count = git_index_entrycount(index);
+	for (size_t i = 0; i < count && error == 0; ++i) {
+		const git_index_entry *entry = git_index_get_byindex(index, i);
+		if (!entry) {
+			continue;
+		}
+		const char *slash = strchr(entry->path, '/');
+		const size_t length =
+			slash ? (size_t)(slash - entry->path)
+			      : strlen(entry->path);
+		if (!status_part_add(parts, entry->path, length,
+				     slash != nullptr)) {
+			error = GIT_ERROR;
+		}
+	}
+
+	git_index_free(index);
+	return error;
+}
+
+static int status_parts_from_head(git_repository *repo,
+				  status_part_list *parts)
+{
+	git_object *object = nullptr;
+	if (git_revparse_single(&object, repo, "HEAD^{tree}") < 0) {
+		// unborn branch: nothing can have been deleted from HEAD
+		git_error_clear();
+		return 0;
+	}
+
+	const git_tree *tree = (const git_tree *)object;
+	const size_t count = git_tree_entrycount(tree);
+	int error = 0;
+	for (size_t i = 0; i < count && error == 0; ++i) {
+		const git_tree_entry *entry = git_tree_entry_byindex(tree, i);
+		const char *name = git_tree_entry_name(entry);
+		if (!status_part_add(parts, name, strlen(name),
+				     git_tree_entry_type(entry) ==
+					     GIT_OBJECT_TREE)) {
+			error = GIT_ERROR;
+		}
+	}
+
+	git_object_free(object);
+	return error;
+}
+
+static int status_parts_from_workdir(const char *workdir,
+				     status_part_list *parts)
+{
+	DIR *dir = opendir(workdir);
+	if (!dir) {
+		return GIT_ERROR;
+	}
+
+	int error = 0;
+	const struct dirent *entry;
+	while (error == 0 && (entry = readdir(dir)) != nullptr) {
+		const char *name = entry->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+		    strcmp(name, ".git") == 0) {
+			continue;
+		}
+
+		bool directory = entry->d_type == DT_DIR;
+		struct stat st;
+		if (entry->d_type == DT_UNKNOWN &&
+		    fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			directory = S_ISDIR(st.st_mode);
+		}
+		if (!status_part_add(parts, name, strlen(name), directory)) {
+			error = GIT_ERROR;
+		}
+	}
+
+	closedir(dir);
+	return error;
+}
+
+// Splits the working tree into top-level names, from the index, HEAD and
+// the directory itself, so deletions and untracked files are covered too.
+static int collect_status_parts(git_repository *repo, status_part_list *parts)
+{
+	int error = status_parts_from_index(repo, parts);
+	if (error == 0) {
+		error = status_parts_from_head(repo, parts);
+	}
+	if (error == 0) {
+		error = status_parts_from_workdir(git_repository_workdir(repo),
+						  parts);
+	}
+	if (error < 0) {
+		return error;
+	}
+
+	qsort(parts->items, parts->count, sizeof(*parts->items),
+	      compare_status_parts);
+	size_t kept = 0U;
+	for (size_t i = 0; i < parts->count; ++i) {
+		if (kept > 0U && strcmp(parts->items[kept - 1U].name,
+					parts->items[i].name) == 0) {
+			parts->items[kept - 1U].directory |=
+				parts->items[i].directory;
+			utils_free(parts->items[i].name);
+			continue;
+		}
+		parts->items[kept++] = parts->items[i];
+	}
+	parts->count = kept;
+	return 0;
+}
+
+static int status_scan(git_repository *repo, char **pathspecs, size_t count,
+		       gitutils_status_callback callback, void *userdata)
+{
+	TRACE_SCOPE_DETAIL("git.status_scan",
+			   count == 1U ? pathspecs[0] : "top-level files");
+	git_status_options options;
+	status_options_init(&options);
+	options.pathspec.strings = pathspecs;
+	options.pathspec.count = count;
+
+	git_status_list *status_list = nullptr;
+	int error = git_status_list_new(&status_list, repo, &options);
+	if (error < 0) {
+		return error;
+	}
+
+	const size_t entries = git_status_list_entrycount(status_list);
+	for (size_t i = 0; i < entries; ++i) {
+		const git_status_entry *entry =
+			git_status_byindex(status_list, i);
+		const int include =
+			entry ? status_entry_should_include(entry->status) : -1;
+		const char *path = entry ? status_entry_path(entry) : nullptr;
+		if (include < 0 || !path) {
+			continue;
+		}
+
+		const gitutils_status_entry reported = {
+			.path = (char *)path,
+			.status = (gitutils_file_status)include,
+		};
+		if (!callback(&reported, userdata)) {
+			error = GIT_EUSER;
+			break;
+		}
+	}
+
+	git_status_list_free(status_list);
+	return error;
+}
+
+int gitutils_collect_status_stream(git_repository *repo,
+				   gitutils_status_callback callback,
+				   gitutils_status_progress progress,
+				   void *userdata)
+{
+	TRACE_SCOPE("git.collect_status_stream");
+	UTILS_MEM_SCOPE(UTILS_MEM_GIT);
+	if (!repo || !callback) {
+		return GIT_ERROR;
+	}
+
+	git_repository *own = nullptr;
+	int error = git_repository_open(&own, git_repository_path(repo));
+	if (error < 0) {
+		return error;
+	}
+
+	status_part_list parts = {0};
+	char **files = nullptr;
+	if (git_repository_workdir(own)) {
+		error = collect_status_parts(own, &parts);
+	}
+	if (error == 0 && parts.count > 0U) {
+		files = utils_calloc(parts.count, sizeof(*files));
+		error = files ? 0 : GIT_ERROR;
+	}
+	if (error < 0) {
+		goto cleanup;
+	}
+
+	// loose top-level files share the first, usually tiny, scan so
+	// something shows up quickly; every directory is scanned on its own
+	size_t file_count = 0U;
+	size_t total = parts.count > 0U ? 0U : 1U;
+	for (size_t i = 0; i < parts.count; ++i) {
+		if (!parts.items[i].directory) {
+			files[file_count++] = parts.items[i].name;
+		} else {
+			++total;
+		}
+	}
+	total += file_count > 0U ? 1U : 0U;
+
+	size_t done = 0U;
+	if (file_count > 0U || parts.count == 0U) {
+		if (progress &&
+		    !progress(parts.count > 0U ? "top-level files" : "", done,
+			      total, userdata)) {
+			error = GIT_EUSER;
+			goto cleanup;
+		}
+		error = status_scan(own, files, file_count, callback,
+				    userdata);
+		++done;
+	}
+	for (size_t i = 0; i < parts.count && error == 0; ++i) {
+		if (!parts.items[i].directory) {
+			continue;
+		}
+		if (progress &&
+		    !progress(parts.items[i].name, done, total, userdata)) {
+			error = GIT_EUSER;
+			break;
+		}
+		error = status_scan(own, &parts.items[i].name, 1U, callback,
+				    userdata);
+		++done;
+	}
+	if (error == 0 && progress) {
+		progress(nullptr, total, total, userdata);
+	}
+
+cleanup:
+	utils_free(files);
+	status_part_list_free(&parts);
+	git_repository_free(own);
+	return error;
+}
+
 int gitutils_write_diff_for_path(git_repository *repo, const char *path,
 				 FILE *output, bool *out_has_changes)
 {
+	TRACE_SCOPE_DETAIL("git.diff", path);
 	if (out_has_changes) {
 		*out_has_changes = false;
 	}
@@ -218,3 +566,646 @@ int gitutils_write_diff_for_path(git_repository *repo, const char *path,
 
 	return error;
 }
+
+typedef struct {
+	char *data;
+	size_t length;
+	int error;
+	bool has_changes;
+	bool ready;
+} diff_slot;
+
+typedef struct {
+	const char *const *paths;
+	size_t count;
+	diff_slot *slots;
+	size_t capacity;
+	size_t next;	// next path a worker will claim
+	size_t drained; // paths already handed to the writer
+	bool abort;
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+	pthread_cond_t filled;
+} diff_pipeline;
+
+typedef struct {
+	diff_pipeline *pipeline;
+	git_repository *repo; // borrowed from the pool
+	pthread_t thread;
+} diff_worker;
+
+static void render_diff(git_repository *repo, const char *path,
+			diff_slot *slot)
+{
+	FILE *memory = open_memstream(&slot->data, &slot->length);
+	if (!memory) {
+		slot->error = GIT_ERROR;
+		return;
+	}
+
+	slot->error = gitutils_write_diff_for_path(repo, path, memory,
+						   &slot->has_changes);
+	if (fclose(memory) != 0 && slot->error == 0) {
+		slot->error = GIT_ERROR;
+	}
+}
+
+static void *diff_worker_main(void *arg)
+{
+	diff_worker *worker = arg;
+	diff_pipeline *pipeline = worker->pipeline;
+
+	while (1) {
+		pthread_mutex_lock(&pipeline->lock);
+		while (!pipeline->abort && pipeline->next < pipeline->count &&
+		       pipeline->next >=
+			       pipeline->drained + pipeline->capacity) {
+			pthread_cond_wait(&pipeline->space, &pipeline->lock);
+		}
+		if (pipeline->abort || pipeline->next >= pipeline->count) {
+			pthread_mutex_unlock(&pipeline->lock);
+			break;
+		}
+		const size_t index = pipeline->next++;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		diff_slot rendered = {0};
+		render_diff(worker->repo, pipeline->paths[index], &rendered);
+		rendered.ready = true;
+
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->slots[index % pipeline->capacity] = rendered;
+		pthread_cond_broadcast(&pipeline->filled);
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+
+	return nullptr;
+}
+
+static size_t diff_worker_count(size_t count)
+{
+	const long online = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t workers = online > 0 ? (size_t)online : 1U;
+	if (workers > DIFF_WORKERS_MAX) {
+		workers = DIFF_WORKERS_MAX;
+	}
+	return workers < count ? workers : count;
+}
+
+static int write_diffs_sequential(git_repository *repo,
+				  const char *const *paths, size_t count,
+				  FILE *output, size_t *out_written,
+				  size_t *out_failed)
+{
+	for (size_t i = 0; i < count; ++i) {
+		bool has_changes = false;
+		int error = gitutils_write_diff_for_path(repo, paths[i], output,
+							 &has_changes);
+		if (error < 0 && error != GIT_ENOTFOUND) {
+			if (out_failed) {
+				*out_failed = i;
+			}
+			return error;
+		}
+		if (has_changes) {
+			++(*out_written);
+		}
+	}
+	return 0;
+}
+
+int gitutils_diff_pool_open(git_repository *repo, size_t count,
+			    gitutils_diff_pool *pool)
+{
+	UTILS_MEM_SCOPE(UTILS_MEM_GIT);
+	if (!repo || !pool) {
+		return GIT_ERROR;
+	}
+
+	ZeroMemory(pool);
+	const size_t wanted = diff_worker_count(count);
+	if (wanted == 0U) {
+		return 0;
+	}
+	pool->repos = utils_calloc(wanted, sizeof(*pool->repos));
+	if (!pool->repos) {
+		return GIT_ERROR;
+	}
+
+	// libgit2 repositories must not be shared between threads, so every
+	// worker diffs through its own handle onto the same repository
+	const char *repo_path = git_repository_path(repo);
+	while (pool->count < wanted &&
+	       git_repository_open(&pool->repos[pool->count], repo_path) == 0) {
+		++pool->count;
+	}
+	return 0;
+}
+
+void gitutils_diff_pool_dispose(gitutils_diff_pool *pool)
+{
+	if (!pool) {
+		return;
+	}
+	for (size_t i = 0; i < pool->count; ++i) {
+		git_repository_free(pool->repos[i]);
+	}
+	utils_free(pool->repos);
+	ZeroMemory(pool);
+}
+
+int gitutils_write_diffs(git_repository *repo, const char *const *paths,
+			 size_t count, FILE *output, size_t *out_written,
+			 size_t *out_failed)
+{
+	gitutils_diff_pool pool = {0};
+	if (count > 1U) {
+		gitutils_diff_pool_open(repo, count, &pool);
+	}
+	int error = gitutils_write_diffs_pooled(
+		repo, &pool, paths, count, output, out_written, out_failed);
+	gitutils_diff_pool_dispose(&pool);
+	return error;
+}
+
+int gitutils_write_diffs_pooled(git_repository *repo,
+				const gitutils_diff_pool *pool,
+				const char *const *paths, size_t count,
+				FILE *output, size_t *out_written,
+				size_t *out_failed)
+{
+	TRACE_SCOPE("git.write_diffs");
+	UTILS_MEM_SCOPE(UTILS_MEM_GIT);
+	size_t written = 0U;
+	if (out_written) {
+		*out_written = 0U;
+	}
+
+	if (!repo || !pool || (!paths && count > 0U) || !output) {
+		return GIT_ERROR;
+	}
+
+	size_t worker_count = count > 1U ? pool->count : 0U;
+	if (worker_count > count) {
+		worker_count = count;
+	}
+	diff_worker *workers =
+		worker_count ? utils_calloc(worker_count, sizeof(*workers))
+			     : nullptr;
+	if (!workers) {
+		int error = write_diffs_sequential(repo, paths, count, output,
+						   &written, out_failed);
+		if (out_written) {
+			*out_written = written;
+		}
+		return error;
+	}
+	for (size_t i = 0; i < worker_count; ++i) {
+		workers[i].repo = pool->repos[i];
+	}
+
+	diff_pipeline pipeline = {
+		.paths = paths,
+		.count = count,
+		.capacity = worker_count * DIFF_SLOTS_PER_WORKER,
+	};
+	pipeline.slots =
+		utils_calloc(pipeline.capacity, sizeof(*pipeline.slots));
+	if (!pipeline.slots) {
+		utils_free(workers);
+		int error = write_diffs_sequential(repo, paths, count, output,
+						   &written, out_failed);
+		if (out_written) {
+			*out_written = written;
+		}
+		return error;
+	}
+	pthread_mutex_init(&pipeline.lock, nullptr);
+	pthread_cond_init(&pipeline.space, nullptr);
+	pthread_cond_init(&pipeline.filled, nullptr);
+
+	size_t started = 0U;
+	for (; started < worker_count; ++started) {
+		workers[started].pipeline = &pipeline;
+		if (pthread_create(&workers[started].thread, nullptr,
+				   diff_worker_main, &workers[started]) != 0) {
+			break;
+		}
+	}
+
+	int error = 0;
+	if (started == 0U) {
+		pipeline.abort = true;
+		error = write_diffs_sequential(repo, paths, count, output,
+					       &written, out_failed);
+	}
+
+	// the calling thread is the single writer: it drains rendered diffs in
+	// path order while the workers keep computing ahead of it
+	for (size_t i = 0; !pipeline.abort && error == 0 && i < count; ++i) {
+		diff_slot *slot = &pipeline.slots[i % pipeline.capacity];
+
+		pthread_mutex_lock(&pipeline.lock);
+		while (!slot->ready) {
+			pthread_cond_wait(&pipeline.filled, &pipeline.lock);
+		}
+		diff_slot rendered = *slot;
+		*slot = (diff_slot){0};
+		pipeline.drained = i + 1U;
+		pthread_cond_broadcast(&pipeline.space);
+		pthread_mutex_unlock(&pipeline.lock);
+
+		if (rendered.error < 0 && rendered.error != GIT_ENOTFOUND) {
+			error = rendered.error;
+		} else if (rendered.has_changes &&
+			   fwrite(rendered.data, 1U, rendered.length, output) !=
+				   rendered.length) {
+			error = GIT_ERROR;
+		} else if (rendered.has_changes) {
+			++written;
+		}
+		free(rendered.data);
+
+		if (error < 0 && out_failed) {
+			*out_failed = i;
+		}
+	}
+
+	pthread_mutex_lock(&pipeline.lock);
+	pipeline.abort = true;
+	pthread_cond_broadcast(&pipeline.space);
+	pthread_mutex_unlock(&pipeline.lock);
+
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(workers[i].thread, nullptr);
+	}
+	for (size_t i = 0; i < pipeline.capacity; ++i) {
+		free(pipeline.slots[i].data);
+	}
+
+	pthread_cond_destroy(&pipeline.filled);
+	pthread_cond_destroy(&pipeline.space);
+	pthread_mutex_destroy(&pipeline.lock);
+	utils_free(pipeline.slots);
+	utils_free(workers);
+
+	if (out_written) {
+		*out_written = written;
+	}
+	return error;
+}
+
+int gitutils_diffstat_for_path(git_repository *repo, const char *path,
+			       gitutils_diffstat *out)
+{
+	TRACE_SCOPE_DETAIL("git.diffstat", path);
+	if (!repo || !path || !out) {
+		return GIT_ERROR;
+	}
+
+	ZeroMemory(out);
+
+	git_diff_options diff_opts;
+	git_diff_options_init(&diff_opts, GIT_DIFF_OPTIONS_VERSION);
+	diff_opts.flags = GIT_DIFF_INCLUDE_UNTRACKED |
+			  GIT_DIFF_SHOW_UNTRACKED_CONTENT |
+			  GIT_DIFF_RECURSE_UNTRACKED_DIRS |
+			  GIT_DIFF_DISABLE_PATHSPEC_MATCH;
+
+	char *pathspec[1] = {(char *)path};
+	diff_opts.pathspec.strings = pathspec;
+	diff_opts.pathspec.count = 1U;
+
+	git_diff *diff = nullptr;
+	int error = git_diff_index_to_workdir(&diff, repo, nullptr, &diff_opts);
+	if (error < 0) {
+		return error;
+	}
+
+	const size_t deltas = git_diff_num_deltas(diff);
+	for (size_t i = 0; i < deltas && error == 0; ++i) {
+		git_patch *patch = nullptr;
+		error = git_patch_from_diff(&patch, diff, i);
+		if (error < 0) {
+			break;
+		}
+
+		const git_diff_delta *delta = git_patch_get_delta(patch);
+		out->size += (size_t)delta->new_file.size;
+		if ((delta->flags & GIT_DIFF_FLAG_BINARY) != 0) {
+			out->binary = true;
+		}
+
+		size_t additions = 0U;
+		size_t deletions = 0U;
+		error = git_patch_line_stats(nullptr, &additions, &deletions,
+					     patch);
+		out->added += additions;
+		out->removed += deletions;
+
+		git_patch_free(patch);
+	}
+
+	git_diff_free(diff);
+	return error < 0 ? error : 0;
+}
+
+struct gitutils_diffstat_cache {
+	git_repository *repo;
+	utils_strmap stats; // path -> gitutils_diffstat *
+	pthread_mutex_t lock;
+};
+
+gitutils_diffstat_cache *gitutils_diffstat_cache_new(git_repository *repo)
+{
+	UTILS_MEM_SCOPE(UTILS_MEM_GIT);
+	if (!repo) {
+		return nullptr;
+	}
+
+	gitutils_diffstat_cache *cache = utils_calloc(1U, sizeof(*cache));
+	if (!cache) {
+		return nullptr;
+	}
+
+	if (git_repository_open(&cache->repo, git_repository_path(repo)) < 0) {
+		utils_free(cache);
+		return nullptr;
+	}
+	pthread_mutex_init(&cache->lock, nullptr);
+	return cache;
+}
+
+void gitutils_diffstat_cache_free(gitutils_diffstat_cache *cache)
+{
+	if (!cache) {
+		return;
+	}
+
+	utils_strmap_dispose(&cache->stats, utils_free);
+	pthread_mutex_destroy(&cache->lock);
+	git_repository_free(cache->repo);
+	utils_free(cache);
+}
+
+static void format_size(size_t bytes, char *buffer, size_t size)
+{
+	static const char *units[] = {"B", "KiB", "MiB", "GiB"};
+	double value = (double)bytes;
+	size_t unit = 0U;
+	while (value >= 1024.0 && unit + 1U < sizeof(units) / sizeof(*units)) {
+		value /= 1024.0;
+		++unit;
+	}
+	utils_format_message((message_buf){buffer, size},
+			     unit == 0U ? "%.0f %s" : "%.1f %s", value,
+			     units[unit]);
+}
+
+bool gitutils_diffstat_cache_describe(gitutils_diffstat_cache *cache,
+				      const char *path, const char *prefix,
+				      char *buffer, size_t size)
+{
+	UTILS_MEM_SCOPE(UTILS_MEM_GIT);
+	if (!cache || !path || !buffer || size == 0U) {
+		return false;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	gitutils_diffstat *stat = utils_strmap_get(&cache->stats, path);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!stat) {
+		stat = utils_calloc(1U, sizeof(*stat));
+		if (!stat ||
+		    gitutils_diffstat_for_path(cache->repo, path, stat) < 0) {
+			utils_free(stat);
+			return false;
+		}
+
+		pthread_mutex_lock(&cache->lock);
+		gitutils_diffstat *raced =
+			utils_strmap_get(&cache->stats, path);
+		const bool stored =
+			!raced && utils_strmap_put(&cache->stats, path, stat);
+		pthread_mutex_unlock(&cache->lock);
+		if (!stored) {
+			utils_free(stat);
+			if (!raced) {
+				return false;
+			}
+			stat = raced;
+		}
+	}
+
+	char size_text[32];
+	format_size(stat->size, size_text, sizeof(size_text));
+	if (stat->binary) {
+		utils_format_message((message_buf){buffer, size},
+				     "%s binary %s", prefix ? prefix : "",
+				     size_text);
+	} else {
+		utils_format_message((message_buf){buffer, size},
+				     "%s +%zu/-%zu %s", prefix ? prefix : "",
+				     stat->added, stat->removed, size_text);
+	}
+	return true;
+}
+
+static void copy_git_message(char *buffer, size_t size)
+{
+	const git_error *err = git_error_last();
+	utils_format_message((message_buf){buffer, size}, "%s",
+			     err && err->message ? err->message
+						 : "patch does not apply");
+}
+
+// Finds the "@@" line opening each hunk of a one-file |patch|, in order.
+static size_t find_hunk_offsets(const char *patch, size_t length,
+				size_t *offsets, size_t count)
+{
+	size_t found = 0U;
+	for (size_t offset = 0U; offset < length && found < count;) {
+		if (length - offset >= 4U &&
+		    memcmp(patch + offset, "@@ -", 4) == 0) {
+			offsets[found++] = offset;
+		}
+		const char *newline =
+			memchr(patch + offset, '\n', length - offset);
+		offset = newline ? (size_t)(newline - patch) + 1U : length;
+	}
+	return found;
+}
+
+static bool text_applies(git_repository *repo, const char *text,
+			 size_t length, git_apply_location_t location)
+{
+	git_diff *diff = nullptr;
+	if (git_diff_from_buffer(&diff, text, length) < 0) {
+		return false;
+	}
+	git_apply_options options = GIT_APPLY_OPTIONS_INIT;
+	options.flags = GIT_APPLY_CHECK;
+	const bool applies = git_apply(repo, diff, location, &options) == 0;
+	git_diff_free(diff);
+	return applies;
+}
+
+// Checks |hunk| as a patch of its own: |header|, the section text before
+// its first hunk, then the hunk with its ranges rewritten to start at
+// |new_start|. Fails only when the text cannot be built.
+static bool hunk_applies(git_repository *repo, git_apply_location_t location,
+			 const char *header, size_t header_length,
+			 const char *hunk, size_t hunk_length,
+			 const gitutils_hunk_check *check, size_t new_start,
+			 bool *out_applies)
+{
+	*out_applies = false;
+	const char *line_end = memchr(hunk, '\n', hunk_length);
+	const char *ranges_end =
+		line_end && line_end - hunk > 2
+			? memmem(hunk + 2, (size_t)(line_end - hunk) - 2U, "@@",
+				 2)
+			: nullptr;
+	if (!ranges_end) {
+		return true;
+	}
+	// the function context after the ranges is kept
+	const char *rest = ranges_end + 2;
+
+	char ranges[96];
+	FORMAT_MSG_INTO(ranges, "@@ -%zu,%zu +%zu,%zu @@", check->old_start,
+			check->old_lines, new_start, check->new_lines);
+	char *text = nullptr;
+	size_t length = 0U;
+	size_t capacity = 0U;
+	const bool built =
+		utils_append_bytes(&text, &length, &capacity, header,
+				   header_length) &&
+		utils_append_bytes(&text, &length, &capacity, ranges,
+				   strlen(ranges)) &&
+		utils_append_bytes(&text, &length, &capacity, rest,
+				   hunk_length - (size_t)(rest - hunk));
+	if (built) {
+		*out_applies = text_applies(repo, text, length, location);
+	}
+	utils_free(text);
+	return built;
+}
+
+// Retries every hunk of a failed section alone, so the result names the
+// ones that conflict.
+static int check_hunks(git_repository *repo, const char *patch,
+		       size_t length, git_diff *diff,
+		       git_apply_location_t location,
+		       gitutils_apply_check *out)
+{
+	git_patch *parsed = nullptr;
+	int error = git_patch_from_diff(&parsed, diff, 0);
+	if (error < 0) {
+		return error;
+	}
+
+	const size_t count = git_patch_num_hunks(parsed);
+	out->hunks = count ? utils_calloc(count, sizeof(*out->hunks)) : nullptr;
+	size_t *offsets =
+		count ? utils_calloc(count, sizeof(*offsets)) : nullptr;
+	if (count && (!out->hunks || !offsets)) {
+		utils_free(offsets);
+		git_patch_free(parsed);
+		return GIT_ERROR;
+	}
+	const bool located =
+		find_hunk_offsets(patch, length, offsets, count) == count;
+
+	size_t old_total = 0U;
+	size_t new_total = 0U;
+	for (size_t i = 0; i < count; ++i) {
+		const git_diff_hunk *hunk = nullptr;
+		error = git_patch_get_hunk(&hunk, nullptr, parsed, i);
+		if (error < 0) {
+			break;
+		}
+		gitutils_hunk_check *check = &out->hunks[i];
+		*check = (gitutils_hunk_check){
+			.old_start = (size_t)hunk->old_start,
+			.old_lines = (size_t)hunk->old_lines,
+			.new_start = (size_t)hunk->new_start,
+			.new_lines = (size_t)hunk->new_lines,
+		};
+		++out->hunk_count;
+
+		// libgit2 places a hunk by its new start, which counts the
+		// lines the earlier hunks added and removed; alone, the hunk
+		// must start where it would with none of them applied
+		size_t new_start = check->new_start + old_total;
+		new_start = new_start >= new_total ? new_start - new_total
+						   : check->old_start;
+		old_total += check->old_lines;
+		new_total += check->new_lines;
+
+		if (count == 1U || !located) {
+			// the section verdict already is this hunk's, or the
+			// hunks could not be found in the text
+			check->applies = out->applies;
+			continue;
+		}
+		const size_t end = i + 1U < count ? offsets[i + 1U] : length;
+		if (!hunk_applies(repo, location, patch, offsets[0],
+				  patch + offsets[i], end - offsets[i], check,
+				  new_start, &check->applies)) {
+			error = GIT_ERROR;
+			break;
+		}
+	}
+
+	utils_free(offsets);
+	git_patch_free(parsed);
+	return error < 0 ? error : 0;
+}
+
+int gitutils_check_apply(git_repository *repo, const char *patch,
+			 size_t length, bool cached, gitutils_apply_check *out)
+{
+	TRACE_SCOPE("git.check_apply");
+	UTILS_MEM_SCOPE(UTILS_MEM_GIT);
+	if (!repo || !patch || !out) {
+		return GIT_ERROR;
+	}
+
+	ZeroMemory(out);
+	git_diff *diff = nullptr;
+	int error = git_diff_from_buffer(&diff, patch, length);
+	if (error < 0) {
+		copy_git_message(out->message, sizeof(out->message));
+		return error;
+	}
+
+	// GIT_APPLY_CHECK runs the whole apply in memory and writes nothing
+	const git_apply_location_t location =
+		cached ? GIT_APPLY_LOCATION_INDEX : GIT_APPLY_LOCATION_WORKDIR;
+	git_apply_options options = GIT_APPLY_OPTIONS_INIT;
+	options.flags = GIT_APPLY_CHECK;
+	out->applies = git_apply(repo, diff, location, &options) == 0;
+	if (!out->applies) {
+		copy_git_message(out->message, sizeof(out->message));
+	}
+
+	// hunks are only split up when something failed; a clean section
+	// costs a single apply
+	if (!out->applies && git_diff_num_deltas(diff) > 0U) {
+		error = check_hunks(repo, patch, length, diff, location, out);
+	}
+
+	git_diff_free(diff);
+	return error;
+}
+
+void gitutils_apply_check_dispose(gitutils_apply_check *check)
+{
+	if (!check) {
+		return;
+	}
+	utils_free(check->hunks);
+	ZeroMemory(check);
+}
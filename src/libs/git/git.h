@@ -20,8 +20,96 @@ typedef struct {
 	size_t count;
 } gitutils_status_list;
 
+typedef struct {
+	size_t added;
+	size_t removed;
+	size_t size; // bytes of the working tree file
+	bool binary;
+} gitutils_diffstat;
+
+typedef struct gitutils_diffstat_cache gitutils_diffstat_cache;
+
+// Worker repository handles for gitutils_write_diffs_pooled(). Opening them
+// costs a repository open each, so long-lived callers keep one pool around.
+typedef struct {
+	git_repository **repos;
+	size_t count;
+} gitutils_diff_pool;
+
+// Receives one status entry; |entry| is only valid during the call.
+// Returning false stops the scan with GIT_EUSER.
+typedef bool (*gitutils_status_callback)(const gitutils_status_entry *entry,
+					 void *userdata);
+// Reports that |part| is being scanned, after |done| of |total| parts.
+// |part| is nullptr once the scan is complete. Returning false stops the
+// scan before the next part.
+typedef bool (*gitutils_status_progress)(const char *part, size_t done,
+					 size_t total, void *userdata);
+
+// Installs the accounting allocator into libgit2, then initializes it.
+// Use instead of git_libgit2_init(); pair with git_libgit2_shutdown().
+int gitutils_init(void);
 int gitutils_open_repository(git_repository **out_repo, const char *path);
 int gitutils_collect_status(git_repository *repo, gitutils_status_list *list);
 void gitutils_status_list_free(gitutils_status_list *list);
+// Like gitutils_collect_status(), but scans one top-level directory at a
+// time and reports entries as each part completes. Runs on its own
+// repository handle, so it may be called from a background thread.
+int gitutils_collect_status_stream(git_repository *repo,
+				   gitutils_status_callback callback,
+				   gitutils_status_progress progress,
+				   void *userdata);
 int gitutils_write_diff_for_path(git_repository *repo, const char *path,
 				 FILE *output, bool *out_has_changes);
+// Diffs |paths| on worker threads and writes the results to |output| in
+// order. On failure, |out_failed| receives the index of the offending path.
+int gitutils_write_diffs(git_repository *repo, const char *const *paths,
+			 size_t count, FILE *output, size_t *out_written,
+			 size_t *out_failed);
+// Opens one handle per diff worker that a batch of |count| paths can use.
+// An empty pool is valid and makes batches run on the calling thread.
+int gitutils_diff_pool_open(git_repository *repo, size_t count,
+			    gitutils_diff_pool *pool);
+void gitutils_diff_pool_dispose(gitutils_diff_pool *pool);
+// Like gitutils_write_diffs(), but diffs through the handles of |pool|. A
+// pool serves one batch at a time.
+int gitutils_write_diffs_pooled(git_repository *repo,
+				const gitutils_diff_pool *pool,
+				const char *const *paths, size_t count,
+				FILE *output, size_t *out_written,
+				size_t *out_failed);
+
+int gitutils_diffstat_for_path(git_repository *repo, const char *path,
+			       gitutils_diffstat *out);
+
+// Session cache of diffstats. It diffs through its own repository handle,
+// so describe() may run on a background thread while |repo| stays in use.
+gitutils_diffstat_cache *gitutils_diffstat_cache_new(git_repository *repo);
+void gitutils_diffstat_cache_free(gitutils_diffstat_cache *cache);
+bool gitutils_diffstat_cache_describe(gitutils_diffstat_cache *cache,
+				      const char *path, const char *prefix,
+				      char *buffer, size_t size);
+
+typedef struct {
+	size_t old_start;
+	size_t old_lines;
+	size_t new_start;
+	size_t new_lines;
+	bool applies;
+} gitutils_hunk_check;
+
+typedef struct {
+	gitutils_hunk_check *hunks;
+	size_t hunk_count;
+	bool applies;
+	char message[256]; // libgit2's reason when the section does not apply
+} gitutils_apply_check;
+
+// Checks whether |patch| applies to the index (|cached|) or the working
+// tree without changing either. When it does not, every hunk is retried on
+// its own so the result names the hunks that conflict. Returns 0 whenever
+// the check ran, whatever its verdict, and an error if |patch| is
+// malformed.
+int gitutils_check_apply(git_repository *repo, const char *patch,
+			 size_t length, bool cached, gitutils_apply_check *out);
+void gitutils_apply_check_dispose(gitutils_apply_check *check);
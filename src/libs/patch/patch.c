@@ -1,5 +1,7 @@
 #include "patch.h"
 
+#include "util/compress.h"
+#include "util/trace.h"
 #include "util/util.h"
 
 #include <assert.h>
@@ -11,9 +13,10 @@ bool patch_section_init(patch_section *section, const char *path)
 	assert(section);
 	assert(path);
 
+	UTILS_MEM_SCOPE(UTILS_MEM_PATCH);
 	ZeroMemory(section);
 
-	section->path = strdup(path);
+	section->path = utils_strdup(path);
 	if (!section->path) {
 		return false;
 	}
@@ -25,8 +28,9 @@ void patch_section_reset(patch_section *section)
 {
 	assert(section);
 
-	free(section->path);
-	free(section->data);
+	// newest first, so a stack allocator gets both blocks back
+	utils_free(section->data);
+	utils_free(section->path);
 	ZeroMemory(section);
 }
 
@@ -34,23 +38,62 @@ bool patch_section_append(patch_section *section, const char *data, size_t len)
 {
 	assert(section);
 
+	UTILS_MEM_SCOPE(UTILS_MEM_PATCH);
 	return utils_append_bytes(&section->data, &section->length,
 				  &section->capacity, data, len);
 }
 
-bool patch_parse(FILE *input, patch_section_callback cb, void *userdata)
+static bool section_consume(patch_section *section, const char *line,
+			    size_t len, bool keep_data)
+{
+	if (!keep_data) {
+		section->length += len;
+		return true;
+	}
+	return patch_section_append(section, line, len);
+}
+
+// Picks the path a "diff --git" line is filed under: the new one, without
+// its a/ or b/ prefix.
+static void section_path(const char *line, char *path, size_t size)
+{
+	char old_path[512];
+	char new_path[512];
+	const char *cursor = line + 10;
+	cursor = utils_parse_token(cursor, old_path, sizeof(old_path));
+	cursor = utils_parse_token(cursor, new_path, sizeof(new_path));
+
+	const char *target = new_path[0] ? new_path : old_path;
+	if (strncmp(target, "a/", 2) == 0 || strncmp(target, "b/", 2) == 0) {
+		target += 2;
+	}
+	utils_format_message((message_buf){path, size}, "%s", target);
+}
+
+static bool parse_sections(FILE *input, patch_filter_callback filter,
+			   patch_section_callback cb, void *userdata,
+			   bool keep_data)
 {
 	assert(input);
 	assert(cb);
 
+	// compressed patches are read through a decoding stream; offsets
+	// are then into the decompressed text
+	FILE *stream = utils_decompress_open(input, false, nullptr);
+	if (!stream) {
+		return false;
+	}
+
 	patch_section current = {0};
 
 	char *line = NULL;
 	size_t line_cap = 0U;
 	ssize_t line_len;
+	size_t offset = 0U;
 	bool ok = true;
 
-	while ((line_len = getline(&line, &line_cap, input)) != -1) {
+	for (; (line_len = getline(&line, &line_cap, stream)) != -1;
+	     offset += (size_t)line_len) {
 		// check if we are at the start of a new patch section
 		if (strncmp(line, "diff --git", 10) == 0) {
 			// it isn't our first patch?
@@ -63,19 +106,14 @@ bool patch_parse(FILE *input, patch_section_callback cb, void *userdata)
 				patch_section_reset(&current);
 			}
 
-			// get the file names
-			const char *cursor = line + 10;
-			char old_path[512];
-			char new_path[512];
-			cursor = utils_parse_token(cursor, old_path,
-						   sizeof(old_path));
-			cursor = utils_parse_token(cursor, new_path,
-						   sizeof(new_path));
-
-			const char *target = new_path[0] ? new_path : old_path;
-			if (strncmp(target, "a/", 2) == 0 ||
-			    strncmp(target, "b/", 2) == 0) {
-				target += 2;
+			// get the file name
+			char target[512];
+			section_path(line, target, sizeof(target));
+
+			// an unwanted section leaves |current| empty, so its
+			// lines are passed over without being copied
+			if (filter && !filter(target, userdata)) {
+				continue;
 			}
 
 			// initialize |current|
@@ -83,10 +121,11 @@ bool patch_parse(FILE *input, patch_section_callback cb, void *userdata)
 				ok = false;
 				break;
 			}
+			current.offset = offset;
 
 			// append the first line
-			if (!patch_section_append(&current, line,
-						  (size_t)line_len)) {
+			if (!section_consume(&current, line, (size_t)line_len,
+					     keep_data)) {
 				ok = false;
 				break;
 			}
@@ -95,8 +134,8 @@ bool patch_parse(FILE *input, patch_section_callback cb, void *userdata)
 
 		// consume one more line of the current patch
 		if (current.path) {
-			if (!patch_section_append(&current, line,
-						  (size_t)line_len)) {
+			if (!section_consume(&current, line, (size_t)line_len,
+					     keep_data)) {
 				ok = false;
 				break;
 			}
@@ -104,11 +143,201 @@ bool patch_parse(FILE *input, patch_section_callback cb, void *userdata)
 	}
 
 	free(line);
+	// a stream that failed to decode ends early, not cleanly
+	ok = ok && !ferror(stream);
 
 	if (ok && current.path) {
 		ok = cb(&current, userdata);
 	}
 
 	patch_section_reset(&current);
+	if (stream != input) {
+		fclose(stream);
+	}
+	return ok;
+}
+
+bool patch_parse(FILE *input, patch_section_callback cb, void *userdata)
+{
+	TRACE_SCOPE("patch.parse");
+	return parse_sections(input, nullptr, cb, userdata, true);
+}
+
+bool patch_parse_filtered(FILE *input, patch_filter_callback filter,
+			  patch_section_callback cb, void *userdata)
+{
+	TRACE_SCOPE("patch.parse");
+	return parse_sections(input, filter, cb, userdata, true);
+}
+
+bool patch_scan(FILE *input, patch_section_callback cb, void *userdata)
+{
+	TRACE_SCOPE("patch.scan");
+	return parse_sections(input, nullptr, cb, userdata, false);
+}
+
+bool patch_parse_lines(FILE *input, patch_line_callback cb, void *userdata)
+{
+	TRACE_SCOPE("patch.parse_lines");
+	assert(input);
+	assert(cb);
+
+	FILE *stream = utils_decompress_open(input, false, nullptr);
+	if (!stream) {
+		return false;
+	}
+
+	char path[512] = "";
+	patch_line event = {.path = path};
+	bool in_section = false;
+	bool in_hunk = false;
+
+	char *line = NULL;
+	size_t line_cap = 0U;
+	ssize_t line_len;
+	size_t offset = 0U;
+	bool ok = true;
+
+	for (; ok && (line_len = getline(&line, &line_cap, stream)) != -1;
+	     offset += (size_t)line_len) {
+		patch_hunk hunk = {0};
+		if (strncmp(line, "diff --git", 10) == 0) {
+			section_path(line, path, sizeof(path));
+			event.kind = PATCH_LINE_SECTION;
+			event.hunk = hunk;
+			in_section = true;
+			in_hunk = false;
+		} else if (!in_section) {
+			// text before the first section, like a mail header
+			continue;
+		} else if (*line == '@' &&
+			   patch_parse_hunk_header(line, (size_t)line_len,
+						   &hunk)) {
+			event.kind = PATCH_LINE_HUNK;
+			event.hunk = hunk;
+			in_hunk = true;
+		} else if (in_hunk) {
+			event.kind = PATCH_LINE_BODY;
+		} else {
+			event.kind = PATCH_LINE_HEADER;
+		}
+
+		event.text = line;
+		event.length = (size_t)line_len;
+		event.offset = offset;
+		ok = cb(&event, userdata);
+	}
+
+	free(line);
+	ok = ok && !ferror(stream);
+	if (stream != input) {
+		fclose(stream);
+	}
 	return ok;
 }
+
+bool patch_scan_buffer(const char *data, size_t length,
+		       patch_section_callback cb, void *userdata)
+{
+	assert(data || length == 0U);
+	assert(cb);
+
+	if (length == 0U) {
+		return true;
+	}
+	FILE *input = fmemopen((void *)data, length, "r");
+	if (!input) {
+		return false;
+	}
+	const bool ok = patch_scan(input, cb, userdata);
+	fclose(input);
+	return ok;
+}
+
+static const char *parse_number(const char *cursor, const char *end,
+				size_t *out)
+{
+	size_t value = 0U;
+	const char *digits = cursor;
+	for (; cursor < end && *cursor >= '0' && *cursor <= '9'; ++cursor) {
+		value = value * 10U + (size_t)(*cursor - '0');
+	}
+	*out = value;
+	return cursor == digits ? nullptr : cursor;
+}
+
+// Reads one "start[,count]" range after its '-' or '+' marker.
+static const char *parse_range(const char *cursor, const char *end,
+			       char marker, size_t *start, size_t *count)
+{
+	if (cursor >= end || *cursor != marker) {
+		return nullptr;
+	}
+	cursor = parse_number(cursor + 1, end, start);
+	*count = 1U;
+	if (cursor && cursor < end && *cursor == ',') {
+		cursor = parse_number(cursor + 1, end, count);
+	}
+	return cursor;
+}
+
+bool patch_parse_hunk_header(const char *line, size_t length, patch_hunk *out)
+{
+	assert(line);
+	assert(out);
+
+	const char *end = line + length;
+	if (length < 4U || strncmp(line, "@@ ", 3) != 0) {
+		return false;
+	}
+
+	const char *cursor = parse_range(line + 3, end, '-', &out->old_start,
+					 &out->old_lines);
+	if (!cursor || cursor >= end || *cursor != ' ') {
+		return false;
+	}
+	cursor = parse_range(cursor + 1, end, '+', &out->new_start,
+			     &out->new_lines);
+	return cursor && end - cursor >= 3 && strncmp(cursor, " @@", 3) == 0;
+}
+
+bool patch_section_hunks(const patch_section *section, patch_hunk_callback cb,
+			 void *userdata)
+{
+	assert(section);
+	assert(cb);
+
+	const char *cursor = section->data;
+	const char *end = section->data ? section->data + section->length
+					: nullptr;
+	// a hunk is reported once the next one starts, so its length is known
+	patch_hunk pending;
+	bool has_pending = false;
+	while (cursor && cursor < end) {
+		const char *newline =
+			memchr(cursor, '\n', (size_t)(end - cursor));
+		const char *line_end = newline ? newline : end;
+
+		patch_hunk hunk;
+		if (*cursor == '@' &&
+		    patch_parse_hunk_header(cursor, (size_t)(line_end - cursor),
+					    &hunk)) {
+			hunk.offset = (size_t)(cursor - section->data);
+			if (has_pending) {
+				pending.length = hunk.offset - pending.offset;
+				if (!cb(&pending, userdata)) {
+					return false;
+				}
+			}
+			pending = hunk;
+			has_pending = true;
+		}
+		cursor = newline ? newline + 1 : end;
+	}
+
+	if (has_pending) {
+		pending.length = section->length - pending.offset;
+		return cb(&pending, userdata);
+	}
+	return true;
+}
@@ -9,6 +9,7 @@ typedef struct patch_section {
 	char *data;
 	size_t length;
 	size_t capacity;
+	size_t offset; // byte offset of the section within the parsed input
 } patch_section;
 
 typedef bool (*patch_section_callback)(const patch_section *section,
@@ -19,4 +20,59 @@ void patch_section_reset(patch_section *section);
 void patch_section_dispose(patch_section *section);
 bool patch_section_append(patch_section *section, const char *data, size_t len);
 
+// Tells whether the section for |path| is wanted.
+typedef bool (*patch_filter_callback)(const char *path, void *userdata);
+
+// Reads the sections of |input| in order. gzip and zstd input is
+// decompressed on the fly, and offsets then index the decompressed text.
 bool patch_parse(FILE *input, patch_section_callback cb, void *userdata);
+// Like patch_parse(), but sections |filter| rejects are read past without
+// copying their text and never reach |cb|.
+bool patch_parse_filtered(FILE *input, patch_filter_callback filter,
+			  patch_section_callback cb, void *userdata);
+// Like patch_parse(), but only reports where each section lives in |input|:
+// sections handed to |cb| carry path, offset and length, with no data.
+bool patch_scan(FILE *input, patch_section_callback cb, void *userdata);
+// patch_scan() over a patch already in memory; offsets index into |data|.
+bool patch_scan_buffer(const char *data, size_t length,
+		       patch_section_callback cb, void *userdata);
+
+typedef struct {
+	size_t old_start;
+	size_t old_lines;
+	size_t new_start;
+	size_t new_lines;
+	// where the hunk sits in its section's text, from its @@ line up to
+	// the next hunk; only filled by patch_section_hunks()
+	size_t offset;
+	size_t length;
+} patch_hunk;
+
+typedef bool (*patch_hunk_callback)(const patch_hunk *hunk, void *userdata);
+
+typedef enum {
+	PATCH_LINE_SECTION, // the "diff --git" line opening a section
+	PATCH_LINE_HEADER,  // a section line before its first hunk
+	PATCH_LINE_HUNK,    // a "@@" line opening a hunk
+	PATCH_LINE_BODY,    // a line inside a hunk
+} patch_line_kind;
+
+typedef struct {
+	patch_line_kind kind;
+	const char *path; // of the section the line belongs to
+	const char *text; // the line, newline included
+	size_t length;
+	size_t offset;	 // byte offset of the line within the input
+	patch_hunk hunk; // ranges of the current hunk, once there is one
+} patch_line;
+
+typedef bool (*patch_line_callback)(const patch_line *line, void *userdata);
+
+// Parses a "@@ -a,b +c,d @@" line; a missing count means one line.
+bool patch_parse_hunk_header(const char *line, size_t length, patch_hunk *out);
+// Reports every hunk header in the text of |section|, in order.
+bool patch_section_hunks(const patch_section *section, patch_hunk_callback cb,
+			 void *userdata);
+// Streams |input| one classified line at a time, keeping no section in
+// memory; |line| is only valid during the call.
+bool patch_parse_lines(FILE *input, patch_line_callback cb, void *userdata);
@@ -0,0 +1,512 @@
+#include "backend.h"
+
+#include "util/util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HEADLESS_DEFAULT_ROWS 40
+#define HEADLESS_DEFAULT_COLS 120
+#define HEADLESS_NAME_SIZE 32U
+#define HEADLESS_ROW_SIZE 1024U
+
+static bool ncurses_open(ui_backend *backend)
+{
+	(void)backend;
+	if (initscr() == nullptr) {
+		return false;
+	}
+	if (cbreak() == ERR || noecho() == ERR) {
+		endwin();
+		return false;
+	}
+	return true;
+}
+
+static void ncurses_close(ui_backend *backend)
+{
+	(void)backend;
+	endwin();
+}
+
+static int ncurses_read_key(ui_backend *backend, WINDOW *win, int timeout_ms)
+{
+	(void)backend;
+	wtimeout(win, timeout_ms);
+	return wgetch(win);
+}
+
+ui_backend *ui_backend_ncurses(void)
+{
+	ui_backend *backend = utils_calloc(1, sizeof(*backend));
+	if (!backend) {
+		return nullptr;
+	}
+	*backend = (ui_backend){
+		.name = "ncurses",
+		.open = ncurses_open,
+		.close = ncurses_close,
+		.read_key = ncurses_read_key,
+	};
+	return backend;
+}
+
+typedef enum {
+	STEP_KEY,
+	STEP_IDLE,   // one timed-out wait
+	STEP_SETTLE, // timed-out waits until the UI stops polling
+	STEP_FRAME,
+	STEP_SLEEP,
+	STEP_END,
+} script_step_kind;
+
+typedef struct {
+	script_step_kind kind;
+	int key;
+	long value; // milliseconds for STEP_SLEEP
+	char name[HEADLESS_NAME_SIZE];
+} script_step;
+
+typedef struct {
+	const char *name;
+	int key;
+} script_key;
+
+static const script_key script_keys[] = {
+	{"Enter", '\n'},
+	{"Esc", 27},
+	{"Space", ' '},
+	{"Tab", '\t'},
+	{"lt", '<'},
+	{"Backspace", KEY_BACKSPACE},
+	{"Del", KEY_DC},
+	{"Up", KEY_UP},
+	{"Down", KEY_DOWN},
+	{"Left", KEY_LEFT},
+	{"Right", KEY_RIGHT},
+	{"PgUp", KEY_PPAGE},
+	{"PgDn", KEY_NPAGE},
+	{"Home", KEY_HOME},
+	{"End", KEY_END},
+	{"S-Up", KEY_SR},
+	{"S-Down", KEY_SF},
+	{"S-PgUp", KEY_SPREVIOUS},
+	{"S-PgDn", KEY_SNEXT},
+	{"S-Home", KEY_SHOME},
+	{"S-End", KEY_SEND},
+};
+
+typedef struct {
+	SCREEN *screen;
+	FILE *screen_out;
+	FILE *screen_in;
+	FILE *record;
+	int rows;
+	int cols;
+
+	char *script;
+	size_t script_length;
+	size_t position;
+	script_step step;
+	unsigned long repeat; // pending repetitions of |step|
+
+	// the key handed out last, timed until the UI asks for the next one
+	bool key_pending;
+	struct timespec key_started;
+	size_t keys;
+	double total_ms;
+	double max_ms;
+} headless_state;
+
+static double elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - since->tv_sec) * 1000.0 +
+	       (double)(now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static void sleep_ms(long ms)
+{
+	if (ms <= 0) {
+		return;
+	}
+	struct timespec delay = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+	while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+	}
+}
+
+static void record_string(FILE *out, const char *text, size_t length)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < length; ++i) {
+		const unsigned char ch = (unsigned char)text[i];
+		if (ch == '"' || ch == '\\') {
+			fputc('\\', out);
+			fputc(ch, out);
+		} else if (ch < 0x20U) {
+			fprintf(out, "\\u%04x", ch);
+		} else {
+			fputc(ch, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static bool read_script(const char *path, char **out, size_t *out_length)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return false;
+	}
+	const bool ok = utils_read_stream(file, out, out_length);
+	fclose(file);
+	return ok;
+}
+
+static bool parse_named_step(const char *name, script_step *step)
+{
+	if (strcmp(name, "idle") == 0) {
+		step->kind = STEP_IDLE;
+		return true;
+	}
+	if (strcmp(name, "settle") == 0) {
+		step->kind = STEP_SETTLE;
+		return true;
+	}
+	if (strcmp(name, "frame") == 0) {
+		step->kind = STEP_FRAME;
+		return true;
+	}
+	if (strncmp(name, "sleep:", 6) == 0) {
+		char *end = nullptr;
+		step->kind = STEP_SLEEP;
+		step->value = strtol(name + 6, &end, 10);
+		return end != name + 6 && *end == '\0' && step->value >= 0;
+	}
+	for (size_t i = 0; i < sizeof(script_keys) / sizeof(*script_keys);
+	     ++i) {
+		if (strcmp(name, script_keys[i].name) == 0) {
+			step->kind = STEP_KEY;
+			step->key = script_keys[i].key;
+			return true;
+		}
+	}
+	if (name[0] != '\0' && name[1] == '\0') {
+		step->kind = STEP_KEY;
+		step->key = (unsigned char)name[0];
+		return true;
+	}
+	return false;
+}
+
+// Reads the next token of the script into |state->step|. Plain characters
+// are keys, "<Name>" names a key or directive and "<Name*N>" repeats it.
+// Line breaks are ignored and lines starting with '#' are comments.
+static void headless_next_step(headless_state *state)
+{
+	const char *text = state->script;
+	const size_t length = state->script_length;
+	script_step *step = &state->step;
+	ZeroMemory(step);
+	state->repeat = 1U;
+
+	size_t pos = state->position;
+	while (pos < length) {
+		const bool line_start = pos == 0U || text[pos - 1U] == '\n';
+		if (text[pos] == '\n' || text[pos] == '\r') {
+			++pos;
+		} else if (line_start && text[pos] == '#') {
+			const char *eol =
+				memchr(text + pos, '\n', length - pos);
+			pos = eol ? (size_t)(eol - text) : length;
+		} else {
+			break;
+		}
+	}
+	if (pos >= length) {
+		state->position = length;
+		step->kind = STEP_END;
+		return;
+	}
+
+	if (text[pos] != '<') {
+		step->kind = STEP_KEY;
+		step->key = (unsigned char)text[pos];
+		step->name[0] = text[pos];
+		state->position = pos + 1U;
+		return;
+	}
+
+	const char *close = memchr(text + pos, '>', length - pos);
+	const size_t name_length =
+		close ? (size_t)(close - text) - pos - 1U : 0U;
+	if (!close || name_length == 0U ||
+	    name_length >= sizeof(step->name)) {
+		fprintf(stderr, "ui script: malformed token at offset %zu\n",
+			pos);
+		state->position = length;
+		step->kind = STEP_END;
+		return;
+	}
+	memcpy(step->name, text + pos + 1U, name_length);
+	step->name[name_length] = '\0';
+	state->position = (size_t)(close - text) + 1U;
+
+	char *star = strrchr(step->name, '*');
+	if (star && star != step->name) {
+		char *end = nullptr;
+		const unsigned long repeat = strtoul(star + 1, &end, 10);
+		if (end != star + 1 && *end == '\0') {
+			state->repeat = repeat;
+			*star = '\0';
+		}
+	}
+	if (!parse_named_step(step->name, step)) {
+		fprintf(stderr, "ui script: unknown key <%s>\n", step->name);
+		state->position = length;
+		step->kind = STEP_END;
+		state->repeat = 1U;
+	}
+}
+
+static void headless_record_frame(headless_state *state)
+{
+	if (!state->record) {
+		return;
+	}
+
+	char row[HEADLESS_ROW_SIZE];
+	const int width = state->cols < (int)sizeof(row) - 1
+				  ? state->cols
+				  : (int)sizeof(row) - 1;
+	fputs("{\"frame\":[", state->record);
+	for (int y = 0; y < state->rows; ++y) {
+		int got = mvwinnstr(curscr, y, 0, row, width);
+		size_t used = got > 0 ? (size_t)got : 0U;
+		while (used > 0U && row[used - 1U] == ' ') {
+			--used;
+		}
+		if (y > 0) {
+			fputc(',', state->record);
+		}
+		record_string(state->record, row, used);
+	}
+	fputs("]}\n", state->record);
+}
+
+static void headless_finish_key(headless_state *state)
+{
+	if (!state->key_pending) {
+		return;
+	}
+	state->key_pending = false;
+
+	const double ms = elapsed_ms(&state->key_started);
+	++state->keys;
+	state->total_ms += ms;
+	if (ms > state->max_ms) {
+		state->max_ms = ms;
+	}
+	if (state->record) {
+		fputs("{\"key\":", state->record);
+		record_string(state->record, state->step.name,
+			      strlen(state->step.name));
+		fprintf(state->record, ",\"ms\":%.3f}\n", ms);
+	}
+}
+
+static int headless_read_key(ui_backend *backend, WINDOW *win,
+			     int timeout_ms)
+{
+	headless_state *state = backend->data;
+	headless_finish_key(state);
+	// wgetch() flushes pending changes to |win| before it waits
+	if (win && is_wintouched(win)) {
+		wrefresh(win);
+	}
+
+	for (;;) {
+		if (state->repeat == 0U) {
+			headless_next_step(state);
+			if (state->repeat == 0U) {
+				continue; // "<Name*0>"
+			}
+		}
+
+		script_step *step = &state->step;
+		switch (step->kind) {
+		case STEP_KEY:
+			--state->repeat;
+			state->key_pending = true;
+			clock_gettime(CLOCK_MONOTONIC, &state->key_started);
+			return step->key;
+		case STEP_IDLE:
+			--state->repeat;
+			sleep_ms(timeout_ms);
+			return ERR;
+		case STEP_SETTLE:
+			// a blocking read means nothing is left to wait for
+			if (timeout_ms >= 0) {
+				sleep_ms(timeout_ms);
+				return ERR;
+			}
+			--state->repeat;
+			break;
+		case STEP_FRAME:
+			--state->repeat;
+			headless_record_frame(state);
+			break;
+		case STEP_SLEEP:
+			--state->repeat;
+			sleep_ms(step->value);
+			break;
+		case STEP_END:
+			// every screen backs out on Esc, so an exhausted
+			// script unwinds the program instead of hanging it
+			state->repeat = 1U;
+			return 27;
+		}
+	}
+}
+
+static bool headless_open(ui_backend *backend)
+{
+	headless_state *state = backend->data;
+
+	state->screen_out = fopen("/dev/null", "w");
+	state->screen_in = fopen("/dev/null", "r");
+	if (!state->screen_out || !state->screen_in) {
+		return false;
+	}
+	state->screen = newterm("xterm", state->screen_out, state->screen_in);
+	if (!state->screen) {
+		fputs("ui script: cannot create offscreen terminal\n", stderr);
+		return false;
+	}
+	set_term(state->screen);
+	resizeterm(state->rows, state->cols);
+	return true;
+}
+
+static void headless_close(ui_backend *backend)
+{
+	headless_state *state = backend->data;
+
+	headless_finish_key(state);
+	if (state->screen) {
+		endwin();
+		delscreen(state->screen);
+		state->screen = nullptr;
+	}
+	if (state->record) {
+		fprintf(state->record,
+			"{\"summary\":{\"keys\":%zu,\"total_ms\":%.3f,"
+			"\"max_ms\":%.3f}}\n",
+			state->keys, state->total_ms, state->max_ms);
+		fflush(state->record);
+	}
+}
+
+static void headless_free(headless_state *state)
+{
+	if (!state) {
+		return;
+	}
+	if (state->record) {
+		fclose(state->record);
+	}
+	if (state->screen_out) {
+		fclose(state->screen_out);
+	}
+	if (state->screen_in) {
+		fclose(state->screen_in);
+	}
+	utils_free(state->script);
+	utils_free(state);
+}
+
+ui_backend *ui_backend_headless(const char *script_path,
+				const char *record_path, int rows, int cols)
+{
+	assert(script_path);
+
+	ui_backend *backend = utils_calloc(1, sizeof(*backend));
+	headless_state *state = utils_calloc(1, sizeof(*state));
+	if (!backend || !state) {
+		utils_free(backend);
+		utils_free(state);
+		return nullptr;
+	}
+	state->rows = rows > 0 ? rows : HEADLESS_DEFAULT_ROWS;
+	state->cols = cols > 0 ? cols : HEADLESS_DEFAULT_COLS;
+
+	if (!read_script(script_path, &state->script,
+			 &state->script_length)) {
+		fprintf(stderr, "ui script: cannot read %s: %s\n", script_path,
+			strerror(errno));
+		goto fail;
+	}
+	if (record_path && *record_path) {
+		state->record = fopen(record_path, "w");
+		if (!state->record) {
+			fprintf(stderr, "ui script: cannot write %s: %s\n",
+				record_path, strerror(errno));
+			goto fail;
+		}
+	}
+
+	*backend = (ui_backend){
+		.name = "headless",
+		.open = headless_open,
+		.close = headless_close,
+		.read_key = headless_read_key,
+		.data = state,
+	};
+	return backend;
+
+fail:
+	headless_free(state);
+	utils_free(backend);
+	return nullptr;
+}
+
+ui_backend *ui_backend_from_environment(void)
+{
+	const char *script = getenv("PATCHUTILS_UI_SCRIPT");
+	if (!script || !*script) {
+		return ui_backend_ncurses();
+	}
+
+	int rows = HEADLESS_DEFAULT_ROWS;
+	int cols = HEADLESS_DEFAULT_COLS;
+	const char *size = getenv("PATCHUTILS_UI_SIZE");
+	if (size && sscanf(size, "%dx%d", &rows, &cols) != 2) {
+		fprintf(stderr, "ui script: ignoring PATCHUTILS_UI_SIZE=%s\n",
+			size);
+		rows = HEADLESS_DEFAULT_ROWS;
+		cols = HEADLESS_DEFAULT_COLS;
+	}
+	// an unattended run must not fall back to the real terminal
+	return ui_backend_headless(script, getenv("PATCHUTILS_UI_RECORD"),
+				   rows, cols);
+}
+
+void ui_backend_free(ui_backend *backend)
+{
+	if (!backend) {
+		return;
+	}
+	if (backend->read_key == headless_read_key) {
+		headless_free(backend->data);
+	}
+	utils_free(backend);
+}
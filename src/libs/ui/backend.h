@@ -0,0 +1,29 @@
+#pragma once
+
+#include <ncurses.h>
+#include <stdbool.h>
+
+// Terminal behind the UI. Drawing always goes through ncurses; a backend
+// decides where the screen lives and where keystrokes come from.
+typedef struct ui_backend {
+	const char *name;
+	bool (*open)(struct ui_backend *backend);
+	void (*close)(struct ui_backend *backend);
+	// Waits up to |timeout_ms| (-1 blocks) for a key aimed at |win|.
+	// Returns ERR when the wait ran out.
+	int (*read_key)(struct ui_backend *backend, WINDOW *win,
+			int timeout_ms);
+	void *data;
+} ui_backend;
+
+// The interactive terminal on stdin/stdout.
+ui_backend *ui_backend_ncurses(void);
+// An offscreen |rows| x |cols| screen fed from the key script at
+// |script_path|. Per-key timings and requested frames are appended to
+// |record_path| as JSON lines when it is not nullptr.
+ui_backend *ui_backend_headless(const char *script_path,
+				const char *record_path, int rows, int cols);
+// Headless when PATCHUTILS_UI_SCRIPT names a script (with
+// PATCHUTILS_UI_RECORD and PATCHUTILS_UI_SIZE=ROWSxCOLS), else ncurses.
+ui_backend *ui_backend_from_environment(void);
+void ui_backend_free(ui_backend *backend);
@@ -0,0 +1,285 @@
+#include "tree.h"
+
+#include "util/util.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	const char *label;
+	size_t index;
+} tree_sort_entry;
+
+static int compare_sort_entries(const void *lhs, const void *rhs)
+{
+	const tree_sort_entry *a = lhs;
+	const tree_sort_entry *b = rhs;
+	const int order = strcmp(a->label, b->label);
+	if (order != 0) {
+		return order;
+	}
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+static size_t tree_push(ui_tree *tree, size_t *capacity, size_t parent,
+			const char *name, size_t name_length, size_t item)
+{
+	if (!utils_array_reserve((void **)&tree->nodes, capacity,
+				 tree->node_count + 1U, sizeof(*tree->nodes))) {
+		return SIZE_MAX;
+	}
+
+	const size_t index = tree->node_count++;
+	tree->nodes[index] = (ui_tree_node){
+		.name = name,
+		.name_length = name_length,
+		.parent = parent,
+		.end = index + 1U,
+		.item = item,
+		.files = item != SIZE_MAX ? 1U : 0U,
+		.depth = parent != SIZE_MAX ? tree->nodes[parent].depth + 1U
+					    : 0U,
+	};
+	return index;
+}
+
+// Closes the open directories deeper than |level|: everything appended
+// from here on lies outside their subtrees.
+static void tree_close(ui_tree *tree, const size_t *stack, size_t *depth,
+		       size_t level)
+{
+	for (; *depth > level; --(*depth)) {
+		tree->nodes[stack[*depth]].end = tree->node_count;
+	}
+}
+
+bool ui_tree_build(ui_tree *tree, const ui_list_item *items, size_t count)
+{
+	assert(tree);
+	assert(items || count == 0U);
+
+	ZeroMemory(tree);
+	tree_sort_entry *sorted =
+		utils_calloc(count ? count : 1U, sizeof(*sorted));
+	tree->item_nodes =
+		utils_calloc(count ? count : 1U, sizeof(*tree->item_nodes));
+	if (!sorted || !tree->item_nodes) {
+		utils_free(sorted);
+		ui_tree_dispose(tree);
+		return false;
+	}
+	tree->item_count = count;
+
+	// paths sharing a directory prefix are contiguous once sorted, so
+	// the trie comes out in pre-order from a single pass
+	for (size_t i = 0; i < count; ++i) {
+		sorted[i] = (tree_sort_entry){
+			.label = items[i].label ? items[i].label : "",
+			.index = i,
+		};
+	}
+	qsort(sorted, count, sizeof(*sorted), compare_sort_entries);
+
+	size_t capacity = 0U;
+	size_t *stack = nullptr; // open directory at each depth
+	size_t stack_capacity = 0U;
+	size_t depth = 0U;
+	bool ok = utils_array_reserve((void **)&stack, &stack_capacity, 1U,
+				      sizeof(*stack));
+	if (ok) {
+		stack[0] = tree_push(tree, &capacity, SIZE_MAX, "", 0U,
+				     SIZE_MAX);
+		ok = stack[0] != SIZE_MAX;
+	}
+
+	for (size_t i = 0; ok && i < count; ++i) {
+		const char *component = sorted[i].label;
+		size_t level = 0U;
+		while (ok) {
+			// a trailing slash stays part of the leaf name
+			const char *slash = strchr(component, '/');
+			if (!slash || slash[1] == '\0') {
+				break;
+			}
+			const size_t length = (size_t)(slash - component);
+			++level;
+
+			const ui_tree_node *open =
+				level <= depth ? &tree->nodes[stack[level]]
+					       : nullptr;
+			if (!open || open->name_length != length ||
+			    memcmp(open->name, component, length) != 0) {
+				tree_close(tree, stack, &depth, level - 1U);
+				ok = utils_array_reserve(
+					(void **)&stack, &stack_capacity,
+					level + 1U, sizeof(*stack));
+				stack[level] =
+					ok ? tree_push(tree, &capacity,
+						       stack[level - 1U],
+						       component, length,
+						       SIZE_MAX)
+					   : SIZE_MAX;
+				ok = stack[level] != SIZE_MAX;
+				depth = level;
+			}
+			component = slash + 1;
+		}
+		if (!ok) {
+			break;
+		}
+
+		tree_close(tree, stack, &depth, level);
+		const size_t leaf =
+			tree_push(tree, &capacity, stack[level], component,
+				  strlen(component), sorted[i].index);
+		ok = leaf != SIZE_MAX;
+		if (ok) {
+			tree->item_nodes[sorted[i].index] = leaf;
+		}
+	}
+	if (ok) {
+		tree_close(tree, stack, &depth, 0U);
+		tree->nodes[0].end = tree->node_count;
+		tree->nodes[0].expanded = true;
+
+		// children follow their parent, so a reverse pass sees every
+		// subtree complete before adding it upwards
+		for (size_t i = tree->node_count; i-- > 1U;) {
+			tree->nodes[tree->nodes[i].parent].files +=
+				tree->nodes[i].files;
+		}
+	}
+
+	utils_free(stack);
+	utils_free(sorted);
+	if (!ok) {
+		ui_tree_dispose(tree);
+	}
+	return ok;
+}
+
+void ui_tree_dispose(ui_tree *tree)
+{
+	if (!tree) {
+		return;
+	}
+	utils_free(tree->nodes);
+	utils_free(tree->item_nodes);
+	ZeroMemory(tree);
+}
+
+void ui_tree_recount(ui_tree *tree, const ui_selection *selection)
+{
+	assert(tree);
+	assert(selection);
+
+	for (size_t i = 0; i < tree->node_count; ++i) {
+		ui_tree_node *node = &tree->nodes[i];
+		node->selected = node->item != SIZE_MAX &&
+				 ui_selection_test(selection, node->item);
+	}
+	for (size_t i = tree->node_count; i-- > 1U;) {
+		tree->nodes[tree->nodes[i].parent].selected +=
+			tree->nodes[i].selected;
+	}
+}
+
+void ui_tree_item_changed(ui_tree *tree, size_t item, bool value)
+{
+	assert(tree);
+
+	if (item >= tree->item_count) {
+		return;
+	}
+	for (size_t node = tree->item_nodes[item]; node != SIZE_MAX;
+	     node = tree->nodes[node].parent) {
+		if (value) {
+			++tree->nodes[node].selected;
+		} else {
+			--tree->nodes[node].selected;
+		}
+	}
+}
+
+size_t ui_tree_set_subtree(ui_tree *tree, ui_selection *selection,
+			   size_t node, bool value)
+{
+	assert(tree);
+	assert(selection);
+
+	if (node >= tree->node_count) {
+		return 0U;
+	}
+
+	size_t changed = 0U;
+	const size_t end = tree->nodes[node].end;
+	for (size_t i = node; i < end;) {
+		ui_tree_node *current = &tree->nodes[i];
+		const size_t target = value ? current->files : 0U;
+		if (current->selected == target) {
+			i = current->end;
+			continue;
+		}
+		if (current->item != SIZE_MAX) {
+			ui_selection_set(selection, current->item, value);
+			++changed;
+		}
+		current->selected = target;
+		++i;
+	}
+
+	for (size_t up = tree->nodes[node].parent; up != SIZE_MAX;
+	     up = tree->nodes[up].parent) {
+		if (value) {
+			tree->nodes[up].selected += changed;
+		} else {
+			tree->nodes[up].selected -= changed;
+		}
+	}
+	return changed;
+}
+
+void ui_tree_reveal(ui_tree *tree, size_t node)
+{
+	assert(tree);
+
+	if (node >= tree->node_count) {
+		return;
+	}
+	for (size_t up = tree->nodes[node].parent; up != SIZE_MAX;
+	     up = tree->nodes[up].parent) {
+		tree->nodes[up].expanded = true;
+	}
+}
+
+size_t ui_tree_rows(const ui_tree *tree, size_t *rows)
+{
+	assert(tree);
+	assert(rows);
+
+	size_t count = 0U;
+	for (size_t i = 1U; i < tree->node_count;) {
+		const ui_tree_node *node = &tree->nodes[i];
+		rows[count++] = i;
+		// a collapsed directory hides its whole subtree range
+		i = node->item == SIZE_MAX && !node->expanded ? node->end
+							      : i + 1U;
+	}
+	return count;
+}
+
+size_t ui_tree_first_item(const ui_tree *tree, size_t node)
+{
+	assert(tree);
+
+	const size_t end = node < tree->node_count ? tree->nodes[node].end
+						   : node;
+	for (size_t i = node; i < end; ++i) {
+		if (tree->nodes[i].item != SIZE_MAX) {
+			return tree->nodes[i].item;
+		}
+	}
+	return SIZE_MAX;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ui.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Directory trie over slash-separated item labels. Nodes are stored in
+// pre-order, so the subtree of node n is the index range [n, nodes[n].end)
+// and node 0 is the unnamed root.
+typedef struct {
+	const char *name; // points into the item label, not terminated
+	size_t name_length;
+	size_t parent;	    // SIZE_MAX for the root
+	size_t end;	    // one past the last node of the subtree
+	size_t item;	    // SIZE_MAX for directories
+	size_t files;	    // files in the subtree
+	size_t selected;    // selected files in the subtree
+	unsigned int depth; // 0 for the root
+	bool expanded;
+} ui_tree_node;
+
+typedef struct {
+	ui_tree_node *nodes;
+	size_t node_count;
+	size_t *item_nodes; // item index -> node index
+	size_t item_count;
+} ui_tree;
+
+bool ui_tree_build(ui_tree *tree, const ui_list_item *items, size_t count);
+void ui_tree_dispose(ui_tree *tree);
+
+// Recomputes every per-directory selected count from |selection|.
+void ui_tree_recount(ui_tree *tree, const ui_selection *selection);
+// Adjusts the counts above |item| after its bit changed to |value|.
+void ui_tree_item_changed(ui_tree *tree, size_t item, bool value);
+// Selects or clears every file under |node|, skipping subtrees that are
+// already settled. Returns the number of files whose bit changed.
+size_t ui_tree_set_subtree(ui_tree *tree, ui_selection *selection,
+			   size_t node, bool value);
+
+// Expands every ancestor of |node| so it becomes visible.
+void ui_tree_reveal(ui_tree *tree, size_t node);
+// Writes the visible nodes, in display order, to |rows| (node_count
+// entries at most) and returns how many there are. Only expanded
+// directories are descended into.
+size_t ui_tree_rows(const ui_tree *tree, size_t *rows);
+// First file at or below |node|.
+size_t ui_tree_first_item(const ui_tree *tree, size_t node);
@@ -1,13 +1,132 @@
 #include "ui.h"
+#include "backend.h"
+#include "tree.h"
+
+#include "util/trace.h"
+#include "util/util.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <ncurses.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define DESCRIPTION_WIDTH 64U
+#define DESCRIBE_POLL_MS 100
+#define PREVIEW_LINGER_MS 150
+#define PREVIEW_CACHE_BYTES (16U << 20)
+#define PREVIEW_MIN_COLS 80
+#define ROW_BUFFER_SIZE 1024
+#define VISIBLE_HINT_MAX 256U
+#define FILTER_QUERY_SIZE 256U
+#define TREE_DEFAULT_MIN_ITEMS 200U
+#define FEED_POLL_MS 50
+#define FEED_PROGRESS_SIZE 128U
+
+enum { DESCRIPTION_PENDING, DESCRIPTION_READY, DESCRIPTION_FAILED };
+enum { COLOR_PAIR_ADDED = 1, COLOR_PAIR_REMOVED, COLOR_PAIR_HUNK };
+
+typedef struct {
+	const ui_multiselect_options *options;
+	size_t count;
+	char *text; // count slots of DESCRIPTION_WIDTH bytes
+	_Atomic(unsigned char) *state;
+	atomic_size_t visible[VISIBLE_HINT_MAX]; // item indices on screen
+	atomic_size_t visible_count;
+	atomic_size_t completed;
+	atomic_bool stop;
+	atomic_bool finished;
+	pthread_t thread;
+	bool running;
+} describe_worker;
+
+struct ui_item_feed {
+	pthread_mutex_t lock;
+	// filled by the loader, guarded by |lock|
+	ui_list_item *pending;
+	size_t pending_count;
+	size_t pending_capacity;
+	char progress[FEED_PROGRESS_SIZE];
+	bool finished;
+	bool failed;
+	bool closed;
+	// owned by the UI thread
+	ui_list_item *items;
+	size_t count;
+	size_t capacity;
+};
+
+typedef struct preview_entry {
+	char *key;
+	char *text;
+	size_t length;
+	size_t *lines; // offset of every line start in |text|
+	size_t line_count;
+	struct preview_entry *prev;
+	struct preview_entry *next;
+} preview_entry;
+
+// Rendered previews keyed by item label, most recently used first. Lives
+// from ui_initialize() to ui_shutdown() so revisiting a file is instant.
+typedef struct {
+	utils_strmap index; // label -> preview_entry *
+	preview_entry *head;
+	preview_entry *tail;
+	size_t bytes;
+} preview_cache;
+
+// Incremental label filter. Keys are lowercased once, on first use, into a
+// single arena so matching is a run of memchr() calls over flat memory.
+typedef struct {
+	char *keys;
+	size_t *key_offsets; // count + 1 entries; key i spans [i], [i + 1] - 1
+	size_t key_count;
+	char query[FILTER_QUERY_SIZE];
+	size_t query_length;
+	char applied[FILTER_QUERY_SIZE]; // query that produced the view
+	size_t applied_length;
+	bool editing;
+} filter_state;
+
+typedef struct {
+	const char *title;
+	const char *prompt;
+	ui_list_item *items;
+	size_t count;
+	const ui_multiselect_options *options;
+	ui_item_feed *feed;
+	bool loading;
+	bool load_failed;
+	char progress[FEED_PROGRESS_SIZE];
+	size_t *order; // items by label when they arrive unsorted, else nullptr
+	size_t *view;  // item indices shown, or tree nodes in tree mode
+	size_t view_count;
+	size_t cursor;	  // position in |view|
+	size_t top_index; // first visible position in |view|
+	ui_selection selection;
+	size_t view_selected; // selected items among |view|
+	filter_state filter;
+	ui_tree tree; // built the first time tree mode is entered
+	bool tree_mode;
+	describe_worker worker;
+	size_t shown_descriptions;
+	bool preview_visible;
+	bool preview_pending; // waiting for the cursor to linger
+	size_t preview_scroll;
+} multiselect_state;
+
 static bool ui_ready = false;
+static ui_backend *backend;
+static preview_cache previews;
+
+static int read_key(WINDOW *win, int timeout_ms)
+{
+	return backend->read_key(backend, win, timeout_ms);
+}
 
 static size_t bounded_strlen(const char *str, size_t max_len)
 {
@@ -49,23 +168,289 @@ static void draw_centered(WINDOW *win, int y, const char *text, int attrs)
 	}
 }
 
+static void preview_entry_free(preview_entry *entry)
+{
+	utils_free(entry->key);
+	free(entry->text);
+	utils_free(entry->lines);
+	utils_free(entry);
+}
+
+static size_t preview_entry_bytes(const preview_entry *entry)
+{
+	return sizeof(*entry) + strlen(entry->key) + entry->length +
+	       entry->line_count * sizeof(*entry->lines);
+}
+
+static void preview_unlink(preview_entry *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		previews.head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		previews.tail = entry->prev;
+	}
+	entry->prev = nullptr;
+	entry->next = nullptr;
+}
+
+static void preview_push_front(preview_entry *entry)
+{
+	entry->next = previews.head;
+	if (previews.head) {
+		previews.head->prev = entry;
+	}
+	previews.head = entry;
+	if (!previews.tail) {
+		previews.tail = entry;
+	}
+}
+
+static preview_entry *preview_lookup(const char *key)
+{
+	preview_entry *entry = utils_strmap_get(&previews.index, key);
+	if (entry && entry != previews.head) {
+		preview_unlink(entry);
+		preview_push_front(entry);
+	}
+	return entry;
+}
+
+static void preview_cache_clear(void)
+{
+	while (previews.head) {
+		preview_entry *entry = previews.head;
+		previews.head = entry->next;
+		preview_entry_free(entry);
+	}
+	utils_strmap_dispose(&previews.index, nullptr);
+	ZeroMemory(&previews);
+}
+
+// Takes ownership of |text|.
+static preview_entry *preview_insert(const char *key, char *text,
+				     size_t length)
+{
+	preview_entry *entry = utils_calloc(1U, sizeof(*entry));
+	if (!entry) {
+		free(text);
+		return nullptr;
+	}
+	entry->key = utils_strdup(key);
+	entry->text = text;
+	entry->length = length;
+
+	size_t capacity = 0U;
+	for (size_t pos = 0U; entry->key && pos < length;) {
+		if (!utils_array_reserve((void **)&entry->lines, &capacity,
+					 entry->line_count + 1U,
+					 sizeof(*entry->lines))) {
+			break;
+		}
+		entry->lines[entry->line_count++] = pos;
+		const char *newline = memchr(text + pos, '\n', length - pos);
+		pos = newline ? (size_t)(newline - text) + 1U : length;
+	}
+
+	if (!entry->key ||
+	    !utils_strmap_put(&previews.index, entry->key, entry)) {
+		preview_entry_free(entry);
+		return nullptr;
+	}
+	preview_push_front(entry);
+	previews.bytes += preview_entry_bytes(entry);
+
+	// evict from the cold end, but never the entry we are about to show
+	while (previews.bytes > PREVIEW_CACHE_BYTES && previews.tail != entry) {
+		preview_entry *victim = previews.tail;
+		preview_unlink(victim);
+		utils_strmap_remove(&previews.index, victim->key);
+		previews.bytes -= preview_entry_bytes(victim);
+		preview_entry_free(victim);
+	}
+	return entry;
+}
+
+#define SELECTION_WORD_BITS 64U
+
+static size_t selection_words(size_t count)
+{
+	return (count + SELECTION_WORD_BITS - 1U) / SELECTION_WORD_BITS;
+}
+
+bool ui_selection_init(ui_selection *selection, size_t count)
+{
+	assert(selection);
+	UTILS_MEM_SCOPE(UTILS_MEM_UI);
+
+	ZeroMemory(selection);
+	if (count > 0U) {
+		selection->words =
+			utils_calloc(selection_words(count), sizeof(uint64_t));
+		if (!selection->words) {
+			return false;
+		}
+	}
+	selection->count = count;
+	return true;
+}
+
+void ui_selection_dispose(ui_selection *selection)
+{
+	if (!selection) {
+		return;
+	}
+	utils_free(selection->words);
+	ZeroMemory(selection);
+}
+
+// Grows |selection| to |count| items; the new ones start cleared.
+static bool selection_resize(ui_selection *selection, size_t count)
+{
+	const size_t old_words = selection_words(selection->count);
+	const size_t new_words = selection_words(count);
+	if (new_words > old_words) {
+		uint64_t *words = utils_realloc(
+			selection->words, new_words * sizeof(*words));
+		if (!words) {
+			return false;
+		}
+		memset(words + old_words, 0,
+		       (new_words - old_words) * sizeof(*words));
+		selection->words = words;
+	}
+	selection->count = count;
+	return true;
+}
+
+bool ui_selection_test(const ui_selection *selection, size_t index)
+{
+	assert(selection);
+
+	if (index >= selection->count) {
+		return false;
+	}
+	return (selection->words[index / SELECTION_WORD_BITS] >>
+		(index % SELECTION_WORD_BITS)) &
+	       1U;
+}
+
+void ui_selection_set(ui_selection *selection, size_t index, bool value)
+{
+	assert(selection);
+
+	if (index >= selection->count ||
+	    ui_selection_test(selection, index) == value) {
+		return;
+	}
+
+	const uint64_t bit = UINT64_C(1) << (index % SELECTION_WORD_BITS);
+	if (value) {
+		selection->words[index / SELECTION_WORD_BITS] |= bit;
+		++selection->selected;
+	} else {
+		selection->words[index / SELECTION_WORD_BITS] &= ~bit;
+		--selection->selected;
+	}
+}
+
+static void selection_trim(ui_selection *selection)
+{
+	// keep the bits past |count| clear so counts and scans stay exact
+	const size_t tail = selection->count % SELECTION_WORD_BITS;
+	if (tail != 0U) {
+		selection->words[selection->count / SELECTION_WORD_BITS] &=
+			(UINT64_C(1) << tail) - 1U;
+	}
+}
+
+void ui_selection_fill(ui_selection *selection, bool value)
+{
+	assert(selection);
+
+	if (selection->count == 0U) {
+		return;
+	}
+	memset(selection->words, value ? 0xff : 0,
+	       selection_words(selection->count) * sizeof(uint64_t));
+	selection_trim(selection);
+	selection->selected = value ? selection->count : 0U;
+}
+
+void ui_selection_invert(ui_selection *selection)
+{
+	assert(selection);
+
+	if (selection->count == 0U) {
+		return;
+	}
+	const size_t words = selection_words(selection->count);
+	for (size_t i = 0; i < words; ++i) {
+		selection->words[i] = ~selection->words[i];
+	}
+	selection_trim(selection);
+	selection->selected = selection->count - selection->selected;
+}
+
+size_t ui_selection_next(const ui_selection *selection, size_t from)
+{
+	assert(selection);
+
+	if (from >= selection->count) {
+		return SIZE_MAX;
+	}
+
+	size_t word = from / SELECTION_WORD_BITS;
+	uint64_t bits = selection->words[word] >> (from % SELECTION_WORD_BITS)
+			<< (from % SELECTION_WORD_BITS);
+	const size_t words = selection_words(selection->count);
+	while (bits == 0U) {
+		if (++word >= words) {
+			return SIZE_MAX;
+		}
+		bits = selection->words[word];
+	}
+	return word * SELECTION_WORD_BITS + (size_t)__builtin_ctzll(bits);
+}
+
 int ui_initialize(void)
 {
 	if (ui_ready) {
 		return 0;
 	}
+	UTILS_MEM_SCOPE(UTILS_MEM_UI);
+	return ui_initialize_backend(ui_backend_from_environment());
+}
 
-	if (initscr() == nullptr) {
+int ui_initialize_backend(ui_backend *chosen)
+{
+	if (!chosen) {
 		return -1;
 	}
+	if (ui_ready) {
+		ui_backend_free(chosen);
+		return 0;
+	}
 
-	if (cbreak() == ERR || noecho() == ERR) {
-		endwin();
+	if (!chosen->open(chosen)) {
+		ui_backend_free(chosen);
 		return -1;
 	}
+	backend = chosen;
 
 	keypad(stdscr, TRUE);
 	curs_set(0);
+	if (has_colors()) {
+		start_color();
+		use_default_colors();
+		init_pair(COLOR_PAIR_ADDED, COLOR_GREEN, -1);
+		init_pair(COLOR_PAIR_REMOVED, COLOR_RED, -1);
+		init_pair(COLOR_PAIR_HUNK, COLOR_CYAN, -1);
+	}
 #if defined(NCURSES_VERSION)
 	set_escdelay(25);
 #endif
@@ -79,159 +464,1316 @@ void ui_shutdown(void)
 		return;
 	}
 
+	preview_cache_clear();
 	curs_set(1);
-	endwin();
+	backend->close(backend);
+	ui_backend_free(backend);
+	backend = nullptr;
 	ui_ready = false;
 }
 
-static void render_multiselect(const char *title, const char *prompt,
-			       ui_list_item *items, size_t count,
-			       size_t current_index, size_t top_index)
+static size_t describe_next(describe_worker *worker, size_t *sequential)
 {
-	erase();
+	// rows on screen first, then everything else in list order
+	const size_t visible = atomic_load(&worker->visible_count);
+	for (size_t i = 0; i < visible && i < VISIBLE_HINT_MAX; ++i) {
+		const size_t index = atomic_load(&worker->visible[i]);
+		if (index < worker->count &&
+		    atomic_load(&worker->state[index]) == DESCRIPTION_PENDING) {
+			return index;
+		}
+	}
 
-	int rows, cols;
-	getmaxyx(stdscr, rows, cols);
+	while (*sequential < worker->count &&
+	       atomic_load(&worker->state[*sequential]) !=
+		       DESCRIPTION_PENDING) {
+		++(*sequential);
+	}
+	return *sequential < worker->count ? *sequential : SIZE_MAX;
+}
 
-	draw_centered(stdscr, 0, title, A_BOLD);
+static void *describe_worker_main(void *arg)
+{
+	describe_worker *worker = arg;
+	size_t sequential = 0U;
 
-	if (prompt) {
-		mvprintw(2, 2, "%s", prompt);
+	while (!atomic_load(&worker->stop)) {
+		const size_t index = describe_next(worker, &sequential);
+		if (index == SIZE_MAX) {
+			break;
+		}
+
+		char *slot = worker->text + index * DESCRIPTION_WIDTH;
+		const bool ok = worker->options->describe(
+			index, slot, DESCRIPTION_WIDTH,
+			worker->options->userdata);
+		atomic_store(&worker->state[index],
+			     ok ? DESCRIPTION_READY : DESCRIPTION_FAILED);
+		atomic_fetch_add(&worker->completed, 1U);
 	}
 
-	int list_start = 4;
-	int list_height = rows - list_start - 3;
-	if (list_height < 1) {
-		list_height = 1;
+	atomic_store(&worker->finished, true);
+	return nullptr;
+}
+
+static void describe_worker_start(describe_worker *worker,
+				  const ui_multiselect_options *options,
+				  size_t count)
+{
+	*worker = (describe_worker){.options = options, .count = count};
+	if (!options || !options->describe) {
+		return;
 	}
 
-	for (int i = 0; i < list_height && (top_index + (size_t)i) < count;
-	     ++i) {
-		size_t idx = top_index + (size_t)i;
-		ui_list_item *item = &items[idx];
-		const char *marker = item->selected ? "[x]" : "[ ]";
-		if (top_index + (size_t)i == current_index) {
-			attron(A_REVERSE);
-		}
-		if (item->description && *item->description) {
-			mvprintw(list_start + i, 4, "%s %s <=> %s", marker,
-				 item->label ? item->label : "",
-				 item->description);
-		} else {
-			mvprintw(list_start + i, 4, "%s %s", marker,
-				 item->label ? item->label : "");
-		}
-		if (top_index + (size_t)i == current_index) {
-			attroff(A_REVERSE);
-		}
+	worker->text = utils_calloc(count, DESCRIPTION_WIDTH);
+	worker->state = utils_calloc(count, sizeof(*worker->state));
+	if (!worker->text || !worker->state) {
+		goto fail;
 	}
 
-	mvprintw(rows - 2, 2,
-		 "Use Up/Down to navigate, Space to toggle, Enter to confirm, "
-		 "Esc "
-		 "to cancel");
-	refresh();
+	if (pthread_create(&worker->thread, nullptr, describe_worker_main,
+			   worker) != 0) {
+		goto fail;
+	}
+	worker->running = true;
+	return;
+
+fail:
+	utils_free(worker->text);
+	utils_free(worker->state);
+	worker->text = nullptr;
+	worker->state = nullptr;
 }
 
-int ui_multiselect(const char *title, const char *prompt, ui_list_item *items,
-		   size_t count)
+static void describe_worker_stop(describe_worker *worker)
 {
-	if (!ui_ready) {
-		return -1;
+	if (worker->running) {
+		atomic_store(&worker->stop, true);
+		pthread_join(worker->thread, nullptr);
+		worker->running = false;
 	}
+	utils_free(worker->text);
+	utils_free(worker->state);
+	worker->text = nullptr;
+	worker->state = nullptr;
+}
 
-	if (count == 0) {
-		erase();
-		draw_centered(stdscr, 0, title ? title : "", A_BOLD);
-		mvprintw(2, 2, "%s", prompt ? prompt : "No entries available.");
-		mvprintw(4, 2, "Press any key to continue.");
-		refresh();
-		getch();
-		return 0;
+static const char *item_description(const describe_worker *worker,
+				    const ui_list_item *items, size_t index)
+{
+	if (worker->state &&
+	    atomic_load(&worker->state[index]) == DESCRIPTION_READY) {
+		return worker->text + index * DESCRIPTION_WIDTH;
 	}
+	return items[index].description;
+}
 
-	size_t current_index = 0U;
-	size_t top_index = 0U;
+// Item shown at |pos|, or SIZE_MAX for a directory row.
+static size_t view_item(const multiselect_state *state, size_t pos)
+{
+	const size_t entry = state->view[pos];
+	return state->tree_mode ? state->tree.nodes[entry].item : entry;
+}
 
-	render_multiselect(title, prompt, items, count, current_index,
-			   top_index);
+static size_t current_item(const multiselect_state *state)
+{
+	return state->cursor < state->view_count
+		       ? view_item(state, state->cursor)
+		       : SIZE_MAX;
+}
 
-	while (1) {
-		int ch = getch();
-		switch (ch) {
-		case KEY_UP:
-		case 'k':
-			if (current_index > 0) {
-				--current_index;
-				if (current_index < top_index) {
-					top_index = current_index;
-				}
-			}
-			break;
-		case KEY_DOWN:
-		case 'j':
-			if (current_index + 1 < count) {
-				++current_index;
-				const size_t list_height =
-					(size_t)compute_list_height();
-				if (current_index >= top_index + list_height) {
-					top_index = current_index -
-						    list_height + 1U;
-				}
-			}
-			break;
-		case ' ':
-			items[current_index].selected =
-				!items[current_index].selected;
-			break;
-		case 'a':
-		case 'A': {
-			bool all_selected = true;
-			for (size_t i = 0; i < count; ++i) {
-				if (!items[i].selected) {
-					all_selected = false;
-					break;
-				}
-			}
-			for (size_t i = 0; i < count; ++i) {
-				items[i].selected = !all_selected;
-			}
-			break;
+static bool preview_enabled(const multiselect_state *state)
+{
+	return state->options && state->options->preview &&
+	       state->preview_visible && getmaxx(stdscr) >= PREVIEW_MIN_COLS;
+}
+
+static const char *current_label(const multiselect_state *state)
+{
+	const size_t index = current_item(state);
+	return index != SIZE_MAX ? state->items[index].label : nullptr;
+}
+
+static const preview_entry *preview_peek(const multiselect_state *state)
+{
+	const char *label = current_label(state);
+	return label ? utils_strmap_get(&previews.index, label) : nullptr;
+}
+
+static void preview_cursor_moved(multiselect_state *state)
+{
+	state->preview_scroll = 0U;
+	const char *label = current_label(state);
+	state->preview_pending = preview_enabled(state) && label &&
+				 !utils_strmap_get(&previews.index, label);
+}
+
+static void preview_load(multiselect_state *state)
+{
+	state->preview_pending = false;
+	const char *label = current_label(state);
+	if (!label || utils_strmap_get(&previews.index, label)) {
+		return;
+	}
+
+	char *text = nullptr;
+	size_t length = 0U;
+	if (!state->options->preview(current_item(state), &text, &length,
+				     state->options->userdata)) {
+		free(text);
+		text = strdup("(preview unavailable)\n");
+		length = text ? strlen(text) : 0U;
+	}
+	preview_insert(label, text, length);
+}
+
+static bool filter_build_keys(multiselect_state *state)
+{
+	filter_state *filter = &state->filter;
+	if (filter->keys && filter->key_count == state->count) {
+		return true;
+	}
+
+	// items that arrived since the last build are appended to the arena
+	const size_t first = filter->keys ? filter->key_count : 0U;
+	size_t *offsets = utils_realloc(
+		filter->key_offsets, (state->count + 1U) * sizeof(*offsets));
+	if (!offsets) {
+		return false;
+	}
+	filter->key_offsets = offsets;
+
+	size_t total = first > 0U ? offsets[first] : 0U;
+	for (size_t i = first; i < state->count; ++i) {
+		offsets[i] = total;
+		const char *label = state->items[i].label;
+		total += (label ? strlen(label) : 0U) + 1U;
+	}
+	offsets[state->count] = total;
+
+	char *keys = utils_realloc(filter->keys, total ? total : 1U);
+	if (!keys) {
+		return false;
+	}
+	filter->keys = keys;
+
+	char *out = keys + offsets[first];
+	for (size_t i = first; i < state->count; ++i) {
+		const char *label = state->items[i].label;
+		for (; label && *label; ++label) {
+			*out++ = (char)tolower((unsigned char)*label);
 		}
-		case '\n':
-		case KEY_ENTER:
-			goto done;
-		case 27: // Escape
-		case 'q':
-		case 'Q':
-			return -1;
-		case KEY_RESIZE:
-			// No state change needed; fallthrough to redraw
-			break;
-		default:
-			break;
+		*out++ = '\0';
+	}
+	filter->key_count = state->count;
+	return true;
+}
+
+// Subsequence match: every query byte must appear in order. Each step is a
+// memchr(), which libc vectorizes, so plain substrings cost a single scan.
+static bool filter_matches(const char *key, size_t length, const char *query,
+			   size_t query_length)
+{
+	const char *end = key + length;
+	for (size_t i = 0; i < query_length; ++i) {
+		const char *hit = memchr(key, query[i], (size_t)(end - key));
+		if (!hit) {
+			return false;
 		}
+		key = hit + 1;
+	}
+	return true;
+}
 
-		const size_t list_height = (size_t)compute_list_height();
-		if (current_index < top_index) {
-			top_index = current_index;
-		} else if (current_index >= top_index + list_height) {
-			top_index = current_index - list_height + 1U;
+// Item at |pos| in label order.
+static size_t sorted_item(const multiselect_state *state, size_t pos)
+{
+	return state->order ? state->order[pos] : pos;
+}
+
+static void cursor_to_item(multiselect_state *state, size_t item)
+{
+	state->cursor = 0U;
+	for (size_t pos = 0; item != SIZE_MAX && pos < state->view_count;
+	     ++pos) {
+		if (state->view[pos] == item) {
+			state->cursor = pos;
+			break;
 		}
+	}
+}
 
-		render_multiselect(title, prompt, items, count, current_index,
-				   top_index);
+static void filter_apply(multiselect_state *state)
+{
+	filter_state *filter = &state->filter;
+	const size_t anchor = current_item(state);
+
+	// a longer query can only drop matches, so narrow the current view
+	// in place instead of rescanning the whole list
+	const bool narrowing =
+		filter->applied_length > 0U &&
+		filter->query_length >= filter->applied_length &&
+		memcmp(filter->query, filter->applied,
+		       filter->applied_length) == 0;
+
+	if (filter->query_length > 0U && !filter_build_keys(state)) {
+		beep();
+		filter->query_length = 0U;
 	}
 
-done: {
-	int selected = 0;
-	for (size_t i = 0; i < count; ++i) {
-		if (items[i].selected) {
-			++selected;
+	size_t kept = 0U;
+	if (filter->query_length == 0U) {
+		for (size_t i = 0; i < state->count; ++i) {
+			state->view[i] = sorted_item(state, i);
+		}
+		kept = state->count;
+	} else {
+		const size_t source = narrowing ? state->view_count
+						: state->count;
+		for (size_t pos = 0; pos < source; ++pos) {
+			const size_t index =
+				narrowing ? state->view[pos]
+					  : sorted_item(state, pos);
+			const size_t start = filter->key_offsets[index];
+			const size_t length =
+				filter->key_offsets[index + 1U] - start - 1U;
+			if (filter_matches(filter->keys + start, length,
+					   filter->query,
+					   filter->query_length)) {
+				state->view[kept++] = index;
+			}
+		}
+	}
+	state->view_count = kept;
+
+	if (kept == state->count) {
+		state->view_selected = state->selection.selected;
+	} else {
+		state->view_selected = 0U;
+		for (size_t pos = 0; pos < kept; ++pos) {
+			state->view_selected += ui_selection_test(
+				&state->selection, state->view[pos]);
 		}
 	}
-	return selected;
+
+	memcpy(filter->applied, filter->query, filter->query_length);
+	filter->applied_length = filter->query_length;
+
+	state->top_index = 0U;
+	cursor_to_item(state, anchor);
 }
+
+static void filter_clear(multiselect_state *state)
+{
+	state->filter.query_length = 0U;
+	state->filter.editing = false;
+	filter_apply(state);
+}
+
+// Returns true when |ch| was consumed as part of the query.
+static bool filter_handle_key(multiselect_state *state, int ch)
+{
+	filter_state *filter = &state->filter;
+	if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
+		if (filter->query_length > 0U) {
+			--filter->query_length;
+			filter_apply(state);
+		}
+		return true;
+	}
+	if (ch == '\n' || ch == KEY_ENTER) {
+		filter->editing = false;
+		return true;
+	}
+	if (ch == 27) {
+		filter_clear(state);
+		return true;
+	}
+	if (ch >= 0 && ch < 256 && isprint(ch)) {
+		if (filter->query_length + 1U < sizeof(filter->query)) {
+			filter->query[filter->query_length++] =
+				(char)tolower(ch);
+			filter_apply(state);
+		} else {
+			beep();
+		}
+		return true;
+	}
+	return false;
+}
+
+static int preview_line_attrs(const char *line, size_t length)
+{
+	if (!has_colors() || length == 0U) {
+		return 0;
+	}
+	if (length >= 3U && (strncmp(line, "+++", 3) == 0 ||
+			     strncmp(line, "---", 3) == 0)) {
+		return A_BOLD;
+	}
+	switch (line[0]) {
+	case '+':
+		return COLOR_PAIR(COLOR_PAIR_ADDED);
+	case '-':
+		return COLOR_PAIR(COLOR_PAIR_REMOVED);
+	case '@':
+		return COLOR_PAIR(COLOR_PAIR_HUNK);
+	default:
+		return 0;
+	}
+}
+
+static void render_preview(const multiselect_state *state, int top, int left,
+			   int height, int width)
+{
+	for (int y = top; y < top + height; ++y) {
+		mvaddch(y, left - 2, ACS_VLINE);
+	}
+
+	const char *label = current_label(state);
+	preview_entry *entry = label ? preview_lookup(label) : nullptr;
+	if (!entry) {
+		mvprintw(top, left, "%s",
+			 state->preview_pending ? "..." : "(no preview)");
+		return;
+	}
+	if (entry->line_count == 0U) {
+		mvprintw(top, left, "(no changes)");
+		return;
+	}
+
+	// only the rows inside the viewport are expanded and drawn
+	char row[ROW_BUFFER_SIZE];
+	const int row_width = width < (int)sizeof(row) - 1
+				      ? width
+				      : (int)sizeof(row) - 1;
+	for (int i = 0; i < height; ++i) {
+		const size_t line = state->preview_scroll + (size_t)i;
+		if (line >= entry->line_count) {
+			break;
+		}
+		const size_t start = entry->lines[line];
+		const size_t end = line + 1U < entry->line_count
+					   ? entry->lines[line + 1U]
+					   : entry->length;
+		int col = 0;
+		for (size_t pos = start; pos < end && col < row_width; ++pos) {
+			const char ch = entry->text[pos];
+			if (ch == '\n') {
+				break;
+			}
+			if (ch == '\t') {
+				do {
+					row[col++] = ' ';
+				} while (col < row_width && col % 8 != 0);
+			} else {
+				row[col++] = ch;
+			}
+		}
+		row[col] = '\0';
+
+		const int attrs =
+			preview_line_attrs(entry->text + start, end - start);
+		if (attrs) {
+			attron(attrs);
+		}
+		mvaddstr(top + i, left, row);
+		if (attrs) {
+			attroff(attrs);
+		}
+	}
+}
+
+static void format_directory_row(const ui_tree_node *node, char *row,
+				 size_t size)
+{
+	const char *marker = node->selected == 0U	     ? "[ ]"
+			     : node->selected == node->files ? "[x]"
+							     : "[~]";
+	utils_format_message((message_buf){row, size},
+			     "%s %*s%c %.*s/  %zu of %zu selected", marker,
+			     2 * (int)(node->depth - 1U), "",
+			     node->expanded ? '-' : '+',
+			     (int)node->name_length, node->name,
+			     node->selected, node->files);
+}
+
+static void format_row(const multiselect_state *state, size_t pos, char *row,
+		       size_t size)
+{
+	const size_t idx = view_item(state, pos);
+	if (idx == SIZE_MAX) {
+		format_directory_row(&state->tree.nodes[state->view[pos]], row,
+				     size);
+		return;
+	}
+
+	const ui_list_item *item = &state->items[idx];
+	const char *marker =
+		ui_selection_test(&state->selection, idx) ? "[x]" : "[ ]";
+	const char *label = item->label ? item->label : "";
+	int indent = 0;
+	if (state->tree_mode) {
+		// files sit under their directory's name, past the fold sign
+		const ui_tree_node *node = &state->tree.nodes[state->view[pos]];
+		label = node->name;
+		indent = 2 * (int)(node->depth - 1U);
+	}
+	const char *description =
+		item_description(&state->worker, state->items, idx);
+	if (description && *description) {
+		utils_format_message((message_buf){row, size},
+				     "%s %*s%s <=> %s", marker, indent, "",
+				     label, description);
+	} else {
+		utils_format_message((message_buf){row, size}, "%s %*s%s",
+				     marker, indent, "", label);
+	}
+}
+
+static void render_status(const multiselect_state *state, int rows)
+{
+	const filter_state *filter = &state->filter;
+	char loading[FEED_PROGRESS_SIZE + 32];
+	if (state->loading) {
+		FORMAT_MSG_INTO(loading, "  [loading%s%s]",
+				state->progress[0] ? " " : "", state->progress);
+	} else if (state->load_failed) {
+		FORMAT_MSG_INTO(loading, "  [loading failed: %s]",
+				state->progress);
+	} else {
+		loading[0] = '\0';
+	}
+
+	char query[FILTER_QUERY_SIZE + FEED_PROGRESS_SIZE + 128];
+	if (filter->editing || filter->applied_length > 0U) {
+		FORMAT_MSG_INTO(query, "/%.*s  (%zu of %zu, %zu selected)%s",
+				(int)filter->query_length, filter->query,
+				state->view_count, state->count,
+				state->selection.selected, loading);
+	} else {
+		FORMAT_MSG_INTO(query, "%zu of %zu selected%s",
+				state->selection.selected, state->count,
+				loading);
+	}
+
+	char help[256];
+	const char *tree_hint =
+		state->options && state->options->tree ? "t tree, " : "";
+	if (filter->editing) {
+		FORMAT_MSG_INTO(help, "Type to filter, Backspace to edit, "
+				      "Enter to keep, Esc to clear");
+	} else if (state->tree_mode) {
+		FORMAT_MSG_INTO(help, "Space toggle, Left/Right fold, t flat "
+				      "list, a all, i invert, / filter, Enter "
+				      "confirm, Esc cancel");
+	} else if (state->options && state->options->preview) {
+		FORMAT_MSG_INTO(help, "Space toggle, Shift+move range, a all, "
+				      "i invert, / filter, %sp preview, [/] "
+				      "scroll, Enter confirm, Esc cancel",
+				tree_hint);
+	} else {
+		FORMAT_MSG_INTO(help, "Space toggle, Shift+move range, a all, "
+				      "i invert, / filter, %sPgUp/PgDn/Home/"
+				      "End, Enter confirm, Esc cancel",
+				tree_hint);
+	}
+
+	const int width = getmaxx(stdscr) - 4;
+	mvaddnstr(rows - 3, 2, query, width);
+	mvaddnstr(rows - 2, 2, help, width);
+}
+
+static void render_multiselect(multiselect_state *state)
+{
+	erase();
+
+	int rows, cols;
+	getmaxyx(stdscr, rows, cols);
+
+	draw_centered(stdscr, 0, state->title, A_BOLD);
+
+	if (state->prompt) {
+		mvprintw(2, 2, "%s", state->prompt);
+	}
+
+	int list_start = 4;
+	int list_height = rows - list_start - 3;
+	if (list_height < 1) {
+		list_height = 1;
+	}
+
+	const bool preview = preview_enabled(state);
+	const int list_width = preview ? cols / 2 : cols;
+
+	char row[ROW_BUFFER_SIZE];
+	for (int i = 0; i < list_height &&
+			(state->top_index + (size_t)i) < state->view_count;
+	     ++i) {
+		const size_t pos = state->top_index + (size_t)i;
+		format_row(state, pos, row, sizeof(row));
+		if (pos == state->cursor) {
+			attron(A_REVERSE);
+		}
+		mvaddnstr(list_start + i, 4, row, list_width - 5);
+		if (pos == state->cursor) {
+			attroff(A_REVERSE);
+		}
+	}
+	if (state->view_count == 0U) {
+		mvprintw(list_start, 4, "%s",
+			 state->loading ? "(loading...)" : "(no matches)");
+	}
+
+	if (preview) {
+		render_preview(state, list_start, list_width + 2, list_height,
+			       cols - list_width - 3);
+	}
+
+	render_status(state, rows);
+	refresh();
+}
+
+static int multiselect_timeout(const multiselect_state *state)
+{
+	if (state->preview_pending) {
+		return PREVIEW_LINGER_MS;
+	}
+	if (state->loading) {
+		return FEED_POLL_MS;
+	}
+	if (state->worker.running &&
+	    (!atomic_load(&state->worker.finished) ||
+	     atomic_load(&state->worker.completed) !=
+		     state->shown_descriptions)) {
+		return DESCRIBE_POLL_MS;
+	}
+	return -1;
+}
+
+static void publish_visible(multiselect_state *state, size_t list_height)
+{
+	describe_worker *worker = &state->worker;
+	if (!worker->running) {
+		return;
+	}
+
+	size_t visible = 0U;
+	const size_t end = state->top_index + list_height;
+	for (size_t pos = state->top_index;
+	     pos < state->view_count && pos < end &&
+	     visible < VISIBLE_HINT_MAX;
+	     ++pos) {
+		const size_t index = view_item(state, pos);
+		if (index != SIZE_MAX) {
+			atomic_store(&worker->visible[visible++], index);
+		}
+	}
+	atomic_store(&worker->visible_count, visible);
+}
+
+static bool view_is_everything(const multiselect_state *state)
+{
+	// tree mode is never filtered; folded rows still count as shown
+	return state->tree_mode || state->view_count == state->count;
+}
+
+static void select_item(multiselect_state *state, size_t index, bool value)
+{
+	// |index| always comes from the view, so both counters move together
+	const size_t before = state->selection.selected;
+	ui_selection_set(&state->selection, index, value);
+	if (state->selection.selected == before) {
+		return;
+	}
+	state->view_selected += state->selection.selected;
+	state->view_selected -= before;
+	if (state->tree.nodes) {
+		ui_tree_item_changed(&state->tree, index, value);
+	}
+}
+
+static bool row_selected(const multiselect_state *state, size_t pos)
+{
+	const size_t index = view_item(state, pos);
+	if (index != SIZE_MAX) {
+		return ui_selection_test(&state->selection, index);
+	}
+	const ui_tree_node *node = &state->tree.nodes[state->view[pos]];
+	return node->selected == node->files;
+}
+
+// A directory row selects or clears its whole subtree; only the nodes
+// whose state actually changes are visited.
+static void select_row(multiselect_state *state, size_t pos, bool value)
+{
+	const size_t index = view_item(state, pos);
+	if (index != SIZE_MAX) {
+		select_item(state, index, value);
+		return;
+	}
+	ui_tree_set_subtree(&state->tree, &state->selection, state->view[pos],
+			    value);
+	state->view_selected = state->selection.selected;
+}
+
+// Resynchronizes the derived counters after a whole-list bit operation.
+static void selection_replaced(multiselect_state *state)
+{
+	state->view_selected = state->selection.selected;
+	if (state->tree.nodes) {
+		ui_tree_recount(&state->tree, &state->selection);
+	}
+}
+
+static void toggle_all_visible(multiselect_state *state)
+{
+	// "all" means the filtered view, so a query plus 'a' picks matches
+	if (view_is_everything(state)) {
+		ui_selection_fill(&state->selection,
+				  state->selection.selected != state->count);
+		selection_replaced(state);
+		return;
+	}
+	const bool value = state->view_selected != state->view_count;
+	for (size_t pos = 0; pos < state->view_count; ++pos) {
+		select_item(state, state->view[pos], value);
+	}
+}
+
+static void invert_visible(multiselect_state *state)
+{
+	if (view_is_everything(state)) {
+		ui_selection_invert(&state->selection);
+		selection_replaced(state);
+		return;
+	}
+	for (size_t pos = 0; pos < state->view_count; ++pos) {
+		const size_t index = state->view[pos];
+		select_item(state, index,
+			    !ui_selection_test(&state->selection, index));
+	}
+}
+
+// Moves the cursor by |delta| rows, clamped to the view. With |extend|,
+// every row crossed, including both ends, becomes selected.
+static void move_cursor(multiselect_state *state, ptrdiff_t delta, bool extend)
+{
+	if (state->view_count == 0U) {
+		return;
+	}
+
+	const size_t from = state->cursor;
+	size_t to;
+	if (delta < 0) {
+		const size_t back = (size_t)-delta;
+		to = back > from ? 0U : from - back;
+	} else {
+		const size_t last = state->view_count - 1U;
+		to = (size_t)delta > last - from ? last : from + (size_t)delta;
+	}
+	state->cursor = to;
+
+	if (extend) {
+		const size_t low = from < to ? from : to;
+		const size_t high = from < to ? to : from;
+		for (size_t pos = low; pos <= high; ++pos) {
+			select_row(state, pos, true);
+		}
+	}
+}
+
+// Rebuilds the visible rows after a fold and keeps the cursor on |node|.
+static void tree_refresh_rows(multiselect_state *state, size_t node)
+{
+	state->view_count = ui_tree_rows(&state->tree, state->view);
+	state->cursor = 0U;
+	for (size_t pos = 0; node != SIZE_MAX && pos < state->view_count;
+	     ++pos) {
+		if (state->view[pos] == node) {
+			state->cursor = pos;
+			break;
+		}
+	}
+}
+
+static bool tree_mode_enter(multiselect_state *state)
+{
+	// the tree is built once, so it waits for the complete list
+	if (state->loading) {
+		return false;
+	}
+	if (!state->tree.nodes) {
+		if (!ui_tree_build(&state->tree, state->items, state->count)) {
+			return false;
+		}
+		size_t *view = utils_realloc(
+			state->view, state->tree.node_count * sizeof(*view));
+		if (!view) {
+			ui_tree_dispose(&state->tree);
+			return false;
+		}
+		state->view = view;
+		ui_tree_recount(&state->tree, &state->selection);
+	}
+
+	// the tree always shows everything, so any filter goes away
+	const size_t anchor = current_item(state);
+	state->filter.query_length = 0U;
+	state->filter.applied_length = 0U;
+	state->filter.editing = false;
+	state->view_selected = state->selection.selected;
+	state->tree_mode = true;
+
+	const size_t node =
+		anchor != SIZE_MAX ? state->tree.item_nodes[anchor] : SIZE_MAX;
+	if (node != SIZE_MAX) {
+		ui_tree_reveal(&state->tree, node);
+	}
+	tree_refresh_rows(state, node);
+	return true;
+}
+
+static void tree_mode_leave(multiselect_state *state)
+{
+	const size_t anchor =
+		state->cursor < state->view_count
+			? ui_tree_first_item(&state->tree,
+					     state->view[state->cursor])
+			: SIZE_MAX;
+	state->tree_mode = false;
+	state->view_count = 0U;
+	filter_apply(state);
+	cursor_to_item(state, anchor);
+}
+
+// Right opens a folded directory or steps into an open one; Left folds an
+// open directory or steps out to the parent.
+static void tree_fold(multiselect_state *state, bool expand)
+{
+	if (!state->tree_mode || state->cursor >= state->view_count) {
+		return;
+	}
+
+	size_t node = state->view[state->cursor];
+	ui_tree_node *entry = &state->tree.nodes[node];
+	const bool directory = entry->item == SIZE_MAX;
+	if (directory && entry->expanded != expand) {
+		entry->expanded = expand;
+	} else if (!expand && entry->parent != 0U) {
+		node = entry->parent;
+	} else if (expand && directory && node + 1U < entry->end) {
+		node = node + 1U;
+	} else {
+		return;
+	}
+	tree_refresh_rows(state, node);
+}
+
+ui_item_feed *ui_item_feed_new(void)
+{
+	UTILS_MEM_SCOPE(UTILS_MEM_UI);
+	ui_item_feed *feed = utils_calloc(1U, sizeof(*feed));
+	if (feed) {
+		pthread_mutex_init(&feed->lock, nullptr);
+	}
+	return feed;
+}
+
+static void free_item_labels(ui_list_item *items, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		utils_free((char *)items[i].label);
+	}
+}
+
+void ui_item_feed_free(ui_item_feed *feed)
+{
+	if (!feed) {
+		return;
+	}
+	free_item_labels(feed->pending, feed->pending_count);
+	free_item_labels(feed->items, feed->count);
+	utils_free(feed->pending);
+	utils_free(feed->items);
+	pthread_mutex_destroy(&feed->lock);
+	utils_free(feed);
+}
+
+bool ui_item_feed_push(ui_item_feed *feed, const char *label,
+		       const char *description)
+{
+	assert(feed);
+	assert(label);
+	UTILS_MEM_SCOPE(UTILS_MEM_UI);
+
+	// copy outside the lock so the UI thread never waits on malloc
+	char *copy = utils_strdup(label);
+	if (!copy) {
+		return false;
+	}
+
+	pthread_mutex_lock(&feed->lock);
+	const bool ok = !feed->closed &&
+			utils_array_reserve((void **)&feed->pending,
+					    &feed->pending_capacity,
+					    feed->pending_count + 1U,
+					    sizeof(*feed->pending));
+	if (ok) {
+		feed->pending[feed->pending_count++] = (ui_list_item){
+			.label = copy,
+			.description = description,
+			.selected = false,
+		};
+	}
+	pthread_mutex_unlock(&feed->lock);
+
+	if (!ok) {
+		utils_free(copy);
+	}
+	return ok;
+}
+
+bool ui_item_feed_progress(ui_item_feed *feed, const char *message)
+{
+	assert(feed);
+
+	pthread_mutex_lock(&feed->lock);
+	FORMAT_MSG_INTO(feed->progress, "%s", message ? message : "");
+	const bool open = !feed->closed;
+	pthread_mutex_unlock(&feed->lock);
+	return open;
+}
+
+void ui_item_feed_finish(ui_item_feed *feed, const char *error)
+{
+	assert(feed);
+
+	pthread_mutex_lock(&feed->lock);
+	feed->finished = true;
+	feed->failed = error != nullptr;
+	FORMAT_MSG_INTO(feed->progress, "%s", error ? error : "");
+	pthread_mutex_unlock(&feed->lock);
+}
+
+ui_list_item *ui_item_feed_items(ui_item_feed *feed, size_t *out_count)
+{
+	assert(feed);
+
+	if (out_count) {
+		*out_count = feed->count;
+	}
+	return feed->items;
+}
+
+static void feed_close(ui_item_feed *feed)
+{
+	pthread_mutex_lock(&feed->lock);
+	feed->closed = true;
+	pthread_mutex_unlock(&feed->lock);
+}
+
+typedef struct {
+	const char *label;
+	size_t index;
+} sort_entry;
+
+static int compare_sort_entries(const void *lhs, const void *rhs)
+{
+	const sort_entry *a = lhs;
+	const sort_entry *b = rhs;
+	const int order = strcmp(a->label, b->label);
+	if (order != 0) {
+		return order;
+	}
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+// Appends |batch| to the feed's items and merges it into the label order.
+// Only the batch is sorted; the existing order is merged in one pass.
+static bool multiselect_take(multiselect_state *state,
+			     const ui_list_item *batch, size_t batch_count)
+{
+	ui_item_feed *feed = state->feed;
+	const size_t first = feed->count;
+	const size_t count = first + batch_count;
+
+	sort_entry *sorted = utils_malloc(batch_count * sizeof(*sorted));
+	size_t *order = utils_malloc(count * sizeof(*order));
+	size_t *view = utils_realloc(state->view, count * sizeof(*view));
+	if (view) {
+		state->view = view;
+	}
+	// the selection grows last, so a failure leaves every count as is
+	if (!sorted || !order || !view ||
+	    !utils_array_reserve((void **)&feed->items, &feed->capacity,
+				 count, sizeof(*feed->items)) ||
+	    !selection_resize(&state->selection, count)) {
+		utils_free(sorted);
+		utils_free(order);
+		return false;
+	}
+
+	memcpy(feed->items + first, batch, batch_count * sizeof(*batch));
+	feed->count = count;
+	state->items = feed->items;
+	state->count = count;
+
+	for (size_t i = 0; i < batch_count; ++i) {
+		sorted[i] = (sort_entry){batch[i].label, first + i};
+	}
+	qsort(sorted, batch_count, sizeof(*sorted), compare_sort_entries);
+
+	size_t old = 0U;
+	size_t added = 0U;
+	for (size_t out = 0; out < count; ++out) {
+		const bool take_old =
+			added == batch_count ||
+			(old < first &&
+			 strcmp(state->items[state->order[old]].label,
+				sorted[added].label) <= 0);
+		order[out] = take_old ? state->order[old++]
+				      : sorted[added++].index;
+	}
+
+	utils_free(state->order);
+	state->order = order;
+	utils_free(sorted);
+	return true;
+}
+
+// Takes in whatever the loader pushed since the last call. Returns true
+// when the rows or the progress line changed.
+static bool multiselect_drain(multiselect_state *state)
+{
+	if (!state->loading) {
+		return false;
+	}
+
+	ui_item_feed *feed = state->feed;
+	pthread_mutex_lock(&feed->lock);
+	ui_list_item *batch = feed->pending;
+	const size_t batch_count = feed->pending_count;
+	feed->pending = nullptr;
+	feed->pending_count = 0U;
+	feed->pending_capacity = 0U;
+	const bool finished = feed->finished;
+	const bool failed = feed->failed;
+	const bool progressed = strcmp(state->progress, feed->progress) != 0;
+	memcpy(state->progress, feed->progress, sizeof(state->progress));
+	pthread_mutex_unlock(&feed->lock);
+
+	if (batch_count > 0U) {
+		// keep the cursor on its item and at the same screen row
+		const size_t offset = state->cursor >= state->top_index
+					      ? state->cursor - state->top_index
+					      : 0U;
+		if (multiselect_take(state, batch, batch_count)) {
+			// new rows may match the query, so rescan everything
+			state->filter.applied_length = 0U;
+			filter_apply(state);
+			state->top_index = state->cursor > offset
+						   ? state->cursor - offset
+						   : 0U;
+		} else {
+			free_item_labels(batch, batch_count);
+			beep();
+		}
+	}
+	utils_free(batch);
+
+	if (finished) {
+		state->loading = false;
+		state->load_failed = failed;
+		if (state->count > 0U) {
+			describe_worker_start(&state->worker, state->options,
+					      state->count);
+		}
+	}
+	return batch_count > 0U || progressed || finished;
+}
+
+static int multiselect_run(multiselect_state *state)
+{
+	TRACE_SCOPE_DETAIL("ui.multiselect", state->title);
+	UTILS_MEM_SCOPE(UTILS_MEM_UI);
+	const ui_multiselect_options *options = state->options;
+	int result = -1;
+
+	publish_visible(state, (size_t)compute_list_height());
+	preview_cursor_moved(state);
+	render_multiselect(state);
+
+	while (1) {
+		int ch = read_key(stdscr, multiselect_timeout(state));
+		const size_t previous_item = current_item(state);
+		const bool fed = multiselect_drain(state);
+		if (state->feed && !state->loading && state->count == 0U) {
+			goto done;
+		}
+
+		if (ch != ERR && state->filter.editing &&
+		    filter_handle_key(state, ch)) {
+			goto update;
+		}
+
+		switch (ch) {
+		case ERR:
+			// idle: the cursor lingered or descriptions arrived
+			if (state->preview_pending) {
+				preview_load(state);
+				break;
+			}
+			if (fed) {
+				break;
+			}
+			if (atomic_load(&state->worker.completed) ==
+			    state->shown_descriptions) {
+				continue;
+			}
+			break;
+		case KEY_UP:
+		case 'k':
+			move_cursor(state, -1, false);
+			break;
+		case KEY_DOWN:
+		case 'j':
+			move_cursor(state, 1, false);
+			break;
+		case KEY_SR: // Shift+Up
+		case 'K':
+			move_cursor(state, -1, true);
+			break;
+		case KEY_SF: // Shift+Down
+		case 'J':
+			move_cursor(state, 1, true);
+			break;
+		case KEY_PPAGE:
+		case KEY_SPREVIOUS:
+			move_cursor(state, -(ptrdiff_t)compute_list_height(),
+				    ch == KEY_SPREVIOUS);
+			break;
+		case KEY_NPAGE:
+		case KEY_SNEXT:
+			move_cursor(state, compute_list_height(),
+				    ch == KEY_SNEXT);
+			break;
+		case KEY_HOME:
+		case KEY_SHOME:
+		case 'g':
+			move_cursor(state, -(ptrdiff_t)state->cursor,
+				    ch == KEY_SHOME);
+			break;
+		case KEY_END:
+		case KEY_SEND:
+		case 'G':
+			move_cursor(state, PTRDIFF_MAX, ch == KEY_SEND);
+			break;
+		case ' ':
+			if (state->cursor < state->view_count) {
+				select_row(state, state->cursor,
+					   !row_selected(state, state->cursor));
+			}
+			break;
+		case KEY_RIGHT:
+		case 'l':
+			tree_fold(state, true);
+			break;
+		case KEY_LEFT:
+		case 'h':
+			tree_fold(state, false);
+			break;
+		case 't':
+		case 'T':
+			if (state->tree_mode) {
+				tree_mode_leave(state);
+			} else if (options && options->tree &&
+				   !tree_mode_enter(state)) {
+				beep();
+			}
+			break;
+		case 'a':
+		case 'A':
+			toggle_all_visible(state);
+			break;
+		case 'i':
+		case 'I':
+			invert_visible(state);
+			break;
+		case '/':
+			if (state->tree_mode) {
+				tree_mode_leave(state);
+			}
+			state->filter.editing = true;
+			break;
+		case 'p':
+		case 'P':
+			state->preview_visible = !state->preview_visible;
+			preview_cursor_moved(state);
+			break;
+		case '[':
+			state->preview_scroll =
+				state->preview_scroll > (size_t)LINES / 2U
+					? state->preview_scroll -
+						  (size_t)LINES / 2U
+					: 0U;
+			break;
+		case ']': {
+			const preview_entry *entry = preview_peek(state);
+			const size_t lines = entry ? entry->line_count : 0U;
+			state->preview_scroll += (size_t)LINES / 2U;
+			if (entry && state->preview_scroll >= lines) {
+				state->preview_scroll = lines ? lines - 1U : 0U;
+			}
+			break;
+		}
+		case '\n':
+		case KEY_ENTER:
+			goto done;
+		case 27: // Escape
+			if (state->filter.applied_length > 0U) {
+				filter_clear(state);
+				break;
+			}
+			goto cleanup;
+		case 'q':
+		case 'Q':
+			goto cleanup;
+		case KEY_RESIZE:
+			// No state change needed; fallthrough to redraw
+			break;
+		default:
+			break;
+		}
+
+	update:
+		if (current_item(state) != previous_item) {
+			preview_cursor_moved(state);
+		}
+
+		const size_t list_height = (size_t)compute_list_height();
+		if (state->cursor < state->top_index) {
+			state->top_index = state->cursor;
+		} else if (state->cursor >= state->top_index + list_height) {
+			state->top_index = state->cursor - list_height + 1U;
+		}
+		publish_visible(state, list_height);
+		state->shown_descriptions =
+			atomic_load(&state->worker.completed);
+
+		render_multiselect(state);
+	}
+
+done:
+	for (size_t i = 0; i < state->count; ++i) {
+		state->items[i].selected =
+			ui_selection_test(&state->selection, i);
+	}
+	ui_selection *out = options ? options->selection : nullptr;
+	if (out && out->count != state->count) {
+		ui_selection_dispose(out);
+		if (!ui_selection_init(out, state->count)) {
+			out = nullptr;
+		}
+	}
+	if (out && state->count > 0U) {
+		memcpy(out->words, state->selection.words,
+		       selection_words(state->count) * sizeof(uint64_t));
+		out->selected = state->selection.selected;
+	}
+	result = (int)state->selection.selected;
+
+cleanup:
+	describe_worker_stop(&state->worker);
+	ui_selection_dispose(&state->selection);
+	ui_tree_dispose(&state->tree);
+	utils_free(state->filter.keys);
+	utils_free(state->filter.key_offsets);
+	utils_free(state->order);
+	utils_free(state->view);
+	return result;
+}
+
+int ui_multiselect(const char *title, const char *prompt, ui_list_item *items,
+		   size_t count)
+{
+	return ui_multiselect_ex(title, prompt, items, count, nullptr);
+}
+
+int ui_multiselect_ex(const char *title, const char *prompt,
+		      ui_list_item *items, size_t count,
+		      const ui_multiselect_options *options)
+{
+	if (!ui_ready) {
+		return -1;
+	}
+
+	if (count == 0) {
+		erase();
+		draw_centered(stdscr, 0, title ? title : "", A_BOLD);
+		mvprintw(2, 2, "%s", prompt ? prompt : "No entries available.");
+		mvprintw(4, 2, "Press any key to continue.");
+		refresh();
+		read_key(stdscr, -1);
+		return 0;
+	}
+
+	multiselect_state state = {
+		.title = title,
+		.prompt = prompt,
+		.items = items,
+		.count = count,
+		.options = options,
+		.preview_visible = true,
+	};
+	UTILS_MEM_SCOPE(UTILS_MEM_UI);
+	state.view = utils_calloc(count, sizeof(*state.view));
+	if (!state.view || !ui_selection_init(&state.selection, count)) {
+		utils_free(state.view);
+		return -1;
+	}
+	// items[].selected is read once here and written once on confirm; in
+	// between every toggle is a bit flip plus two counter updates
+	for (size_t i = 0; i < count; ++i) {
+		if (items[i].selected) {
+			ui_selection_set(&state.selection, i, true);
+		}
+	}
+	if (!options || !options->tree || count < TREE_DEFAULT_MIN_ITEMS ||
+	    !tree_mode_enter(&state)) {
+		filter_apply(&state);
+	}
+
+	describe_worker_start(&state.worker, options, count);
+	return multiselect_run(&state);
+}
+
+int ui_multiselect_feed(const char *title, const char *prompt,
+			ui_item_feed *feed,
+			const ui_multiselect_options *options)
+{
+	if (!feed) {
+		return -1;
+	}
+	if (!ui_ready) {
+		feed_close(feed);
+		return -1;
+	}
+
+	multiselect_state state = {
+		.title = title,
+		.prompt = prompt,
+		.options = options,
+		.feed = feed,
+		.loading = true,
+		.preview_visible = true,
+	};
+	UTILS_MEM_SCOPE(UTILS_MEM_UI);
+	multiselect_drain(&state);
+	const int result = multiselect_run(&state);
+	// the loader sees the close on its next push and can wind down
+	feed_close(feed);
+	return result;
 }
 
 static void render_menu(const char *title, const char *prompt,
@@ -263,6 +1805,7 @@ static void render_menu(const char *title, const char *prompt,
 int ui_menu_select(const char *title, const char *prompt,
 		   const char *const *options, size_t count)
 {
+	TRACE_SCOPE_DETAIL("ui.menu", title);
 	if (!ui_ready) {
 		return -1;
 	}
@@ -275,7 +1818,7 @@ int ui_menu_select(const char *title, const char *prompt,
 	render_menu(title, prompt, options, count, current_index);
 
 	while (1) {
-		int ch = getch();
+		int ch = read_key(stdscr, -1);
 		switch (ch) {
 		case KEY_UP:
 		case 'k':
@@ -358,7 +1901,7 @@ int ui_prompt_string(const char *title, const char *prompt,
 	while (1) {
 		draw_input_window(win, title, prompt, buffer);
 		wmove(win, 3, 2 + (int)cursor);
-		int ch = wgetch(win);
+		int ch = read_key(win, -1);
 		if (ch == 27) {
 			delwin(win);
 			curs_set(0);
@@ -415,6 +1958,7 @@ int ui_prompt_string(const char *title, const char *prompt,
 
 static void show_message_box(const char *title, const char *message)
 {
+	TRACE_SCOPE_DETAIL("ui.message", title);
 	int rows, cols;
 	getmaxyx(stdscr, rows, cols);
 
@@ -447,7 +1991,7 @@ static void show_message_box(const char *title, const char *message)
 	wrefresh(win);
 
 	int ch;
-	while ((ch = wgetch(win)) != '\n' && ch != KEY_ENTER) {
+	while ((ch = read_key(win, -1)) != '\n' && ch != KEY_ENTER) {
 		if (ch == 27) {
 			break;
 		}
@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
 	const char *label;
@@ -9,10 +10,83 @@ typedef struct {
 	bool selected;
 } ui_list_item;
 
+// Selection bitset with a running count, so callers can size and walk a
+// selection without rescanning every ui_list_item.
+typedef struct {
+	uint64_t *words;
+	size_t count;
+	size_t selected;
+} ui_selection;
+
+// Fills |buffer| with a richer description for items[index]. Runs on a
+// background thread while the list is interactive.
+typedef bool (*ui_describe_callback)(size_t index, char *buffer, size_t size,
+				     void *userdata);
+
+// Renders the diff previewed next to items[index] into a malloc'd buffer.
+// Called on the UI thread once the cursor has rested on an item.
+typedef bool (*ui_preview_callback)(size_t index, char **out_text,
+				    size_t *out_length, void *userdata);
+
+typedef struct {
+	ui_describe_callback describe;
+	ui_preview_callback preview;
+	void *userdata;
+	// When set, receives the confirmed selection alongside
+	// ui_list_item.selected; it is resized to the final item count.
+	ui_selection *selection;
+	// Labels are slash-separated paths: offer the collapsible directory
+	// view ('t'), and start in it for long lists.
+	bool tree;
+} ui_multiselect_options;
+
+bool ui_selection_init(ui_selection *selection, size_t count);
+void ui_selection_dispose(ui_selection *selection);
+bool ui_selection_test(const ui_selection *selection, size_t index);
+void ui_selection_set(ui_selection *selection, size_t index, bool value);
+void ui_selection_fill(ui_selection *selection, bool value);
+void ui_selection_invert(ui_selection *selection);
+// Returns the first selected index >= |from|, or SIZE_MAX.
+size_t ui_selection_next(const ui_selection *selection, size_t from);
+
+typedef struct ui_backend ui_backend;
+
+// Opens the backend chosen by ui_backend_from_environment().
 int ui_initialize(void);
+// Opens |backend| and takes ownership of it, also on failure.
+int ui_initialize_backend(ui_backend *backend);
 void ui_shutdown(void);
 int ui_multiselect(const char *title, const char *prompt, ui_list_item *items,
 		   size_t count);
+int ui_multiselect_ex(const char *title, const char *prompt,
+		      ui_list_item *items, size_t count,
+		      const ui_multiselect_options *options);
+
+// Items that arrive while a multiselect is already on screen. A loader
+// thread pushes entries; the list takes them in between keystrokes.
+typedef struct ui_item_feed ui_item_feed;
+
+ui_item_feed *ui_item_feed_new(void);
+void ui_item_feed_free(ui_item_feed *feed);
+// Thread-safe. |label| is copied, |description| must outlive the feed.
+// Returns false once the list has been closed, so the loader can stop.
+bool ui_item_feed_push(ui_item_feed *feed, const char *label,
+		       const char *description);
+// Thread-safe. Shown in the status line while loading. Returns false once
+// the list has been closed.
+bool ui_item_feed_progress(ui_item_feed *feed, const char *message);
+// Thread-safe. Marks the feed complete; a non-null |error| is shown.
+void ui_item_feed_finish(ui_item_feed *feed, const char *error);
+// Items taken in so far, in arrival order; callback indices refer to this
+// array. Only for the UI thread or after ui_multiselect_feed() returned.
+ui_list_item *ui_item_feed_items(ui_item_feed *feed, size_t *out_count);
+
+// Like ui_multiselect_ex(), but the list fills from |feed| while the user
+// already filters and selects. Rows are kept sorted by label, and
+// describe() starts once the feed has finished.
+int ui_multiselect_feed(const char *title, const char *prompt,
+			ui_item_feed *feed,
+			const ui_multiselect_options *options);
 int ui_menu_select(const char *title, const char *prompt,
 		   const char *const *options, size_t count);
 bool ui_confirm(const char *title, const char *question);
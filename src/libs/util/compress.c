@@ -0,0 +1,560 @@
+#include "compress.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef PATCHUTILS_HAVE_ZLIB
+#include <zlib.h>
+#define HAVE_ZLIB true
+#else
+#define HAVE_ZLIB false
+#endif
+
+#ifdef PATCHUTILS_HAVE_ZSTD
+#include <zstd.h>
+#define HAVE_ZSTD true
+#else
+#define HAVE_ZSTD false
+#endif
+
+// compressed bytes move between the file and the codec in chunks this big
+#define CHUNK_SIZE (1U << 16)
+
+static const unsigned char gzip_magic[] = {0x1F, 0x8B};
+static const unsigned char zstd_magic[] = {0x28, 0xB5, 0x2F, 0xFD};
+
+bool utils_compression_parse(const char *name, utils_compression *out)
+{
+	static const struct {
+		const char *name;
+		utils_compression format;
+	} names[] = {
+		{"none", UTILS_COMPRESS_NONE}, {"gzip", UTILS_COMPRESS_GZIP},
+		{"gz", UTILS_COMPRESS_GZIP},   {"zstd", UTILS_COMPRESS_ZSTD},
+		{"zst", UTILS_COMPRESS_ZSTD},
+	};
+
+	assert(name);
+	assert(out);
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcmp(name, names[i].name) == 0) {
+			*out = names[i].format;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+	const size_t length = strlen(name);
+	const size_t suffix_length = strlen(suffix);
+	return length > suffix_length &&
+	       strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+utils_compression utils_compression_of_name(const char *name)
+{
+	assert(name);
+
+	if (has_suffix(name, ".gz") || has_suffix(name, ".tgz")) {
+		return UTILS_COMPRESS_GZIP;
+	}
+	if (has_suffix(name, ".zst")) {
+		return UTILS_COMPRESS_ZSTD;
+	}
+	return UTILS_COMPRESS_NONE;
+}
+
+const char *utils_compression_suffix(utils_compression format)
+{
+	switch (format) {
+	case UTILS_COMPRESS_GZIP:
+		return ".gz";
+	case UTILS_COMPRESS_ZSTD:
+		return ".zst";
+	case UTILS_COMPRESS_NONE:
+		break;
+	}
+	return "";
+}
+
+bool utils_compression_supported(utils_compression format)
+{
+	switch (format) {
+	case UTILS_COMPRESS_GZIP:
+		return HAVE_ZLIB;
+	case UTILS_COMPRESS_ZSTD:
+		return HAVE_ZSTD;
+	case UTILS_COMPRESS_NONE:
+		break;
+	}
+	return true;
+}
+
+static utils_compression detect(const unsigned char *data, size_t length)
+{
+	if (length >= sizeof(gzip_magic) &&
+	    memcmp(data, gzip_magic, sizeof(gzip_magic)) == 0) {
+		return UTILS_COMPRESS_GZIP;
+	}
+	if (length >= sizeof(zstd_magic) &&
+	    memcmp(data, zstd_magic, sizeof(zstd_magic)) == 0) {
+		return UTILS_COMPRESS_ZSTD;
+	}
+	return UTILS_COMPRESS_NONE;
+}
+
+// State behind a reading stream. The bytes taken from the source to tell
+// the format apart stay at the front of |in| and are decoded with the rest.
+typedef struct {
+	FILE *source;
+	bool owns_source;
+	utils_compression format;
+	bool source_done; // |source| is exhausted
+	bool in_frame;	  // a frame was started and has not ended yet
+	size_t in_pos;
+	size_t in_end;
+#ifdef PATCHUTILS_HAVE_ZLIB
+	z_stream gzip;
+#endif
+#ifdef PATCHUTILS_HAVE_ZSTD
+	ZSTD_DStream *zstd;
+#endif
+	unsigned char in[CHUNK_SIZE];
+} decompressor;
+
+static bool refill(decompressor *dec)
+{
+	dec->in_pos = 0U;
+	dec->in_end = fread(dec->in, 1, sizeof(dec->in), dec->source);
+	if (dec->in_end == 0U) {
+		if (ferror(dec->source)) {
+			return false;
+		}
+		dec->source_done = true;
+	}
+	return true;
+}
+
+#ifdef PATCHUTILS_HAVE_ZLIB
+static ssize_t decode_gzip(decompressor *dec, char *buffer, size_t size)
+{
+	z_stream *stream = &dec->gzip;
+	if (!dec->in_frame) {
+		if (dec->in_pos == dec->in_end) {
+			return 0;
+		}
+		// members are concatenated when gzip output is appended to,
+		// and read back as one stream
+		if (inflateReset(stream) != Z_OK) {
+			return -1;
+		}
+		dec->in_frame = true;
+	}
+
+	const uInt room = size > UINT_MAX ? UINT_MAX : (uInt)size;
+	stream->next_in = dec->in + dec->in_pos;
+	stream->avail_in = (uInt)(dec->in_end - dec->in_pos);
+	stream->next_out = (Bytef *)buffer;
+	stream->avail_out = room;
+	const int rc = inflate(stream, Z_NO_FLUSH);
+	dec->in_pos = dec->in_end - stream->avail_in;
+	if (rc == Z_STREAM_END) {
+		dec->in_frame = false;
+	} else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+		errno = EIO;
+		return -1;
+	}
+	return (ssize_t)(room - stream->avail_out);
+}
+#endif
+
+#ifdef PATCHUTILS_HAVE_ZSTD
+static ssize_t decode_zstd(decompressor *dec, char *buffer, size_t size)
+{
+	if (!dec->in_frame && dec->in_pos == dec->in_end) {
+		return 0;
+	}
+
+	ZSTD_inBuffer in = {dec->in, dec->in_end, dec->in_pos};
+	ZSTD_outBuffer out = {buffer, size, 0U};
+	const size_t rc = ZSTD_decompressStream(dec->zstd, &out, &in);
+	dec->in_pos = in.pos;
+	if (ZSTD_isError(rc)) {
+		errno = EIO;
+		return -1;
+	}
+	// 0 once a frame is decoded and flushed; the next one, if any,
+	// starts with the following call
+	dec->in_frame = rc != 0U;
+	return (ssize_t)out.pos;
+}
+#endif
+
+// Decodes from |in| into |buffer|. Returns the bytes produced, which may
+// be 0 while a frame header is consumed, or -1 on corrupt data.
+static ssize_t decode(decompressor *dec, char *buffer, size_t size)
+{
+	switch (dec->format) {
+	case UTILS_COMPRESS_GZIP:
+#ifdef PATCHUTILS_HAVE_ZLIB
+		return decode_gzip(dec, buffer, size);
+#else
+		break;
+#endif
+	case UTILS_COMPRESS_ZSTD:
+#ifdef PATCHUTILS_HAVE_ZSTD
+		return decode_zstd(dec, buffer, size);
+#else
+		break;
+#endif
+	case UTILS_COMPRESS_NONE: {
+		const size_t available = dec->in_end - dec->in_pos;
+		const size_t length = available < size ? available : size;
+		memcpy(buffer, dec->in + dec->in_pos, length);
+		dec->in_pos += length;
+		return (ssize_t)length;
+	}
+	}
+	return -1;
+}
+
+static ssize_t decompress_read(void *cookie, char *buffer, size_t size)
+{
+	decompressor *dec = cookie;
+	for (;;) {
+		if (dec->in_pos == dec->in_end && !dec->source_done &&
+		    !refill(dec)) {
+			return -1;
+		}
+		const ssize_t produced = decode(dec, buffer, size);
+		if (produced != 0) {
+			return produced;
+		}
+		if (dec->in_pos == dec->in_end && dec->source_done) {
+			if (dec->in_frame) {
+				// the stream was cut short
+				errno = EIO;
+				return -1;
+			}
+			return 0;
+		}
+	}
+}
+
+static void release_decoder(decompressor *dec)
+{
+#ifdef PATCHUTILS_HAVE_ZLIB
+	if (dec->format == UTILS_COMPRESS_GZIP) {
+		inflateEnd(&dec->gzip);
+	}
+#endif
+#ifdef PATCHUTILS_HAVE_ZSTD
+	ZSTD_freeDStream(dec->zstd);
+#endif
+	utils_free(dec);
+}
+
+static int decompress_close(void *cookie)
+{
+	decompressor *dec = cookie;
+	const int rc = dec->owns_source ? fclose(dec->source) : 0;
+	release_decoder(dec);
+	return rc;
+}
+
+static bool init_decoder(decompressor *dec)
+{
+	switch (dec->format) {
+	case UTILS_COMPRESS_GZIP:
+#ifdef PATCHUTILS_HAVE_ZLIB
+		// 32 lets zlib read the gzip header itself
+		return inflateInit2(&dec->gzip, 15 + 32) == Z_OK;
+#else
+		break;
+#endif
+	case UTILS_COMPRESS_ZSTD:
+#ifdef PATCHUTILS_HAVE_ZSTD
+		dec->zstd = ZSTD_createDStream();
+		return dec->zstd != nullptr;
+#else
+		break;
+#endif
+	case UTILS_COMPRESS_NONE:
+		return true;
+	}
+	return false;
+}
+
+// glibc keeps more than the one byte of pushback ISO C promises, which is
+// what lets a pipe be sniffed without wrapping it.
+static bool push_back(FILE *input, const unsigned char *data, size_t length)
+{
+	while (length > 0U) {
+		if (ungetc(data[--length], input) == EOF) {
+			return false;
+		}
+	}
+	return true;
+}
+
+FILE *utils_decompress_open(FILE *input, bool owns_input,
+			    utils_compression *out_format)
+{
+	assert(input);
+
+	unsigned char magic[sizeof(zstd_magic)];
+	const size_t got = fread(magic, 1, sizeof(magic), input);
+	if (got == 0U && ferror(input)) {
+		return nullptr;
+	}
+	const utils_compression format = detect(magic, got);
+	if (out_format) {
+		*out_format = format;
+	}
+	// plain input is handed back as it is where it can be rewound, or
+	// the bytes pushed back; failing both, it is passed through after
+	// the bytes already taken from it
+	if (format == UTILS_COMPRESS_NONE &&
+	    (fseeko(input, -(off_t)got, SEEK_CUR) == 0 ||
+	     push_back(input, magic, got))) {
+		return input;
+	}
+	if (!utils_compression_supported(format)) {
+		errno = ENOTSUP;
+		return nullptr;
+	}
+
+	decompressor *dec = utils_calloc(1U, sizeof(*dec));
+	if (!dec) {
+		return nullptr;
+	}
+	dec->source = input;
+	dec->owns_source = owns_input;
+	dec->format = format;
+	memcpy(dec->in, magic, got);
+	dec->in_end = got;
+	if (!init_decoder(dec)) {
+		release_decoder(dec);
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	static const cookie_io_functions_t io = {
+		.read = decompress_read,
+		.close = decompress_close,
+	};
+	FILE *stream = fopencookie(dec, "r", io);
+	if (!stream) {
+		release_decoder(dec);
+	}
+	return stream;
+}
+
+// State behind a writing stream.
+typedef struct {
+	FILE *sink;
+	bool owns_sink;
+	utils_compression format;
+	bool failed;
+#ifdef PATCHUTILS_HAVE_ZLIB
+	z_stream gzip;
+#endif
+#ifdef PATCHUTILS_HAVE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+	unsigned char out[CHUNK_SIZE];
+} compressor;
+
+static bool flush_out(compressor *enc, size_t length)
+{
+	return length == 0U || fwrite(enc->out, 1, length, enc->sink) == length;
+}
+
+#ifdef PATCHUTILS_HAVE_ZLIB
+static bool encode_gzip(compressor *enc, const char *data, size_t length,
+			bool finish)
+{
+	z_stream *stream = &enc->gzip;
+	stream->next_in = (Bytef *)data;
+	stream->avail_in = (uInt)length;
+	do {
+		stream->next_out = enc->out;
+		stream->avail_out = sizeof(enc->out);
+		if (deflate(stream, finish ? Z_FINISH : Z_NO_FLUSH) ==
+			    Z_STREAM_ERROR ||
+		    !flush_out(enc, sizeof(enc->out) - stream->avail_out)) {
+			return false;
+		}
+	} while (stream->avail_out == 0U);
+	return true;
+}
+#endif
+
+#ifdef PATCHUTILS_HAVE_ZSTD
+static bool encode_zstd(compressor *enc, const char *data, size_t length,
+			bool finish)
+{
+	ZSTD_inBuffer in = {data, length, 0U};
+	const ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+	for (;;) {
+		ZSTD_outBuffer out = {enc->out, sizeof(enc->out), 0U};
+		const size_t left =
+			ZSTD_compressStream2(enc->zstd, &out, &in, mode);
+		if (ZSTD_isError(left) || !flush_out(enc, out.pos)) {
+			return false;
+		}
+		if (finish ? left == 0U : in.pos == in.size) {
+			return true;
+		}
+	}
+}
+#endif
+
+// Feeds |data| to the codec; |finish| then ends the stream.
+static bool encode(compressor *enc, [[maybe_unused]] const char *data,
+		   [[maybe_unused]] size_t length, [[maybe_unused]] bool finish)
+{
+	switch (enc->format) {
+	case UTILS_COMPRESS_GZIP:
+#ifdef PATCHUTILS_HAVE_ZLIB
+		// zlib counts in uInt, so a huge write goes in pieces
+		for (; length > UINT_MAX; length -= UINT_MAX) {
+			if (!encode_gzip(enc, data, UINT_MAX, false)) {
+				return false;
+			}
+			data += UINT_MAX;
+		}
+		return encode_gzip(enc, data, length, finish);
+#else
+		break;
+#endif
+	case UTILS_COMPRESS_ZSTD:
+#ifdef PATCHUTILS_HAVE_ZSTD
+		return encode_zstd(enc, data, length, finish);
+#else
+		break;
+#endif
+	case UTILS_COMPRESS_NONE:
+		break;
+	}
+	return false;
+}
+
+static ssize_t compress_write(void *cookie, const char *data, size_t length)
+{
+	compressor *enc = cookie;
+	if (enc->failed || !encode(enc, data, length, false)) {
+		enc->failed = true;
+		errno = EIO;
+		// stdio takes 0, not -1, as a failed write
+		return 0;
+	}
+	return (ssize_t)length;
+}
+
+static void release_encoder(compressor *enc)
+{
+#ifdef PATCHUTILS_HAVE_ZLIB
+	if (enc->format == UTILS_COMPRESS_GZIP) {
+		deflateEnd(&enc->gzip);
+	}
+#endif
+#ifdef PATCHUTILS_HAVE_ZSTD
+	ZSTD_freeCCtx(enc->zstd);
+#endif
+	utils_free(enc);
+}
+
+static int compress_close(void *cookie)
+{
+	compressor *enc = cookie;
+	bool ok = !enc->failed && encode(enc, nullptr, 0U, true);
+	if (enc->owns_sink) {
+		ok = fclose(enc->sink) == 0 && ok;
+	} else {
+		ok = fflush(enc->sink) == 0 && ok;
+	}
+	release_encoder(enc);
+	return ok ? 0 : EOF;
+}
+
+static bool init_encoder(compressor *enc)
+{
+	switch (enc->format) {
+	case UTILS_COMPRESS_GZIP:
+#ifdef PATCHUTILS_HAVE_ZLIB
+		// 16 asks for a gzip header and trailer around the deflate data
+		return deflateInit2(&enc->gzip, Z_DEFAULT_COMPRESSION,
+				    Z_DEFLATED, 15 + 16, 8,
+				    Z_DEFAULT_STRATEGY) == Z_OK;
+#else
+		break;
+#endif
+	case UTILS_COMPRESS_ZSTD: {
+#ifdef PATCHUTILS_HAVE_ZSTD
+		enc->zstd = ZSTD_createCCtx();
+		if (!enc->zstd) {
+			return false;
+		}
+		// a libzstd built without threads refuses workers and
+		// compresses on the calling thread instead
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (cpus > 1) {
+			ZSTD_CCtx_setParameter(enc->zstd, ZSTD_c_nbWorkers,
+					       cpus < 64 ? (int)cpus : 64);
+		}
+		return true;
+#else
+		break;
+#endif
+	}
+	case UTILS_COMPRESS_NONE:
+		break;
+	}
+	return false;
+}
+
+FILE *utils_compress_open(FILE *output, bool owns_output,
+			  utils_compression format)
+{
+	assert(output);
+
+	if (format == UTILS_COMPRESS_NONE) {
+		return output;
+	}
+	if (!utils_compression_supported(format)) {
+		errno = ENOTSUP;
+		return nullptr;
+	}
+
+	compressor *enc = utils_calloc(1U, sizeof(*enc));
+	if (!enc) {
+		return nullptr;
+	}
+	enc->sink = output;
+	enc->owns_sink = owns_output;
+	enc->format = format;
+	if (!init_encoder(enc)) {
+		release_encoder(enc);
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	static const cookie_io_functions_t io = {
+		.write = compress_write,
+		.close = compress_close,
+	};
+	FILE *stream = fopencookie(enc, "w", io);
+	if (!stream) {
+		release_encoder(enc);
+	}
+	return stream;
+}
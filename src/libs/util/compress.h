@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Transparent gzip and zstd streams. Both directions are stdio streams
+// (fopencookie), so anything that reads or writes a FILE works on
+// compressed data unchanged. zlib and libzstd are optional at build time;
+// a format this build lacks is refused with ENOTSUP.
+
+typedef enum {
+	UTILS_COMPRESS_NONE,
+	UTILS_COMPRESS_GZIP,
+	UTILS_COMPRESS_ZSTD,
+} utils_compression;
+
+// Accepts "none", "gzip"/"gz" and "zstd"/"zst".
+bool utils_compression_parse(const char *name, utils_compression *out);
+// The format a file name asks for by its suffix: .gz, .tgz or .zst.
+utils_compression utils_compression_of_name(const char *name);
+// ".gz", ".zst", or "" for UTILS_COMPRESS_NONE.
+const char *utils_compression_suffix(utils_compression format);
+bool utils_compression_supported(utils_compression format);
+
+// Returns a stream reading |input| decompressed when it starts with a gzip
+// or zstd frame, told apart by their magic bytes, and |input| itself when
+// it does not. The format found is stored in |out_format| if given.
+// Closing a returned wrapper closes |input| only if |owns_input|; on
+// failure |input| is left to the caller.
+FILE *utils_decompress_open(FILE *input, bool owns_input,
+			    utils_compression *out_format);
+// Returns a stream whose writes reach |output| compressed as |format|, or
+// |output| itself for UTILS_COMPRESS_NONE. Closing the wrapper ends the
+// compressed stream, then closes |output| if |owns_output| and flushes it
+// otherwise. zstd spreads the work over every CPU where libzstd can.
+FILE *utils_compress_open(FILE *output, bool owns_output,
+			  utils_compression format);
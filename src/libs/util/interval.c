@@ -0,0 +1,117 @@
+#include "interval.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int compare_intervals(const void *lhs, const void *rhs)
+{
+	const utils_interval *a = lhs;
+	const utils_interval *b = rhs;
+	if (a->start != b->start) {
+		return a->start < b->start ? -1 : 1;
+	}
+	if (a->end != b->end) {
+		return a->end < b->end ? -1 : 1;
+	}
+	return (a->value > b->value) - (a->value < b->value);
+}
+
+// The node for [lo, hi) is its middle element; returns the subtree's
+// largest end.
+static size_t fill_max_end(utils_interval_tree *tree, size_t lo, size_t hi)
+{
+	if (lo >= hi) {
+		return 0U;
+	}
+	const size_t mid = lo + (hi - lo) / 2U;
+	size_t max_end = tree->intervals[mid].end;
+	const size_t left = fill_max_end(tree, lo, mid);
+	const size_t right = fill_max_end(tree, mid + 1U, hi);
+	if (left > max_end) {
+		max_end = left;
+	}
+	if (right > max_end) {
+		max_end = right;
+	}
+	tree->max_end[mid] = max_end;
+	return max_end;
+}
+
+bool utils_interval_tree_build(utils_interval_tree *tree,
+			       const utils_interval *intervals, size_t count)
+{
+	assert(tree);
+	assert(intervals || count == 0U);
+
+	ZeroMemory(tree);
+	if (count == 0U) {
+		return true;
+	}
+	tree->intervals = utils_calloc(count, sizeof(*tree->intervals));
+	tree->max_end = utils_calloc(count, sizeof(*tree->max_end));
+	if (!tree->intervals || !tree->max_end) {
+		utils_interval_tree_dispose(tree);
+		return false;
+	}
+
+	memcpy(tree->intervals, intervals, count * sizeof(*intervals));
+	qsort(tree->intervals, count, sizeof(*tree->intervals),
+	      compare_intervals);
+	tree->count = count;
+	fill_max_end(tree, 0U, count);
+	return true;
+}
+
+void utils_interval_tree_dispose(utils_interval_tree *tree)
+{
+	if (!tree) {
+		return;
+	}
+	utils_free(tree->intervals);
+	utils_free(tree->max_end);
+	ZeroMemory(tree);
+}
+
+static bool query_range(const utils_interval_tree *tree, size_t lo, size_t hi,
+			size_t start, size_t end, utils_interval_callback cb,
+			void *userdata)
+{
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2U;
+		// nothing below this node reaches the query
+		if (tree->max_end[mid] <= start) {
+			return true;
+		}
+		if (!query_range(tree, lo, mid, start, end, cb, userdata)) {
+			return false;
+		}
+
+		const utils_interval *node = &tree->intervals[mid];
+		// starts only grow to the right, so stop at the first one
+		// past the query
+		if (node->start >= end) {
+			return true;
+		}
+		if (node->end > start && !cb(node, userdata)) {
+			return false;
+		}
+		lo = mid + 1U;
+	}
+	return true;
+}
+
+bool utils_interval_tree_query(const utils_interval_tree *tree, size_t start,
+			       size_t end, utils_interval_callback cb,
+			       void *userdata)
+{
+	assert(tree);
+	assert(cb);
+
+	if (start >= end) {
+		return true;
+	}
+	return query_range(tree, 0U, tree->count, start, end, cb, userdata);
+}
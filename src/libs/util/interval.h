@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Static interval tree. The intervals are sorted by start once and laid
+// out as an implicit balanced tree over that array, every node keeping the
+// largest end in its subtree, so a query costs O(log n + matches).
+
+typedef struct {
+	size_t start;
+	size_t end; // exclusive
+	size_t value;
+} utils_interval;
+
+typedef struct {
+	utils_interval *intervals;
+	size_t *max_end;
+	size_t count;
+} utils_interval_tree;
+
+// Returning false stops the query.
+typedef bool (*utils_interval_callback)(const utils_interval *interval,
+					void *userdata);
+
+bool utils_interval_tree_build(utils_interval_tree *tree,
+			       const utils_interval *intervals, size_t count);
+void utils_interval_tree_dispose(utils_interval_tree *tree);
+// Reports every interval that overlaps [start, end). Returns false if the
+// callback stopped the query.
+bool utils_interval_tree_query(const utils_interval_tree *tree, size_t start,
+			       size_t end, utils_interval_callback cb,
+			       void *userdata);
@@ -0,0 +1,419 @@
+#include "util.h"
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdckdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT alignof(max_align_t)
+#define ARENA_DEFAULT_CHUNK (1U << 20)
+
+// Prefix in front of every block: the accounting needs the size and tag
+// back when the block is freed, whatever allocator sits underneath.
+typedef struct {
+	alignas(max_align_t) size_t size;
+	utils_mem_tag tag;
+} mem_header;
+
+typedef struct {
+	atomic_size_t current;
+	atomic_size_t peak;
+	atomic_size_t allocations;
+} mem_counters;
+
+static void *system_allocate(void *state, size_t size)
+{
+	(void)state;
+	return malloc(size);
+}
+
+static void *system_reallocate(void *state, void *ptr, size_t old_size,
+			       size_t size)
+{
+	(void)state;
+	(void)old_size;
+	return realloc(ptr, size);
+}
+
+static void system_release(void *state, void *ptr, size_t size)
+{
+	(void)state;
+	(void)size;
+	free(ptr);
+}
+
+static const utils_allocator system_allocator = {
+	.allocate = system_allocate,
+	.reallocate = system_reallocate,
+	.release = system_release,
+};
+
+static utils_allocator backing = system_allocator;
+static bool report_enabled; // set by utils_mem_report_at_exit()
+static mem_counters total_counters;
+static mem_counters tag_counters[UTILS_MEM_TAG_COUNT];
+static _Thread_local utils_mem_tag current_tag = UTILS_MEM_GENERAL;
+
+static const char *const tag_names[UTILS_MEM_TAG_COUNT] = {
+	[UTILS_MEM_GENERAL] = "general", [UTILS_MEM_GIT] = "git",
+	[UTILS_MEM_LIBGIT2] = "libgit2", [UTILS_MEM_PATCH] = "patch",
+	[UTILS_MEM_UI] = "ui",
+};
+
+static void counters_add(mem_counters *counters, size_t size)
+{
+	const size_t now =
+		atomic_fetch_add_explicit(&counters->current, size,
+					  memory_order_relaxed) +
+		size;
+	size_t peak = atomic_load_explicit(&counters->peak,
+					   memory_order_relaxed);
+	while (now > peak &&
+	       !atomic_compare_exchange_weak_explicit(
+		       &counters->peak, &peak, now, memory_order_relaxed,
+		       memory_order_relaxed)) {
+	}
+}
+
+static void counters_sub(mem_counters *counters, size_t size)
+{
+	atomic_fetch_sub_explicit(&counters->current, size,
+				  memory_order_relaxed);
+}
+
+static void charge(utils_mem_tag tag, size_t size)
+{
+	counters_add(&total_counters, size);
+	counters_add(&tag_counters[tag], size);
+	atomic_fetch_add_explicit(&total_counters.allocations, 1U,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&tag_counters[tag].allocations, 1U,
+				  memory_order_relaxed);
+}
+
+static void refund(utils_mem_tag tag, size_t size)
+{
+	counters_sub(&total_counters, size);
+	counters_sub(&tag_counters[tag], size);
+}
+
+void *utils_malloc_tagged(utils_mem_tag tag, size_t size)
+{
+	assert(tag < UTILS_MEM_TAG_COUNT);
+
+	size_t bytes;
+	if (ckd_add(&bytes, size, sizeof(mem_header)) != 0) {
+		return nullptr;
+	}
+	mem_header *header = backing.allocate(backing.state, bytes);
+	if (!header) {
+		return nullptr;
+	}
+	header->size = size;
+	header->tag = tag;
+	charge(tag, size);
+	return header + 1;
+}
+
+void *utils_malloc(size_t size)
+{
+	return utils_malloc_tagged(current_tag, size);
+}
+
+void *utils_calloc(size_t count, size_t size)
+{
+	size_t bytes;
+	if (ckd_mul(&bytes, count, size) != 0) {
+		return nullptr;
+	}
+	void *ptr = utils_malloc(bytes);
+	if (ptr) {
+		memset(ptr, 0, bytes);
+	}
+	return ptr;
+}
+
+void *utils_realloc(void *ptr, size_t size)
+{
+	if (!ptr) {
+		return utils_malloc(size);
+	}
+
+	size_t bytes;
+	if (ckd_add(&bytes, size, sizeof(mem_header)) != 0) {
+		return nullptr;
+	}
+	mem_header *header = (mem_header *)ptr - 1;
+	const size_t old_size = header->size;
+	const utils_mem_tag tag = header->tag;
+	mem_header *resized =
+		backing.reallocate(backing.state, header,
+				   old_size + sizeof(mem_header), bytes);
+	if (!resized) {
+		return nullptr;
+	}
+	// a resize stays charged to the subsystem that made the block
+	resized->size = size;
+	refund(tag, old_size);
+	counters_add(&total_counters, size);
+	counters_add(&tag_counters[tag], size);
+	return resized + 1;
+}
+
+char *utils_strdup(const char *str)
+{
+	return str ? utils_strndup(str, strlen(str)) : nullptr;
+}
+
+char *utils_strndup(const char *str, size_t length)
+{
+	if (!str) {
+		return nullptr;
+	}
+	const size_t used = strnlen(str, length);
+	char *copy = utils_malloc(used + 1U);
+	if (copy) {
+		memcpy(copy, str, used);
+		copy[used] = '\0';
+	}
+	return copy;
+}
+
+void utils_free(void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+	mem_header *header = (mem_header *)ptr - 1;
+	refund(header->tag, header->size);
+	backing.release(backing.state, header,
+			header->size + sizeof(mem_header));
+}
+
+utils_mem_tag utils_mem_enter(utils_mem_tag tag)
+{
+	assert(tag < UTILS_MEM_TAG_COUNT);
+
+	const utils_mem_tag previous = current_tag;
+	current_tag = tag;
+	return previous;
+}
+
+void utils_mem_leave(const utils_mem_tag *previous)
+{
+	current_tag = *previous;
+}
+
+bool utils_mem_set_allocator(const utils_allocator *allocator)
+{
+	const size_t live = atomic_load(&total_counters.current);
+	if (live != 0U) {
+		if (report_enabled) {
+			fprintf(stderr,
+				"memory: allocator swap refused, %zu bytes "
+				"still live\n",
+				live);
+		}
+		return false;
+	}
+	backing = allocator ? *allocator : system_allocator;
+	return true;
+}
+
+static void usage_load(const mem_counters *counters, utils_mem_usage *out)
+{
+	*out = (utils_mem_usage){
+		.current = atomic_load_explicit(&counters->current,
+						memory_order_relaxed),
+		.peak = atomic_load_explicit(&counters->peak,
+					     memory_order_relaxed),
+		.allocations = atomic_load_explicit(&counters->allocations,
+						    memory_order_relaxed),
+	};
+}
+
+void utils_mem_get_stats(utils_mem_stats *out)
+{
+	assert(out);
+
+	usage_load(&total_counters, &out->total);
+	for (size_t i = 0; i < UTILS_MEM_TAG_COUNT; ++i) {
+		usage_load(&tag_counters[i], &out->tags[i]);
+	}
+}
+
+const char *utils_mem_tag_name(utils_mem_tag tag)
+{
+	return tag < UTILS_MEM_TAG_COUNT ? tag_names[tag] : "unknown";
+}
+
+static void report_usage(FILE *out, const char *name,
+			 const utils_mem_usage *usage)
+{
+	fprintf(out,
+		"\"%s\":{\"current\":%zu,\"peak\":%zu,\"allocations\":%zu}",
+		name, usage->current, usage->peak, usage->allocations);
+}
+
+void utils_mem_report(FILE *out)
+{
+	utils_mem_stats stats;
+	utils_mem_get_stats(&stats);
+
+	fputc('{', out);
+	report_usage(out, "total", &stats.total);
+	for (size_t i = 0; i < UTILS_MEM_TAG_COUNT; ++i) {
+		fputc(',', out);
+		report_usage(out, tag_names[i], &stats.tags[i]);
+	}
+	fputs("}\n", out);
+}
+
+static void report_to_stderr(void)
+{
+	utils_mem_report(stderr);
+}
+
+void utils_mem_report_at_exit(void)
+{
+	const char *flag = getenv("PATCHUTILS_MEM_STATS");
+	if (flag && *flag && strcmp(flag, "0") != 0) {
+		report_enabled = true;
+		atexit(report_to_stderr);
+	}
+}
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	alignas(max_align_t) unsigned char data[];
+} arena_chunk;
+
+struct utils_arena {
+	arena_chunk *chunks; // newest first; only the newest takes blocks
+	size_t chunk_size;
+	size_t reserved;
+};
+
+static size_t align_up(size_t size)
+{
+	return (size + ARENA_ALIGNMENT - 1U) & ~(ARENA_ALIGNMENT - 1U);
+}
+
+utils_arena *utils_arena_new(size_t chunk_size)
+{
+	// arena bookkeeping comes from malloc so it never counts as a block
+	utils_arena *arena = calloc(1, sizeof(*arena));
+	if (arena) {
+		arena->chunk_size =
+			chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+	}
+	return arena;
+}
+
+void utils_arena_free(utils_arena *arena)
+{
+	if (!arena) {
+		return;
+	}
+	for (arena_chunk *chunk = arena->chunks; chunk;) {
+		arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
+
+size_t utils_arena_reserved(const utils_arena *arena)
+{
+	return arena ? arena->reserved : 0U;
+}
+
+static void *arena_allocate(void *state, size_t size)
+{
+	utils_arena *arena = state;
+	const size_t needed = align_up(size);
+	if (needed < size) {
+		return nullptr;
+	}
+
+	arena_chunk *chunk = arena->chunks;
+	if (!chunk || chunk->size - chunk->used < needed) {
+		const size_t capacity = needed > arena->chunk_size
+						? needed
+						: arena->chunk_size;
+		size_t bytes;
+		if (ckd_add(&bytes, capacity, sizeof(*chunk)) != 0) {
+			return nullptr;
+		}
+		chunk = malloc(bytes);
+		if (!chunk) {
+			return nullptr;
+		}
+		*chunk = (arena_chunk){
+			.next = arena->chunks,
+			.size = capacity,
+		};
+		arena->chunks = chunk;
+		arena->reserved += capacity;
+	}
+
+	void *ptr = chunk->data + chunk->used;
+	chunk->used += needed;
+	return ptr;
+}
+
+// Only the block on top of the newest chunk can grow or be given back, so
+// callers that free in reverse order reuse the same bytes.
+static bool arena_is_top(const utils_arena *arena, const void *ptr,
+			 size_t size)
+{
+	const arena_chunk *chunk = arena->chunks;
+	const unsigned char *block = ptr;
+	return block && chunk && block >= chunk->data &&
+	       block + align_up(size) == chunk->data + chunk->used;
+}
+
+static void *arena_reallocate(void *state, void *ptr, size_t old_size,
+			      size_t size)
+{
+	utils_arena *arena = state;
+	if (arena_is_top(arena, ptr, old_size)) {
+		arena_chunk *chunk = arena->chunks;
+		const size_t start =
+			(size_t)((unsigned char *)ptr - chunk->data);
+		const size_t needed = align_up(size);
+		if (needed >= size && chunk->size - start >= needed) {
+			chunk->used = start + needed;
+			return ptr;
+		}
+	}
+
+	void *moved = arena_allocate(state, size);
+	if (moved) {
+		memcpy(moved, ptr, old_size < size ? old_size : size);
+	}
+	return moved;
+}
+
+static void arena_release(void *state, void *ptr, size_t size)
+{
+	utils_arena *arena = state;
+	if (arena_is_top(arena, ptr, size)) {
+		arena->chunks->used -= align_up(size);
+	}
+}
+
+utils_allocator utils_arena_allocator(utils_arena *arena)
+{
+	return (utils_allocator){
+		.allocate = arena_allocate,
+		.reallocate = arena_reallocate,
+		.release = arena_release,
+		.state = arena,
+	};
+}
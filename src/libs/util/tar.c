@@ -0,0 +1,183 @@
+#include "tar.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TAR_BLOCK 512U
+#define TAR_NAME_SIZE 100U
+#define TAR_PREFIX_SIZE 155U
+// tar reads whole records of 20 blocks, so archives end on one
+#define TAR_RECORD (20U * TAR_BLOCK)
+
+typedef struct {
+	char name[TAR_NAME_SIZE];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[TAR_PREFIX_SIZE];
+	char padding[12];
+} tar_header;
+
+static_assert(sizeof(tar_header) == TAR_BLOCK, "ustar headers are a block");
+
+static const char zero_block[TAR_BLOCK];
+
+void utils_tar_init(utils_tar_writer *tar, FILE *output)
+{
+	assert(tar);
+	assert(output);
+
+	ZeroMemory(tar);
+	tar->output = output;
+	tar->mtime = time(nullptr);
+}
+
+static bool tar_write(utils_tar_writer *tar, const void *data, size_t length)
+{
+	if (length > 0U && fwrite(data, 1, length, tar->output) != length) {
+		return false;
+	}
+	tar->offset += length;
+	return true;
+}
+
+static bool tar_pad(utils_tar_writer *tar)
+{
+	const size_t partial = tar->offset % TAR_BLOCK;
+	return partial == 0U || tar_write(tar, zero_block, TAR_BLOCK - partial);
+}
+
+// Octal, zero padded and NUL terminated; values the field cannot hold in
+// octal use the base-256 form GNU and POSIX readers accept.
+static void put_number(char *field, size_t size, uint64_t value)
+{
+	const unsigned int digits = (unsigned int)(size - 1U) * 3U;
+	if (digits >= 64U || value >> digits == 0U) {
+		for (size_t i = size - 1U; i-- > 0U; value >>= 3) {
+			field[i] = (char)('0' + (value & 7U));
+		}
+		field[size - 1U] = '\0';
+		return;
+	}
+
+	for (size_t i = size; i-- > 1U; value >>= 8) {
+		field[i] = (char)(value & 0xFFU);
+	}
+	field[0] = (char)0x80;
+}
+
+static void put_checksum(tar_header *header)
+{
+	memset(header->checksum, ' ', sizeof(header->checksum));
+	unsigned int sum = 0U;
+	const unsigned char *bytes = (const unsigned char *)header;
+	for (size_t i = 0; i < sizeof(*header); ++i) {
+		sum += bytes[i];
+	}
+	put_number(header->checksum, 7U, sum);
+	header->checksum[7] = ' ';
+}
+
+// ustar stores a long name split at a '/' into prefix and name. Returns
+// the prefix length, 0 when the name fits as it is, and SIZE_MAX when it
+// fits neither way.
+static size_t prefix_length(const char *name, size_t length)
+{
+	if (length <= TAR_NAME_SIZE) {
+		return 0U;
+	}
+	const char *slash = memchr(name + length - TAR_NAME_SIZE - 1U, '/',
+				   TAR_NAME_SIZE + 1U);
+	if (!slash || slash == name ||
+	    (size_t)(slash - name) > TAR_PREFIX_SIZE) {
+		return SIZE_MAX;
+	}
+	return (size_t)(slash - name);
+}
+
+static bool write_header(utils_tar_writer *tar, const char *name,
+			 size_t name_length, char typeflag, size_t size)
+{
+	tar_header header;
+	ZeroMemory(&header);
+
+	// a name that fits neither way is cut short here; the long name
+	// record in front of the header carries all of it
+	const size_t prefix = prefix_length(name, name_length);
+	const char *base = name;
+	if (prefix != 0U && prefix != SIZE_MAX) {
+		memcpy(header.prefix, name, prefix);
+		base = name + prefix + 1U;
+	}
+	const size_t base_length = name_length - (size_t)(base - name);
+	memcpy(header.name, base,
+	       base_length < TAR_NAME_SIZE ? base_length : TAR_NAME_SIZE);
+
+	put_number(header.mode, sizeof(header.mode), 0644U);
+	put_number(header.uid, sizeof(header.uid), 0U);
+	put_number(header.gid, sizeof(header.gid), 0U);
+	put_number(header.size, sizeof(header.size), size);
+	put_number(header.mtime, sizeof(header.mtime),
+		   tar->mtime > 0 ? (uint64_t)tar->mtime : 0U);
+	header.typeflag = typeflag;
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+	put_checksum(&header);
+	return tar_write(tar, &header, sizeof(header));
+}
+
+bool utils_tar_add(utils_tar_writer *tar, const char *name, const void *data,
+		   size_t length, size_t *out_offset)
+{
+	assert(tar);
+	assert(name);
+	assert(data || length == 0U);
+
+	const size_t name_length = strlen(name);
+	if (prefix_length(name, name_length) == SIZE_MAX) {
+		static const char long_link[] = "././@LongLink";
+		if (!write_header(tar, long_link, sizeof(long_link) - 1U, 'L',
+				  name_length + 1U) ||
+		    !tar_write(tar, name, name_length + 1U) || !tar_pad(tar)) {
+			return false;
+		}
+	}
+
+	if (!write_header(tar, name, name_length, '0', length)) {
+		return false;
+	}
+	if (out_offset) {
+		*out_offset = tar->offset;
+	}
+	return tar_write(tar, data, length) && tar_pad(tar);
+}
+
+bool utils_tar_finish(utils_tar_writer *tar)
+{
+	assert(tar);
+
+	if (!tar_write(tar, zero_block, TAR_BLOCK) ||
+	    !tar_write(tar, zero_block, TAR_BLOCK)) {
+		return false;
+	}
+	while (tar->offset % TAR_RECORD != 0U) {
+		if (!tar_write(tar, zero_block, TAR_BLOCK)) {
+			return false;
+		}
+	}
+	return true;
+}
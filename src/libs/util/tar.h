@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+// Sequential ustar writer. Members are appended to |output| as they come,
+// so the archive is produced in one pass of large writes; names too long
+// for the ustar fields get a GNU long name record first.
+
+typedef struct {
+	FILE *output;
+	size_t offset; // bytes written so far
+	time_t mtime;  // stamped on every member
+} utils_tar_writer;
+
+void utils_tar_init(utils_tar_writer *tar, FILE *output);
+// Appends a regular file. |out_offset|, if given, receives where its data
+// starts in the archive.
+bool utils_tar_add(utils_tar_writer *tar, const char *name, const void *data,
+		   size_t length, size_t *out_offset);
+// Writes the end-of-archive blocks; the stream is left open.
+bool utils_tar_finish(utils_tar_writer *tar);
@@ -0,0 +1,217 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_BUFFER_SIZE (64U << 10)
+#define TRACE_EVENT_MAX 1024U // room reserved for one formatted event
+#define TRACE_DETAIL_MAX 512U
+
+atomic_bool utils_trace_active = false;
+
+// Events are formatted into a per-thread buffer and only take the lock
+// when a buffer is flushed, so workers do not serialize on every span.
+typedef struct {
+	char data[TRACE_BUFFER_SIZE];
+	size_t length;
+	pid_t tid;
+} trace_buffer;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static bool trace_wrote_event;
+static uint64_t trace_origin_ns;
+static pid_t trace_pid;
+static pthread_key_t trace_key;
+static bool trace_key_ready;
+static _Thread_local trace_buffer *local_buffer;
+
+uint64_t utils_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_flush(trace_buffer *buffer)
+{
+	if (!buffer || buffer->length == 0U) {
+		return;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		// every event starts with a separator; the very first one
+		// opens the array instead
+		const size_t skip = trace_wrote_event ? 0U : 1U;
+		fwrite(buffer->data + skip, 1, buffer->length - skip,
+		       trace_file);
+		trace_wrote_event = true;
+	}
+	pthread_mutex_unlock(&trace_lock);
+	buffer->length = 0U;
+}
+
+static void trace_thread_exit(void *data)
+{
+	trace_buffer *buffer = data;
+	trace_flush(buffer);
+	free(buffer);
+}
+
+static trace_buffer *trace_local(void)
+{
+	if (local_buffer) {
+		return local_buffer;
+	}
+	trace_buffer *buffer = malloc(sizeof(*buffer));
+	if (!buffer) {
+		return nullptr;
+	}
+	buffer->length = 0U;
+	buffer->tid = gettid();
+	if (trace_key_ready) {
+		pthread_setspecific(trace_key, buffer);
+	}
+	local_buffer = buffer;
+	return buffer;
+}
+
+static void escape_detail(const char *detail, char *out, size_t size)
+{
+	size_t used = 0U;
+	for (; *detail && used + 7U < size; ++detail) {
+		const unsigned char ch = (unsigned char)*detail;
+		if (ch == '"' || ch == '\\') {
+			out[used++] = '\\';
+			out[used++] = (char)ch;
+		} else if (ch < 0x20U) {
+			used += (size_t)snprintf(out + used, size - used,
+						 "\\u%04x", ch);
+		} else {
+			out[used++] = (char)ch;
+		}
+	}
+	out[used] = '\0';
+}
+
+static void trace_append(trace_buffer *buffer, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void trace_append(trace_buffer *buffer, const char *format, ...)
+{
+	if (buffer->length + TRACE_EVENT_MAX > sizeof(buffer->data)) {
+		trace_flush(buffer);
+	}
+
+	va_list args;
+	va_start(args, format);
+	const int written =
+		vsnprintf(buffer->data + buffer->length,
+			  sizeof(buffer->data) - buffer->length, format, args);
+	va_end(args);
+	if (written > 0 && (size_t)written < TRACE_EVENT_MAX) {
+		buffer->length += (size_t)written;
+	}
+}
+
+static double trace_micros(uint64_t ns)
+{
+	return ns > trace_origin_ns ? (double)(ns - trace_origin_ns) / 1000.0
+				    : 0.0;
+}
+
+void utils_trace_emit_span(const utils_trace_span *span)
+{
+	const uint64_t end_ns = utils_trace_now();
+	trace_buffer *buffer = trace_local();
+	if (!buffer) {
+		return;
+	}
+
+	char detail[TRACE_DETAIL_MAX] = "";
+	if (span->detail) {
+		escape_detail(span->detail, detail, sizeof(detail));
+	}
+	trace_append(buffer,
+		     ",\n{\"name\":\"%s\",\"cat\":\"patchutils\",\"ph\":\"X\","
+		     "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d%s%s%s}",
+		     span->name, trace_micros(span->start_ns),
+		     (double)(end_ns - span->start_ns) / 1000.0, (int)trace_pid,
+		     (int)buffer->tid,
+		     span->detail ? ",\"args\":{\"detail\":\"" : "", detail,
+		     span->detail ? "\"}" : "");
+}
+
+void utils_trace_emit_counter(const char *name, int64_t value)
+{
+	trace_buffer *buffer = trace_local();
+	if (!buffer) {
+		return;
+	}
+
+	trace_append(buffer,
+		     ",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+		     "\"tid\":%d,\"args\":{\"value\":%lld}}",
+		     name, trace_micros(utils_trace_now()), (int)trace_pid,
+		     (int)buffer->tid, (long long)value);
+}
+
+bool utils_trace_start(void)
+{
+	if (utils_trace_enabled()) {
+		return true;
+	}
+
+	const char *path = getenv("PATCHUTILS_TRACE");
+	if (!path || !*path) {
+		return false;
+	}
+
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "Warning: unable to open trace file %s: %s\n",
+			path, strerror(errno));
+		return false;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	trace_file = file;
+	trace_wrote_event = false;
+	fputs("{\"traceEvents\":[\n", trace_file);
+	pthread_mutex_unlock(&trace_lock);
+
+	if (!trace_key_ready) {
+		trace_key_ready =
+			pthread_key_create(&trace_key, trace_thread_exit) == 0;
+		atexit(utils_trace_stop);
+	}
+	trace_origin_ns = utils_trace_now();
+	trace_pid = getpid();
+	atomic_store(&utils_trace_active, true);
+	return true;
+}
+
+void utils_trace_stop(void)
+{
+	if (!atomic_exchange(&utils_trace_active, false)) {
+		return;
+	}
+
+	// other threads have been joined by now; their buffers were flushed
+	// by the thread-exit destructor
+	trace_flush(local_buffer);
+
+	pthread_mutex_lock(&trace_lock);
+	fputs("\n],\"displayTimeUnit\":\"ms\"}\n", trace_file);
+	fclose(trace_file);
+	trace_file = nullptr;
+	pthread_mutex_unlock(&trace_lock);
+}
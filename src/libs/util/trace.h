@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Phase tracer writing Chrome trace-event JSON, viewable in Perfetto or
+// chrome://tracing. It is switched on by PATCHUTILS_TRACE=<file.json>;
+// while it is off every hook costs one relaxed load and a branch.
+
+typedef struct {
+	const char *name;   // must outlive the span
+	const char *detail; // optional, e.g. the path being diffed
+	uint64_t start_ns;  // 0 when tracing was off at the start
+} utils_trace_span;
+
+extern atomic_bool utils_trace_active;
+
+// Starts tracing when PATCHUTILS_TRACE names a file. The trace is closed
+// by utils_trace_stop(), which also runs at exit.
+bool utils_trace_start(void);
+void utils_trace_stop(void);
+
+uint64_t utils_trace_now(void);
+void utils_trace_emit_span(const utils_trace_span *span);
+void utils_trace_emit_counter(const char *name, int64_t value);
+
+static inline bool utils_trace_enabled(void)
+{
+	return atomic_load_explicit(&utils_trace_active, memory_order_relaxed);
+}
+
+static inline utils_trace_span utils_trace_begin(const char *name,
+						 const char *detail)
+{
+	return (utils_trace_span){
+		.name = name,
+		.detail = detail,
+		.start_ns = utils_trace_enabled() ? utils_trace_now() : 0U,
+	};
+}
+
+static inline void utils_trace_end(utils_trace_span *span)
+{
+	if (span->start_ns != 0U && utils_trace_enabled()) {
+		utils_trace_emit_span(span);
+	}
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Records the rest of the enclosing block as one span.
+#define TRACE_SCOPE_DETAIL(name, detail)                                    \
+	__attribute__((cleanup(utils_trace_end)))                          \
+	utils_trace_span TRACE_CONCAT(trace_span_, __LINE__) =             \
+		utils_trace_begin((name), (detail))
+
+#define TRACE_SCOPE(name) TRACE_SCOPE_DETAIL(name, nullptr)
+
+#define TRACE_COUNTER(name, value)                                          \
+	do {                                                               \
+		if (utils_trace_enabled()) {                               \
+			utils_trace_emit_counter((name), (int64_t)(value)); \
+		}                                                          \
+	} while (0)
@@ -1,6 +1,7 @@
 #include "util.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdckdint.h>
@@ -8,6 +9,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static bool grow_buffer(char **buffer, size_t *capacity, size_t required)
 {
@@ -24,7 +26,7 @@ static bool grow_buffer(char **buffer, size_t *capacity, size_t required)
 		new_capacity = doubled;
 	}
 
-	char *resized = realloc(*buffer, new_capacity);
+	char *resized = utils_realloc(*buffer, new_capacity);
 	if (!resized) {
 		return false;
 	}
@@ -60,6 +62,64 @@ bool utils_append_bytes(char **buffer, size_t *length, size_t *capacity,
 	return true;
 }
 
+bool utils_read_stream(FILE *input, char **out, size_t *out_length)
+{
+	if (!input || !out || !out_length) {
+		return false;
+	}
+
+	char *data = nullptr;
+	size_t length = 0U;
+	size_t capacity = 0U;
+	char chunk[1U << 16];
+	size_t got;
+	bool ok = true;
+	while (ok && (got = fread(chunk, 1, sizeof(chunk), input)) > 0) {
+		ok = utils_append_bytes(&data, &length, &capacity, chunk, got);
+	}
+	// an empty stream still yields a terminated buffer
+	if (ok && !data) {
+		ok = utils_append_bytes(&data, &length, &capacity, nullptr, 0U);
+	}
+	if (!ok || ferror(input)) {
+		utils_free(data);
+		return false;
+	}
+	*out = data;
+	*out_length = length;
+	return true;
+}
+
+size_t utils_line_length(const char *text, const char *end)
+{
+	const char *newline = memchr(text, '\n', (size_t)(end - text));
+	return newline ? (size_t)(newline - text) + 1U
+		       : (size_t)(end - text);
+}
+
+char *utils_buffer_stream(FILE *stream)
+{
+	char *buffer = utils_malloc(UTILS_WRITE_BUFFER_SIZE);
+	if (buffer) {
+		setvbuf(stream, buffer, _IOFBF, UTILS_WRITE_BUFFER_SIZE);
+	}
+	return buffer;
+}
+
+void utils_buffer_stdout(void)
+{
+	// plain malloc: the block outlives every accounted one, and a live
+	// block would stop tools swapping in an arena allocator
+	static char *buffer = nullptr;
+	if (buffer) {
+		return;
+	}
+	buffer = malloc(UTILS_WRITE_BUFFER_SIZE);
+	if (buffer) {
+		setvbuf(stdout, buffer, _IOFBF, UTILS_WRITE_BUFFER_SIZE);
+	}
+}
+
 bool utils_array_reserve(void **data, size_t *capacity, size_t min_elements,
 			 size_t element_size)
 {
@@ -85,7 +145,7 @@ bool utils_array_reserve(void **data, size_t *capacity, size_t min_elements,
 		return false;
 	}
 
-	void *resized = realloc(*data, bytes);
+	void *resized = utils_realloc(*data, bytes);
 	if (!resized) {
 		return false;
 	}
@@ -163,3 +223,239 @@ void utils_format_message(message_buf buf, const char *format, ...)
 		buf.buffer[buf.size - 1U] = '\0';
 	}
 }
+
+static bool copy_range_fallback(int in_fd, off_t offset, size_t length,
+				int out_fd)
+{
+	char chunk[64 * 1024];
+	while (length > 0U) {
+		const size_t want = length < sizeof(chunk) ? length
+							   : sizeof(chunk);
+		const ssize_t got = pread(in_fd, chunk, want, offset);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+
+		size_t done = 0U;
+		while (done < (size_t)got) {
+			const ssize_t put =
+				write(out_fd, chunk + done, (size_t)got - done);
+			if (put < 0 && errno == EINTR) {
+				continue;
+			}
+			if (put <= 0) {
+				return false;
+			}
+			done += (size_t)put;
+		}
+
+		offset += got;
+		length -= (size_t)got;
+	}
+	return true;
+}
+
+bool utils_copy_range(int in_fd, off_t offset, size_t length, int out_fd)
+{
+	if (in_fd < 0 || out_fd < 0) {
+		return false;
+	}
+
+	// let the kernel move the bytes (reflinks, server-side copies) and
+	// only bounce through userspace where copy_file_range() is refused
+	while (length > 0U) {
+		const ssize_t copied = copy_file_range(in_fd, &offset, out_fd,
+						       nullptr, length, 0U);
+		if (copied < 0 && errno == EINTR) {
+			continue;
+		}
+		if (copied < 0 &&
+		    (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+		     errno == EOPNOTSUPP || errno == EBADF)) {
+			return copy_range_fallback(in_fd, offset, length,
+						   out_fd);
+		}
+		if (copied <= 0) {
+			return false;
+		}
+		length -= (size_t)copied;
+	}
+	return true;
+}
+
+uint64_t utils_hash_bytes(const void *data, size_t length)
+{
+	// FNV-1a: cheap, and good enough for paths and section bodies
+	const unsigned char *bytes = data;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static size_t strmap_home(const char *key, size_t capacity)
+{
+	return (size_t)utils_hash_bytes(key, strlen(key)) & (capacity - 1U);
+}
+
+static size_t strmap_slot(char *const *keys, size_t capacity, const char *key)
+{
+	size_t slot = strmap_home(key, capacity);
+	while (keys[slot] && strcmp(keys[slot], key) != 0) {
+		slot = (slot + 1U) & (capacity - 1U);
+	}
+	return slot;
+}
+
+static bool strmap_grow(utils_strmap *map)
+{
+	const size_t capacity = map->capacity ? map->capacity * 2U : 16U;
+	char **keys = utils_calloc(capacity, sizeof(*keys));
+	void **values = utils_calloc(capacity, sizeof(*values));
+	if (!keys || !values) {
+		utils_free(keys);
+		utils_free(values);
+		return false;
+	}
+
+	for (size_t i = 0; i < map->capacity; ++i) {
+		if (!map->keys[i]) {
+			continue;
+		}
+		const size_t slot = strmap_slot(keys, capacity, map->keys[i]);
+		keys[slot] = map->keys[i];
+		values[slot] = map->values[i];
+	}
+
+	utils_free(map->keys);
+	utils_free(map->values);
+	map->keys = keys;
+	map->values = values;
+	map->capacity = capacity;
+	return true;
+}
+
+bool utils_strmap_put(utils_strmap *map, const char *key, void *value)
+{
+	if (!map || !key) {
+		return false;
+	}
+
+	// keep the load factor under 3/4 so probe chains stay short
+	if ((map->count + 1U) * 4U > map->capacity * 3U && !strmap_grow(map)) {
+		return false;
+	}
+
+	const size_t slot = strmap_slot(map->keys, map->capacity, key);
+	if (!map->keys[slot]) {
+		map->keys[slot] = utils_strdup(key);
+		if (!map->keys[slot]) {
+			return false;
+		}
+		++map->count;
+	}
+	map->values[slot] = value;
+	return true;
+}
+
+void *utils_strmap_get(const utils_strmap *map, const char *key)
+{
+	if (!map || !key || map->capacity == 0U) {
+		return nullptr;
+	}
+
+	const size_t slot = strmap_slot(map->keys, map->capacity, key);
+	return map->keys[slot] ? map->values[slot] : nullptr;
+}
+
+void *utils_strmap_get_or_add(utils_strmap *map, const char *key,
+			      size_t size, const char **out_key)
+{
+	if (!map || !key) {
+		return nullptr;
+	}
+
+	if (map->capacity > 0U) {
+		const size_t slot = strmap_slot(map->keys, map->capacity, key);
+		if (map->keys[slot]) {
+			if (out_key) {
+				*out_key = map->keys[slot];
+			}
+			return map->values[slot];
+		}
+	}
+
+	void *value = utils_calloc(1U, size);
+	if (!value || !utils_strmap_put(map, key, value)) {
+		utils_free(value);
+		return nullptr;
+	}
+	if (out_key) {
+		// the put may have grown the table, so look the slot up again
+		const size_t slot = strmap_slot(map->keys, map->capacity, key);
+		*out_key = map->keys[slot];
+	}
+	return value;
+}
+
+void *utils_strmap_remove(utils_strmap *map, const char *key)
+{
+	if (!map || !key || map->capacity == 0U) {
+		return nullptr;
+	}
+
+	const size_t mask = map->capacity - 1U;
+	size_t hole = strmap_slot(map->keys, map->capacity, key);
+	if (!map->keys[hole]) {
+		return nullptr;
+	}
+
+	void *value = map->values[hole];
+	utils_free(map->keys[hole]);
+	map->keys[hole] = nullptr;
+	--map->count;
+
+	// shift later members of the probe chain back so lookups never stop
+	// early at the slot we just emptied
+	for (size_t slot = (hole + 1U) & mask; map->keys[slot];
+	     slot = (slot + 1U) & mask) {
+		const size_t home = strmap_home(map->keys[slot], map->capacity);
+		const bool movable = hole <= slot
+					     ? (home <= hole || home > slot)
+					     : (home <= hole && home > slot);
+		if (movable) {
+			map->keys[hole] = map->keys[slot];
+			map->values[hole] = map->values[slot];
+			map->keys[slot] = nullptr;
+			map->values[slot] = nullptr;
+			hole = slot;
+		}
+	}
+
+	return value;
+}
+
+void utils_strmap_dispose(utils_strmap *map, void (*free_value)(void *))
+{
+	if (!map) {
+		return;
+	}
+
+	for (size_t i = 0; i < map->capacity; ++i) {
+		if (!map->keys[i]) {
+			continue;
+		}
+		utils_free(map->keys[i]);
+		if (free_value) {
+			free_value(map->values[i]);
+		}
+	}
+	utils_free(map->keys);
+	utils_free(map->values);
+	ZeroMemory(map);
+}
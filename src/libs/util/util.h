@@ -1,6 +1,10 @@
+#pragma once
+
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 typedef struct {
 	char *buffer;
@@ -19,9 +23,123 @@ void utils_format_message(message_buf buf, const char *format, ...);
 
 #define ZeroMemory(out) memset((out), 0, sizeof(typeof(*(out))))
 
+// Memory accounting. Allocations made by src/libs go through utils_malloc()
+// and friends, which charge every block to the subsystem tag of the calling
+// thread and hand the bytes out from a replaceable backing allocator.
+// Blocks must be released with utils_free(), never free().
+typedef enum {
+	UTILS_MEM_GENERAL,
+	UTILS_MEM_GIT,
+	UTILS_MEM_LIBGIT2,
+	UTILS_MEM_PATCH,
+	UTILS_MEM_UI,
+	UTILS_MEM_TAG_COUNT
+} utils_mem_tag;
+
+typedef struct {
+	size_t current;	    // bytes in live blocks
+	size_t peak;	    // high-water mark of |current|
+	size_t allocations; // blocks handed out so far
+} utils_mem_usage;
+
+typedef struct {
+	utils_mem_usage total;
+	utils_mem_usage tags[UTILS_MEM_TAG_COUNT];
+} utils_mem_stats;
+
+// Backing store behind the accounting layer. Blocks must be aligned for any
+// type; |reallocate| and |release| get the size the block was asked with.
+typedef struct {
+	void *(*allocate)(void *state, size_t size);
+	void *(*reallocate)(void *state, void *ptr, size_t old_size,
+			    size_t size);
+	void (*release)(void *state, void *ptr, size_t size);
+	void *state;
+} utils_allocator;
+
+void *utils_malloc(size_t size);
+void *utils_calloc(size_t count, size_t size);
+void *utils_realloc(void *ptr, size_t size);
+char *utils_strdup(const char *str);
+char *utils_strndup(const char *str, size_t length);
+void utils_free(void *ptr);
+// Charges a new block to |tag| regardless of the thread's current tag.
+void *utils_malloc_tagged(utils_mem_tag tag, size_t size);
+
+// Makes |tag| the thread's current tag and returns the previous one.
+utils_mem_tag utils_mem_enter(utils_mem_tag tag);
+void utils_mem_leave(const utils_mem_tag *previous);
+
+#define UTILS_CONCAT_(a, b) a##b
+#define UTILS_CONCAT(a, b) UTILS_CONCAT_(a, b)
+
+// Charges allocations made until the end of the block to |tag|.
+#define UTILS_MEM_SCOPE(tag)                                                \
+	__attribute__((cleanup(utils_mem_leave)))                          \
+	const utils_mem_tag UTILS_CONCAT(mem_scope_, __LINE__) =           \
+		utils_mem_enter(tag)
+
+// Swaps the backing allocator; refused while any block is live, which is
+// reported to stderr when PATCHUTILS_MEM_STATS is set. nullptr restores
+// malloc.
+bool utils_mem_set_allocator(const utils_allocator *allocator);
+void utils_mem_get_stats(utils_mem_stats *out);
+const char *utils_mem_tag_name(utils_mem_tag tag);
+// Writes the stats as one line of JSON.
+void utils_mem_report(FILE *out);
+// Reports to stderr at exit when PATCHUTILS_MEM_STATS is set.
+void utils_mem_report_at_exit(void);
+
+// Bump allocator for short-lived tools: blocks are carved from large chunks
+// and only the topmost one can shrink, grow in place or be given back.
+// Everything is returned at once by utils_arena_free(). Not thread-safe.
+typedef struct utils_arena utils_arena;
+
+utils_arena *utils_arena_new(size_t chunk_size);
+void utils_arena_free(utils_arena *arena);
+utils_allocator utils_arena_allocator(utils_arena *arena);
+// Bytes of chunk memory the arena holds.
+size_t utils_arena_reserved(const utils_arena *arena);
+
 bool utils_append_bytes(char **buffer, size_t *length, size_t *capacity,
 			const char *data, size_t count);
+// Reads |input| to the end into one NUL-terminated buffer.
+bool utils_read_stream(FILE *input, char **out, size_t *out_length);
+// Length of the line starting at |text|, newline included; the last line
+// may run to |end| without one.
+size_t utils_line_length(const char *text, const char *end);
+
+// Batch output goes through one large stdio buffer so pipes and slow disks
+// see few, big writes instead of one per line.
+#define UTILS_WRITE_BUFFER_SIZE (1U << 20)
+
+// Gives |stream| a UTILS_WRITE_BUFFER_SIZE buffer; call it before any I/O
+// on |stream|. Returns the buffer, or nullptr when none could be had, to be
+// freed once |stream| is closed.
+char *utils_buffer_stream(FILE *stream);
+// The same for stdout, which may use its buffer until exit, so the buffer
+// is never given back.
+void utils_buffer_stdout(void);
 bool utils_array_reserve(void **data, size_t *capacity, size_t min_elements,
 			 size_t element_size);
 const char *utils_parse_token(const char *input, char *buffer,
 			      size_t buffer_size);
+bool utils_copy_range(int in_fd, off_t offset, size_t length, int out_fd);
+
+typedef struct {
+	char **keys;
+	void **values;
+	size_t count;
+	size_t capacity;
+} utils_strmap;
+
+uint64_t utils_hash_bytes(const void *data, size_t length);
+bool utils_strmap_put(utils_strmap *map, const char *key, void *value);
+void *utils_strmap_get(const utils_strmap *map, const char *key);
+// Returns the value under |key|, first storing a zeroed block of |size|
+// bytes there when there is none. |out_key| gets the map's own copy of the
+// key, which lives as long as the entry.
+void *utils_strmap_get_or_add(utils_strmap *map, const char *key,
+			      size_t size, const char **out_key);
+void *utils_strmap_remove(utils_strmap *map, const char *key);
+void utils_strmap_dispose(utils_strmap *map, void (*free_value)(void *));